@@ -1,17 +1,249 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <memory>
 #include <regex>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
+// digests of the hash chain, files are only compared under one algorithm
+enum class hash_algo_t : uint32_t {
+  // XXH3-128 for every block
+  xxh128,
+  // XXH3-64 for the first 4 blocks, 4KiB with the default blk_sched_t,
+  // where most files differ and extra bits don't help, XXH3-128 after
+  xxh64_early,
+  // BLAKE3 truncated to 128 bits for every block, so crafted collisions
+  // are out of reach, a weaker digest at any level would undo that, only
+  // when built with blake3
+  blake3
+};
+
+/**
+ * @brief sizes of the blocks of the hash chain, files of a size are
+ * compared block by block and dropped at the first block that differs,
+ * block 0 is first_blk bytes, block i > 0 starts at
+ * first_blk * growth^(i - 1), so it is growth - 1 times all blocks before
+ * it, blocks stop growing at max_blk
+ */
+struct blk_sched_t {
+  uint64_t first_blk = 512;
+  // >= 2
+  uint32_t growth = 2;
+  // longest block, 0 for none, each block is a round of reads, a cap stops
+  // reading soon after files diverge at the cost of a round per max_blk,
+  // >= first_blk
+  uint64_t max_blk = 0;
+  // probe latency and bandwidth of the devices of the search dirs, then
+  // use the schedule of their class instead of the above
+  bool auto_calibrate = false;
+};
+
+/**
+ * @brief prefilter of large files, a few small samples at fixed points of
+ * the size are hashed into one digest before the sequential blocks, so
+ * files that share long headers, such as disk images or video containers,
+ * are told apart within a few KiB of reads each
+ */
+struct sample_opts_t {
+  // files smaller than this are not sampled, 0 disables sampling
+  uint64_t min_size = 0;
+  // bytes per sample
+  uint32_t len = 4096;
+  // sample offsets in per-mille of the size, aligned down to len, 1000 is
+  // the last len bytes
+  std::vector<uint32_t> points{1000, 250, 500, 750};
+};
+
+/**
+ * @brief size group jobs hashing at once per device, a group counts
+ * against the device of its files with the lowest limit, so a few jobs
+ * keep a spindle busy without seeking between files while idle threads
+ * take groups of other devices
+ */
+struct dev_limits_t {
+  // per disk that reports /sys/dev/block/<major:minor>/queue/rotational
+  uint32_t rotational = 2;
+  // per other device, including network and virtual filesystems without
+  // a block device, 0 for max_thread
+  uint32_t solid = 0;
+  // limits of the devices holding these paths, before the above
+  std::vector<std::pair<std::filesystem::path, uint32_t>> per_path;
+};
+
+/**
+ * @brief tuning options of dedupe
+ */
+struct options_t {
+  // maximum number of threads to use
+  uint32_t max_thread = 4;
+  // persistent hash cache, disabled if empty
+  std::filesystem::path cache_path;
+  // block reads in flight per thread through io_uring, <= 1 for blocking
+  // reads, ignored if built without io_uring
+  uint32_t io_depth = 32;
+  // hash early blocks of files while listing is still running, starting
+  // as soon as a second file of the same size is found, until the last
+  // directory is listed
+  bool pipeline = false;
+  // compare content of hash-equal groups byte by byte before reporting,
+  // every member is read once more in full
+  bool verify = false;
+  // issue block reads of each round in physical order from FIEMAP, for
+  // rotational disks
+  bool extent_order = false;
+  // sampling prefilter, disabled by default
+  sample_opts_t sample;
+  // digests of hash blocks, a cache written under another algorithm is
+  // ignored
+  hash_algo_t hash_algo = hash_algo_t::xxh128;
+  // hash block sizes, a cache written under another schedule is ignored
+  blk_sched_t blk_sched;
+  // hashing jobs per device
+  dev_limits_t dev_limits;
+  // bytes of memory for file records and files being hashed, 0 for no
+  // limit, past a third of it listed files are spilled to size-sorted runs
+  // in tmp_dir, which are merged back one size group at a time and hashed
+  // in batches of about half of it, a size group past half of it is
+  // skipped and counted in stats_t::oversized_cnt, pipeline is ignored with
+  // a limit
+  uint64_t mem_limit = 0;
+  // directory of spilled runs, the system temporary directory if empty
+  std::filesystem::path tmp_dir;
+  // patterns matched against full paths like exclude_regex, but compiled
+  // together, literal forms such as .*\.tmp or .*/node_modules skip the
+  // regex engine, invalid patterns throw std::regex_error
+  std::vector<std::string> exclude_pattern;
+};
+
+// phases of a search, in order, save only runs with a cache
+enum class phase_t { list, sort, hash, save };
+
+/**
+ * @brief counters of a search, collected per job and summed when jobs end,
+ * level i is hash block i of a file, with the default blk_sched_t covering
+ * [512 * 2^(i - 1), 512 * 2^i) except level 0 which is the first 512B,
+ * levels past max_lvl are counted in the last one
+ */
+struct stats_t {
+  static constexpr auto max_lvl = 64U;
+  static constexpr auto hist_cnt = 32U;
+
+  struct phase_time_t {
+    double wall_ms = 0;
+    // process cpu time, all threads
+    double cpu_ms = 0;
+  };
+  std::array<phase_time_t, 4> phase_time{};
+
+  // listing
+  uint64_t file_cnt = 0;
+  uint64_t dir_cnt = 0;
+  uint64_t excluded_cnt = 0;
+  // symlinks and unsupported file types
+  uint64_t skipped_cnt = 0;
+  // directories or files that can't be opened or stat-ed
+  uint64_t list_error_cnt = 0;
+  // most directories waiting in listing pool
+  uint64_t max_list_queue = 0;
+
+  // hashing, prehashed blocks included
+  std::array<uint64_t, max_lvl> blk_hashed{};
+  std::array<uint64_t, max_lvl> bytes_read{};
+  // files found unique after comparing level
+  std::array<uint64_t, max_lvl> eliminated{};
+  uint64_t files_opened = 0;
+  uint64_t read_error_cnt = 0;
+  uint64_t verify_split_cnt = 0;
+  // sampling prefilter, files found unique by samples and the bytes of
+  // them left unread, an upper bound of the saving as sequential blocks
+  // could have told them apart earlier
+  uint64_t sample_hashed = 0;
+  uint64_t sample_bytes_read = 0;
+  uint64_t sample_eliminated = 0;
+  uint64_t sample_bytes_skipped = 0;
+
+  // size groups
+  uint64_t group_cnt = 0;
+  uint64_t group_us_total = 0;
+  uint64_t group_us_max = 0;
+  // groups by latency, bucket i holds [2^(i - 1), 2^i) us
+  std::array<uint64_t, hist_cnt> group_us_hist{};
+  // most size groups waiting in hashing pool
+  uint64_t max_hash_queue = 0;
+  // files of size groups past half of mem_limit, left unhashed
+  uint64_t oversized_cnt = 0;
+
+  // results
+  uint64_t dupe_cnt = 0;
+  uint64_t linked_cnt = 0;
+
+  // add counters of rhs, maxima are kept
+  void merge(const stats_t &rhs) noexcept;
+};
+
+/**
+ * @brief receives results while dedupe is running, each group is delivered
+ * once its size group resolves, calls are serialized but made from worker
+ * threads, a slow sink holds back the workers
+ */
+class result_sink_t {
+ public:
+  virtual ~result_sink_t() = default;
+
+  /**
+   * @brief duplicate group found
+   *
+   * @param group duplicates, hard links included
+   */
+  virtual void on_dupe(std::vector<std::filesystem::path> &&group) = 0;
+
+  /**
+   * @brief hard links of one inode without other copies found
+   *
+   * @param group hard links
+   */
+  virtual void on_linked(std::vector<std::filesystem::path> &&group) {
+    (void)group;
+  }
+
+  /**
+   * @brief phase boundaries, called from the thread calling dedupe
+   *
+   * @param phase phase started or ended
+   */
+  virtual void on_phase_start(phase_t phase) { (void)phase; }
+  virtual void on_phase_end(phase_t phase) { (void)phase; }
+
+  /**
+   * @brief counters of the search, called once from the thread calling
+   * dedupe after all phases
+   *
+   * @param stats counters
+   */
+  virtual void on_stats(const stats_t &stats) { (void)stats; }
+};
+
+/**
+ * @brief whether this build can hash with algo
+ *
+ * @param algo hash algorithm
+ * @return false if algo needs a library the build left out
+ */
+bool hash_algo_supported(hash_algo_t algo) noexcept;
+
 /**
  * @brief detects duplicate files using file size and hash,
- * collisions are possible, and hard links are included.
+ * collisions are possible, hard links of a duplicate are included in its
+ * group, files whose only copies are hard links are not reported.
  *
  * @param search_dir directories to search
  * @param exclude_regex regular expression to exclude files or directories
@@ -23,6 +255,315 @@ std::vector<std::vector<std::filesystem::path>> dedupe(
     const std::vector<std::regex> &exclude_regex,
     const uint32_t max_thread = 4);
 
+/**
+ * @brief same as above, but reuses hashes of unchanged files from a
+ * persistent cache, files are identified by device, inode, size, mtime and
+ * ctime, cache is created if missing and updated after search.
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expression to exclude files or directories
+ * @param cache_path path of cache file
+ * @param max_thread maximum number of threads to use
+ * @return vector[vector[path]] list of duplicates
+ */
+std::vector<std::vector<std::filesystem::path>> dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex,
+    const std::filesystem::path &cache_path, const uint32_t max_thread = 4);
+
+/**
+ * @brief same as above, configured by options
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expression to exclude files or directories
+ * @param opts options
+ * @return vector[vector[path]] list of duplicates
+ */
+std::vector<std::vector<std::filesystem::path>> dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts);
+
+/**
+ * @brief same as above, also reports files that are already hard linked
+ * and have no other copies
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expression to exclude files or directories
+ * @param opts options
+ * @param[out] linked_list list of hard links to the same inode
+ * @return vector[vector[path]] list of duplicates
+ */
+std::vector<std::vector<std::filesystem::path>> dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts,
+    std::vector<std::vector<std::filesystem::path>> &linked_list);
+
+/**
+ * @brief same as above, but streams results to sink instead of collecting
+ * them, only groups of files being compared are held in memory
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expression to exclude files or directories
+ * @param opts options
+ * @param sink receiver of results
+ * @throw std::invalid_argument if opts.hash_algo is not supported
+ */
+void dedupe(const std::vector<std::filesystem::path> &search_dir,
+            const std::vector<std::regex> &exclude_regex,
+            const options_t &opts, result_sink_t &sink);
+
+// inclusive range of file sizes searched by one worker
+struct size_range_t {
+  uint64_t min = 0;
+  uint64_t max = UINT64_MAX;
+};
+
+/**
+ * @brief list search_dir into a table file sorted by size, the first step
+ * of a search split over processes or hosts, tables are merged by
+ * merge_tables
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expressions to exclude files or directories
+ * @param opts options, only max_thread and exclude_pattern are used
+ * @param table_path output table
+ * @throw std::runtime_error on write error
+ */
+void list_table(const std::vector<std::filesystem::path> &search_dir,
+                const std::vector<std::regex> &exclude_regex,
+                const options_t &opts,
+                const std::filesystem::path &table_path);
+
+/**
+ * @brief merge tables into one sorted by size and split its sizes into
+ * ranges of about the same work, device numbers of tables listed on
+ * another boot than the first table are tagged so their inodes stay apart
+ *
+ * @param tables tables written by list_table or merge_tables
+ * @param out_path merged table
+ * @param part_cnt number of ranges wanted, fewer are returned if there are
+ * fewer sizes to search
+ * @return ranges covering all sizes, in ascending order
+ * @throw std::runtime_error on read or write error, or invalid table
+ */
+std::vector<size_range_t> merge_tables(
+    const std::vector<std::filesystem::path> &tables,
+    const std::filesystem::path &out_path, uint32_t part_cnt);
+
+/**
+ * @brief search files of table in range, results of disjoint ranges of one
+ * table are disjoint, so partial results only need to be concatenated,
+ * paths are opened as listed and must be reachable from this process
+ *
+ * @param table_path table written by list_table or merge_tables
+ * @param range file sizes to search
+ * @param opts options, pipeline is ignored
+ * @param sink receiver of results
+ * @throw std::runtime_error on read error or invalid table
+ * @throw std::invalid_argument if opts.hash_algo is not supported
+ */
+void dedupe_table(const std::filesystem::path &table_path,
+                  const size_range_t &range, const options_t &opts,
+                  result_sink_t &sink);
+
+/**
+ * @brief keeps the duplicates of search_dir current, one full search is run
+ * on construction, then filesystem changes from fanotify, or inotify where
+ * fanotify isn't permitted, are applied to an in-memory size index and only
+ * size groups touched by them are searched again, hash chains of unchanged
+ * files are kept in memory and reused, along with opts.cache_path if set,
+ * which is written after the first search, then when enough chains are
+ * unsaved or a minute has passed, and on destruction
+ */
+class watcher_t {
+ public:
+  struct impl_t;
+
+  /**
+   * @brief search search_dir and start watching it
+   *
+   * @param search_dir directories to search
+   * @param exclude_regex regular expressions to exclude files or directories
+   * @param opts options, pipeline is ignored
+   * @throw std::system_error if neither fanotify nor inotify can be set up
+   * @throw std::invalid_argument if opts.hash_algo is not supported
+   */
+  watcher_t(const std::vector<std::filesystem::path> &search_dir,
+            const std::vector<std::regex> &exclude_regex,
+            const options_t &opts);
+  ~watcher_t();
+
+  watcher_t(const watcher_t &) = delete;
+  watcher_t(watcher_t &&) = delete;
+  watcher_t &operator=(const watcher_t &) = delete;
+  watcher_t &operator=(watcher_t &&) = delete;
+
+  /**
+   * @brief wait up to timeout for changes, apply all pending ones and search
+   * the size groups they touched again, call from one thread at a time
+   *
+   * @param timeout longest wait for the first change
+   * @return number of size groups searched again
+   */
+  uint64_t poll(std::chrono::milliseconds timeout);
+
+  /**
+   * @brief current duplicate groups, thread safe, may run alongside poll
+   *
+   * @return vector[vector[path]] duplicate groups, hard links included
+   */
+  std::vector<std::vector<std::filesystem::path>> dupes() const;
+
+ private:
+  std::unique_ptr<impl_t> _impl;
+};
+
+/**
+ * @brief options of chunk_dupes
+ */
+struct chunk_opts_t {
+  // maximum number of threads to use
+  uint32_t max_thread = 4;
+  // content-defined chunk sizes, avg_chunk is a power of 2,
+  // 64 <= min_chunk <= avg_chunk <= max_chunk <= 16MiB, index memory is
+  // inversely proportional to avg_chunk
+  uint32_t min_chunk = 2048;
+  uint32_t avg_chunk = 8192;
+  uint32_t max_chunk = 65536;
+  // pairs sharing fewer bytes are not reported
+  uint64_t min_shared = 1;
+  // a chunk in n files adds to n * (n - 1) / 2 pairs, chunks in more files
+  // than this, typically runs of zeros, are left out of pair totals
+  uint32_t max_pair_fanout = 64;
+  // report every chunk found more than once through on_chunk
+  bool chunk_map = false;
+  // same as options_t::exclude_pattern
+  std::vector<std::string> exclude_pattern;
+};
+
+// two files with chunks in common
+struct shared_pair_t {
+  std::filesystem::path lhs;
+  std::filesystem::path rhs;
+  uint64_t lhs_size = 0;
+  uint64_t rhs_size = 0;
+  // length of common chunks, a chunk found a times in lhs and b times in rhs
+  // counts min(a, b) times
+  uint64_t shared = 0;
+};
+
+// place of a chunk
+struct chunk_loc_t {
+  std::filesystem::path path;
+  uint64_t off = 0;
+};
+
+/**
+ * @brief receives results of chunk_dupes, calls are serialized
+ */
+class chunk_sink_t {
+ public:
+  virtual ~chunk_sink_t() = default;
+
+  /**
+   * @brief files sharing chunks, called after all files are chunked, in
+   * descending order of shared bytes
+   *
+   * @param pair files and bytes in common
+   */
+  virtual void on_pair(shared_pair_t &&pair) = 0;
+
+  /**
+   * @brief chunk found more than once, only with chunk_opts_t::chunk_map,
+   * called from worker threads before pairs
+   *
+   * @param len chunk length
+   * @param locs places of the chunk, in file order
+   */
+  virtual void on_chunk(uint32_t len, std::vector<chunk_loc_t> &&locs) {
+    (void)len;
+    (void)locs;
+  }
+};
+
+/**
+ * @brief find content shared by files of any size, such as appended logs or
+ * edited images, files are split into content-defined chunks, a rolling
+ * hash picks cut points so an insert only changes the chunks around it,
+ * chunks are indexed by XXH3 digest and common chunks are summed per pair
+ * of files, hard links of one inode are chunked once, the index is held in
+ * memory, about 100 bytes per distinct chunk, 12GiB per TiB scanned with
+ * the default avg_chunk
+ *
+ * @param search_dir directories to search
+ * @param exclude_regex regular expressions to exclude files or directories
+ * @param opts options
+ * @param sink receiver of pairs and chunks
+ * @throw std::invalid_argument on invalid chunk sizes
+ * @throw std::length_error if more than UINT32_MAX files are listed
+ */
+void chunk_dupes(const std::vector<std::filesystem::path> &search_dir,
+                 const std::vector<std::regex> &exclude_regex,
+                 const chunk_opts_t &opts, chunk_sink_t &sink);
+
+// how duplicates are replaced
+enum class link_mode_t {
+  // share extents with FIDEDUPERANGE, or FICLONE where only cloning works
+  reflink,
+  // hard link to keeper
+  hardlink,
+  // reflink, hard link where the filesystem can't share extents
+  reflink_or_hardlink
+};
+
+// which member of a group is kept
+enum class keeper_t {
+  // earliest birth time, modification time if unknown
+  oldest,
+  shortest_path,
+  // first member under preferred_dir, oldest if none
+  preferred
+};
+
+/**
+ * @brief options of link_dupes
+ */
+struct link_opts_t {
+  link_mode_t mode = link_mode_t::reflink;
+  keeper_t keeper = keeper_t::oldest;
+  std::filesystem::path preferred_dir;
+  // compare content with keeper before replacing by hard link or clone,
+  // FIDEDUPERANGE is always checked by the kernel
+  bool verify = true;
+  // maximum number of threads to use
+  uint32_t max_thread = 4;
+};
+
+// outcome of link_dupes
+struct link_result_t {
+  // duplicates replaced
+  uint64_t linked_cnt = 0;
+  // duplicates already hard linked to keeper
+  uint64_t skipped_cnt = 0;
+  uint64_t failed_cnt = 0;
+  // size of duplicates replaced
+  uint64_t byte_cnt = 0;
+};
+
+/**
+ * @brief replace duplicates by links to the keeper of their group, groups
+ * run in parallel, hard links and clones are created under a temporary
+ * name beside the duplicate and renamed over it, so a failure leaves the
+ * duplicate untouched, hard linked duplicates take owner and mode of keeper
+ *
+ * @param groups groups of identical files, as reported by dedupe
+ * @param opts options
+ * @return counts of replaced, skipped and failed files
+ */
+link_result_t link_dupes(
+    const std::vector<std::vector<std::filesystem::path>> &groups,
+    const link_opts_t &opts);
+
 /**
  * @brief remove files
  *
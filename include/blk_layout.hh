@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+
+#include "config.hh"
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief offsets of hash blocks under a blk_sched_t, hash block i covers
+ * [off(i), off(i) + len(i)) of a file, geometric up to the cap level,
+ * max_blk apart after it
+ */
+class blk_layout_t {
+  uint64_t _first = hash_blk_sz;
+  uint64_t _growth = 2;
+  // first level of length max_blk, offset of it
+  uint32_t _cap_lvl = UINT32_MAX;
+  uint64_t _cap_off = 0;
+  uint64_t _max_blk = 0;
+
+  // first * growth^(idx - 1) for idx < _cap_lvl, saturated
+  inline uint64_t geo_off(const uint32_t idx) const noexcept {
+    auto off = _first;
+    for (auto i = 1U; i < idx && off != UINT64_MAX; ++i) {
+      off = off > UINT64_MAX / _growth ? UINT64_MAX : off * _growth;
+    }
+    return off;
+  }
+
+ public:
+  blk_layout_t() noexcept = default;
+  // sched must be valid, see check_blk_sched
+  explicit blk_layout_t(const blk_sched_t &sched) noexcept;
+
+  inline uint64_t off(const uint32_t idx) const noexcept {
+    if (idx == 0U) {
+      return 0;
+    }
+    if (idx < _cap_lvl) {
+      return geo_off(idx);
+    }
+    return _cap_off + (idx - _cap_lvl) * _max_blk;
+  }
+  inline uint64_t len(const uint32_t idx) const noexcept {
+    if (idx == 0U) {
+      return _first;
+    }
+    if (idx < _cap_lvl) {
+      const auto off = geo_off(idx);
+      return off > UINT64_MAX / _growth ? UINT64_MAX : off * (_growth - 1);
+    }
+    return _max_blk;
+  }
+  // number of blocks of a file of size bytes, at least 1
+  uint32_t blk_cnt(uint64_t size) const noexcept;
+};
+
+/**
+ * @brief check schedule before a search
+ *
+ * @param sched block schedule
+ * @throw std::invalid_argument if first_blk is 0, growth is not in
+ * [2, 1024] or max_blk is neither 0 nor >= max(first_blk, 1MiB)
+ */
+void check_blk_sched(const blk_sched_t &sched);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "file_cmp.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief hash block idx of every valid file that lacks it,
+ * with io_uring up to io_depth reads are kept in flight across files and
+ * each completion is hashed as it arrives, otherwise files are read one by
+ * one with file_cmp_t::hash_blk, with extent_order reads are issued sorted by
+ * device and physical offset of the block from FIEMAP, so rotational disks
+ * sweep instead of seeking, sparse files are always read one by one so
+ * their holes are skipped
+ *
+ * @param files files of the same size
+ * @param idx hash block index
+ * @param io_depth reads in flight, <= 1 for blocking reads
+ * @param extent_order order reads by physical offset
+ */
+void hash_blk_batch(std::span<file_cmp_t> files, uint32_t idx,
+                    uint32_t io_depth, bool extent_order);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
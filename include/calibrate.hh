@@ -0,0 +1,32 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief block schedule of a search, files of a size must share block
+ * boundaries, so with auto_calibrate the roots are probed and the class of
+ * the slowest round trip wins, unless a cache was written under a schedule
+ * already, which is kept so its chains stay usable
+ *
+ * @param sched requested schedule
+ * @param roots search roots
+ * @param cache_path cache of the search, empty for none
+ * @param hash_algo hash algorithm of the search
+ * @return sched, the schedule of the cache or of the probed device class
+ * @throw std::invalid_argument if sched is invalid, see check_blk_sched
+ */
+blk_sched_t pick_blk_sched(const blk_sched_t &sched,
+                           const std::vector<std::filesystem::path> &roots,
+                           const std::filesystem::path &cache_path,
+                           hash_algo_t hash_algo);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief source of changed paths for watcher_t, a path is reported when an
+ * entry is created, written, moved in or out, deleted or has its attributes
+ * changed, attribute changes of directories are left out, directories
+ * moved in are reported once, not file by file
+ */
+class change_src_t {
+ public:
+  virtual ~change_src_t() = default;
+
+  /**
+   * @brief watch directory, only needed by sources that watch directories
+   * one by one, a directory moved elsewhere is watched under its new path
+   * once added again
+   *
+   * @param path directory path
+   */
+  virtual void add_dir(const std::string &path) = 0;
+
+  /**
+   * @brief wait up to timeout_ms for changes, then take all pending ones,
+   * if changes were lost the roots are reported so they are scanned again
+   *
+   * @param timeout_ms longest wait, 0 to not wait
+   * @param[out] changed changed paths are appended, in no particular order
+   * @return false if the source failed
+   */
+  virtual bool wait(int timeout_ms, std::vector<std::string> &changed) = 0;
+};
+
+/**
+ * @brief watch roots with fanotify marks on their filesystems, which needs
+ * CAP_SYS_ADMIN and Linux >= 5.9, inotify otherwise
+ *
+ * @param roots absolute paths of search roots
+ * @return change source
+ * @throw std::system_error if neither can be set up
+ */
+std::unique_ptr<change_src_t> make_change_src(
+    const std::vector<std::string> &roots);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <xxhash.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// a chunk at off of file, file is its index in the file table
+struct chunk_ref_t {
+  uint32_t file;
+  uint32_t len;
+  uint64_t off;
+};
+
+/**
+ * @brief places of every chunk by digest, sharded by digest so threads
+ * chunking different files rarely wait on each other
+ */
+class chunk_index_t {
+ public:
+  static constexpr auto shard_cnt = 64UL;
+  // estimated bytes per distinct chunk: map node, digest, bucket slot and
+  // the allocation of its ref vector, each repeat adds a chunk_ref_t
+  static constexpr auto chunk_mem = 100UL;
+
+ private:
+  struct digest_hash_t {
+    inline std::size_t operator()(const XXH128_hash_t &hash) const noexcept {
+      return hash.low64;
+    }
+  };
+  struct digest_eq_t {
+    inline bool operator()(const XXH128_hash_t &lhs,
+                           const XXH128_hash_t &rhs) const noexcept {
+      return lhs.low64 == rhs.low64 && lhs.high64 == rhs.high64;
+    }
+  };
+  struct shard_t {
+    std::mutex mtx;
+    std::unordered_map<XXH128_hash_t, std::vector<chunk_ref_t>, digest_hash_t,
+                       digest_eq_t>
+        refs;
+  };
+
+  std::array<shard_t, shard_cnt> _shards;
+
+  static inline std::size_t shard_of(const XXH128_hash_t &hash) noexcept {
+    return hash.high64 % shard_cnt;
+  }
+
+ public:
+  /**
+   * @brief add chunks of one file, each shard is locked once, thread safe
+   *
+   * @param chunks digest and place of chunks, reordered
+   */
+  void add(std::span<std::pair<XXH128_hash_t, chunk_ref_t>> chunks);
+
+  /**
+   * @brief visit chunks of a shard, not thread safe against add
+   *
+   * @param shard shard index, < shard_cnt
+   * @param fn called with (digest, span[chunk_ref_t]) of every digest
+   */
+  template <typename Fn>
+  void visit(const std::size_t shard, Fn &&fn) const {
+    for (const auto &[hash, refs] : _shards[shard].refs) {
+      fn(hash, std::span<const chunk_ref_t>(refs));
+    }
+  }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
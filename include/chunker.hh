@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief content-defined chunking in the style of FastCDC, a gear hash rolls
+ * over the data and a chunk ends where its top bits are zero, bytes before
+ * min_sz are skipped and a harder mask is used before avg_sz, an easier one
+ * after, so chunk sizes cluster around avg_sz, cut points only depend on the
+ * last 64 bytes, so an insert or append moves at most a few of them
+ */
+class chunker_t {
+  uint64_t _min_sz;
+  uint64_t _avg_sz;
+  uint64_t _max_sz;
+  uint64_t _mask_s;
+  uint64_t _mask_l;
+
+ public:
+  /**
+   * @brief setup chunk sizes
+   *
+   * @param min_sz smallest chunk, except the last of a file
+   * @param avg_sz normal chunk size, power of 2
+   * @param max_sz largest chunk
+   * @throw std::invalid_argument unless
+   * 64 <= min_sz <= avg_sz <= max_sz <= buf_sz and avg_sz is a power of 2
+   */
+  chunker_t(uint64_t min_sz, uint64_t avg_sz, uint64_t max_sz);
+
+  /**
+   * @brief length of the chunk starting at data
+   *
+   * @param data bytes from the start of the chunk
+   * @param len bytes available, at least max_sz unless data runs to eof
+   * @return chunk length, <= min(len, max_sz)
+   */
+  uint64_t cut(const unsigned char *data, uint64_t len) const noexcept;
+
+  inline uint64_t max_sz() const noexcept { return _max_sz; }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -4,11 +4,40 @@
 
 namespace dedupe {
 
-// 512B
+// 512B, block 0 of the default blk_sched_t
 constexpr auto hash_blk_sz = 512UL;
 // 16MiB
 constexpr auto buf_sz = 16UL * 1024UL * 1024UL;
 
+// directories waiting in listing pool, past it subdirectories are listed
+// by the job that found them, bounds the paths held by queued jobs and the
+// parent fds they open relative to, lowered to a quarter of RLIMIT_NOFILE
+constexpr auto ls_queue_max = 256U;
+
+// saves a cache record is kept through without being looked up
+constexpr auto cache_max_age = 16U;
+// the watcher writes merged chains once this many are unsaved, or after
+// cache_flush_sec since its last write
+constexpr auto cache_flush_cnt = 4096UL;
+constexpr auto cache_flush_sec = 60L;
+
+// blocks hashed while listing in pipelined mode, first 4KiB by default
+constexpr auto prehash_lvl = 4U;
+
+// 16MiB, least bytes left to read of a bucket handed off to an idle thread
+constexpr auto split_min_bytes = 16UL * 1024UL * 1024UL;
+
+// runs merged at once under a memory limit, each holds a read buffer
+constexpr auto spill_fan_in = 64U;
+// 64KiB, read and write buffer of a spilled run
+constexpr auto spill_buf_sz = 64UL * 1024UL;
+
+// 1MiB, read size of byte-exact verification
+constexpr auto verify_blk_sz = 1UL << 20;
+
 constexpr auto hash_seed = 0x178ee47c0190226cUL;
 
+// levels with 64-bit digests under hash_algo_t::xxh64_early
+constexpr auto short_hash_lvl = 4U;
+
 }  // namespace dedupe
\ No newline at end of file
@@ -3,25 +3,132 @@
 #include <filesystem>
 #include <mutex>
 #include <span>
+#include <utility>
 #include <vector>
 
+#include "dedupe.hh"
+#include "dev_sched.hh"
+#include "file_cmp.hh"
 #include "file_entry.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
+#include "prehash.hh"
+#include "stats.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
+// serializes results of dedupe_same_sz jobs to sink and counts them
+class result_out_t {
+  result_sink_t &_sink;
+  std::mutex _mtx;
+  uint64_t _dupe_cnt = 0;
+  uint64_t _linked_cnt = 0;
+
+ public:
+  explicit result_out_t(result_sink_t &sink) noexcept : _sink(sink) {}
+
+  inline void dupe(std::vector<std::filesystem::path> &&group) {
+    std::lock_guard lk(_mtx);
+    ++_dupe_cnt;
+    _sink.on_dupe(std::move(group));
+  }
+  inline void linked(std::vector<std::filesystem::path> &&group) {
+    std::lock_guard lk(_mtx);
+    ++_linked_cnt;
+    _sink.on_linked(std::move(group));
+  }
+  inline uint64_t dupe_cnt() const noexcept { return _dupe_cnt; }
+  inline uint64_t linked_cnt() const noexcept { return _linked_cnt; }
+};
+
+// settings shared by all dedupe_same_sz jobs of a search
+struct same_sz_ctx_t {
+  // hash cache, nullable
+  hash_cache_t *cache = nullptr;
+  // reads in flight per thread, <= 1 for blocking reads
+  uint32_t io_depth = 0;
+  // early hashes from pipelined listing, nullable
+  const prehash_t *prehash = nullptr;
+  // confirm groups byte by byte
+  bool verify = false;
+  // order block reads by physical offset
+  bool extent_order = false;
+  // sampling prefilter of large files
+  sample_opts_t sample;
+  // digests of hash blocks
+  hash_algo_t hash_algo = hash_algo_t::xxh128;
+  // hash block sizes
+  blk_layout_t layout;
+  // jobs at once per device
+  dev_limits_t dev_limits;
+  // scheduler running the jobs, buckets of large groups are handed off to
+  // idle threads through it, nullable
+  dev_sched_t *sched = nullptr;
+  // counters of the search, nullable
+  stats_sum_t *stats = nullptr;
+};
+
 /**
  * @brief detects duplicate files of the same size using hash,
- * collisions are possible, and hard links are included.
+ * collisions are possible unless ctx.verify is set, hard links are hashed
+ * once per inode and included in the group of their content.
  *
- * @param file_list files to search
- * @param[out] dupe_list list of duplicates
- * @param mtx mutex for protecting dupe_list
+ * @param file_list files to search, reordered
+ * @param table file table of file_list
+ * @param[out] out receiver of duplicates and hard links without other copies,
+ * groups are delivered as soon as they are confirmed
+ * @param ctx search settings
  */
 void dedupe_same_sz(std::span<file_entry_t> file_list,
-                    std::vector<std::vector<std::filesystem::path>> &dupe_list,
-                    std::mutex &mtx);
+                    const file_table_t &table, result_out_t &out,
+                    const same_sz_ctx_t &ctx);
+
+/**
+ * @brief estimate bytes dedupe_same_sz reads for files, size times the
+ * number of files not told apart by a cached or prehashed first block
+ *
+ * @param files files of one size, not empty
+ * @param ctx search settings
+ * @return estimated cost
+ */
+uint64_t group_cost(std::span<const file_entry_t> files,
+                    const same_sz_ctx_t &ctx);
+
+/**
+ * @brief run dedupe_same_sz on every size with more than one file, most
+ * expensive first, at most max_thread at once and ctx.dev_limits per
+ * device, returns when all are done
+ *
+ * @param file_list files sorted by size
+ * @param table file table of file_list
+ * @param[out] out receiver of results
+ * @param ctx search settings
+ * @param max_thread pool size
+ * @return number of size groups searched
+ */
+uint64_t dedupe_sorted(std::span<file_entry_t> file_list,
+                       const file_table_t &table, result_out_t &out,
+                       const same_sz_ctx_t &ctx, uint32_t max_thread);
+
+/**
+ * @brief run dedupe_same_sz on tables of one size group each, like
+ * dedupe_sorted
+ *
+ * @param tables tables of one size each, more than one file
+ * @param[out] out receiver of results
+ * @param ctx search settings
+ * @param max_thread pool size
+ */
+void dedupe_groups(std::span<file_table_t> tables, result_out_t &out,
+                   const same_sz_ctx_t &ctx, uint32_t max_thread);
+
+// estimated peak bytes of dedupe_same_sz on a table of one size group
+inline uint64_t group_mem(const file_table_t &table) noexcept {
+  // every file gets a comparer holding its full path
+  return 2 * table.mem() + table.files().size() * sizeof(file_cmp_t);
+}
 
 }  // namespace detail_v1_0_0
 
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dedupe.hh"
+#include "file_entry.hh"
+#include "stats.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief runs size group jobs with per-device concurrency limits, jobs are
+ * queued per device by estimated cost and every thread takes the most
+ * expensive job of any device below its limit, so long groups start first
+ * and one slow device doesn't hold all threads, running jobs may queue
+ * parts of their work for idle threads
+ */
+class dev_sched_t {
+  // (cost, job), max-heap by cost
+  using queued_t = std::pair<uint64_t, std::function<void()>>;
+
+  struct dev_t {
+    uint64_t dev;
+    uint32_t limit;
+    uint32_t running = 0;
+    std::vector<queued_t> jobs;
+  };
+
+  uint32_t _max_thread;
+  uint32_t _rotational;
+  uint32_t _solid;
+  // limits of devices named by dev_limits_t::per_path
+  std::unordered_map<uint64_t, uint32_t> _per_dev;
+  std::vector<dev_t> _devs;
+  std::unordered_map<uint64_t, uint32_t> _dev_idx;
+  uint64_t _pending = 0;
+  uint64_t _running = 0;
+  // threads waiting for a job
+  uint64_t _idle = 0;
+  queue_gauge_t *_gauge;
+  mutable std::mutex _mtx;
+  std::condition_variable _cv;
+
+  // index of dev, its limit is looked up on first use, _mtx held
+  uint32_t dev_idx(uint64_t dev);
+  // job to run next, empty once all jobs are done
+  std::function<void()> take(uint32_t &idx);
+  void work();
+
+ public:
+  /**
+   * @param limits limits by device class and path, paths that can't be
+   * stat-ed are skipped with a warning
+   * @param max_thread threads of run
+   * @param gauge queue depth of jobs, nullable
+   */
+  dev_sched_t(const dev_limits_t &limits, uint32_t max_thread,
+              queue_gauge_t *gauge);
+
+  /**
+   * @brief device of files with the lowest limit, thread safe
+   *
+   * @param files files of a job, not empty
+   * @return device index for post
+   */
+  uint32_t dev_of(std::span<const file_entry_t> files);
+
+  /**
+   * @brief queue job, thread safe, also from running jobs
+   *
+   * @param dev device index from dev_of
+   * @param cost estimated bytes to read, more expensive jobs run first
+   * @param job job
+   */
+  void post(uint32_t dev, uint64_t cost, std::function<void()> job);
+
+  // queue job for the device of files, thread safe
+  inline void post(std::span<const file_entry_t> files, const uint64_t cost,
+                   std::function<void()> job) {
+    post(dev_of(files), cost, std::move(job));
+  }
+
+  // more threads wait than jobs are queued, thread safe
+  bool hungry() const;
+
+  // run queued jobs and the jobs they queue on up to max_thread threads,
+  // returns when all are done
+  void run();
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief exclude patterns compiled together, patterns keep std::regex_match
+ * semantics against the full path, literal forms are matched without regex:
+ * "lit" exact path, "lit.*" prefix, ".*lit" suffix, ".*lit.*" substring,
+ * ".*\.ext" and ".*\/name" hashed on the entry name, other patterns share
+ * one combined regex
+ */
+class exclude_t {
+  struct str_hash_t {
+    using is_transparent = void;
+    inline std::size_t operator()(const std::string_view str) const noexcept {
+      return std::hash<std::string_view>{}(str);
+    }
+  };
+  using str_set_t =
+      std::unordered_set<std::string, str_hash_t, std::equal_to<>>;
+
+  str_set_t _exact;
+  str_set_t _names;
+  str_set_t _exts;
+  std::vector<std::string> _prefixes;
+  std::vector<std::string> _suffixes;
+  std::vector<std::string> _contains;
+  std::optional<std::regex> _combined;
+  // patterns with back references can't be combined
+  std::vector<std::regex> _single;
+  // opaque regexes from callers, and every pattern compiled alone for paths
+  // with line breaks, which ".*" doesn't match
+  std::vector<std::regex> _opaque;
+  std::vector<std::regex> _all;
+
+ public:
+  exclude_t() = default;
+
+  /**
+   * @brief compile patterns
+   *
+   * @param patterns ECMAScript patterns matched against the full path
+   * @param regexes compiled regexes, matched one by one
+   * @throw std::regex_error on invalid pattern
+   */
+  exclude_t(const std::vector<std::string> &patterns,
+            const std::vector<std::regex> &regexes);
+
+  bool empty() const noexcept;
+
+  // true if any pattern matches path
+  bool match(std::string_view path) const;
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
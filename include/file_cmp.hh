@@ -2,59 +2,88 @@
 
 #include <xxhash.h>
 
-#include <bit>
-#include <compare>
+#include <algorithm>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
+#include <span>
 #include <vector>
 
+#include "blk_layout.hh"
+#include "config.hh"
+#include "dedupe.hh"
 #include "file_entry.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
+#include "prehash.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
-// tools for calculating max_hash
-
-inline constexpr auto log2_ceil(const auto x) noexcept {
-  auto next_pow2 = std::bit_ceil(x);
-  return std::countr_zero(next_pow2);
+inline constexpr bool hash_eq(const XXH128_hash_t &lhs,
+                              const XXH128_hash_t &rhs) noexcept {
+  return lhs.high64 == rhs.high64 && lhs.low64 == rhs.low64;
 }
 
-inline constexpr auto div_ceil(const auto x, const auto y) noexcept {
-  return (x + y - 1) / y;
+inline constexpr bool hash_lt(const XXH128_hash_t &lhs,
+                              const XXH128_hash_t &rhs) noexcept {
+  return lhs.high64 != rhs.high64 ? lhs.high64 < rhs.high64
+                                  : lhs.low64 < rhs.low64;
 }
 
+/**
+ * @brief offsets of the samples of a file, sorted and distinct
+ *
+ * @param opts sample schedule
+ * @param size file size
+ * @return sample offsets, empty if the file is not sampled
+ */
+std::vector<uint64_t> sample_offsets(const sample_opts_t &opts, uint64_t size);
+
+/**
+ * @brief hash state of a file, block hashes are computed one level at a time
+ * by the refinement rounds in dedupe_same_sz
+ */
 class file_cmp_t {
-  // using mutable to allow lazy hashing during comparison
-
   file_entry_t _file_entry;
-  mutable std::vector<XXH128_hash_t> _file_hashes;
-  mutable uint64_t _remain_sz;
-  mutable std::ifstream _file_stream;
-  uint64_t _hard_link_cnt;
+  // built from file table, only for candidates
+  std::filesystem::path _path;
+  std::vector<XXH128_hash_t> _file_hashes;
+  XXH128_hash_t _sample_hash{};
+  // hard links of the same inode, hashed once through this file
+  std::vector<std::filesystem::path> _links;
+  cache_key_t _cache_key;
+  const blk_layout_t *_layout;
   uint32_t _max_hash;
+  hash_algo_t _hash_algo;
+  uint32_t _cached_cnt = 0;
+  bool _cacheable = false;
+  bool _valid = true;
 
   /**
-   * @brief lazy hash file content
+   * @brief build cache key from listing stat, then prefill hashes from
+   * cache or pipelined hashing, whichever has more
    *
-   * @param idx hash block index
+   * @param cache hash cache, nullable
+   * @param prehash early hashes from listing, nullable
    */
-  void lazy_hash(uint32_t idx) const;
-  void open_file() const noexcept;
-  void close_file() const noexcept;
+  void init(const hash_cache_t *cache, const prehash_t *prehash) noexcept;
 
  public:
   file_cmp_t() = delete;
-  template <typename Tp>
-  inline file_cmp_t(Tp &&file_entry, uint32_t max_hash)
-      : _file_entry(std::forward<Tp>(file_entry)),
-        _remain_sz(_file_entry.size()),
-        _max_hash(max_hash) {
+  // layout must outlive file_cmp_t
+  inline file_cmp_t(const file_entry_t &file_entry, const file_table_t &table,
+                    const blk_layout_t &layout,
+                    const hash_cache_t *cache = nullptr,
+                    const prehash_t *prehash = nullptr,
+                    hash_algo_t hash_algo = hash_algo_t::xxh128)
+      : _file_entry(file_entry),
+        _path(table.path(file_entry)),
+        _layout(&layout),
+        _max_hash(layout.blk_cnt(file_entry.size())),
+        _hash_algo(hash_algo) {
     _file_hashes.reserve(_max_hash);
-    _hard_link_cnt = std::filesystem::hard_link_count(_file_entry.path());
-    _file_stream.rdbuf()->pubsetbuf(nullptr, 0);
+    init(cache, prehash);
   }
 
   file_cmp_t(const file_cmp_t &) = delete;
@@ -62,18 +91,79 @@ class file_cmp_t {
   file_cmp_t &operator=(const file_cmp_t &) = delete;
   file_cmp_t &operator=(file_cmp_t &&) = default;
 
-  std::strong_ordering operator<=>(const file_cmp_t &rhs) const;
-  inline bool operator==(const file_cmp_t &rhs) const {
-    return (*this <=> rhs) == std::strong_ordering::equal;
+  /**
+   * @brief hash block idx, all previous blocks must be hashed,
+   * opens and closes file once, no-op if hash is known, holes of sparse
+   * files are found with SEEK_DATA/SEEK_HOLE and hashed as zeros unread
+   *
+   * @param idx hash block index
+   * @return false on read error, file is invalidated
+   */
+  bool hash_blk(uint32_t idx);
+
+  /**
+   * @brief hash samples of len bytes at offs into one digest, opens and
+   * closes file once, holes are read as zeros
+   *
+   * @param offs sample offsets, off + len <= size
+   * @param len sample length
+   * @return false on read error, file is invalidated
+   */
+  bool hash_samples(std::span<const uint64_t> offs, uint32_t len);
+
+  /**
+   * @brief append hash of next block computed elsewhere
+   *
+   * @param hash hash of block hash_cnt()
+   */
+  inline void add_hash(const XXH128_hash_t &hash) {
+    _file_hashes.emplace_back(hash);
   }
+  // report read error and exclude file from further rounds
+  void set_invalid() noexcept;
 
-  inline std::filesystem::path &path() noexcept { return _file_entry.path(); }
-  inline const std::filesystem::path &path() const noexcept {
-    return _file_entry.path();
+  inline const XXH128_hash_t &hash(const uint32_t idx) const noexcept {
+    return _file_hashes[idx];
+  }
+  inline const XXH128_hash_t &sample_hash() const noexcept {
+    return _sample_hash;
+  }
+  inline uint32_t hash_cnt() const noexcept {
+    return (uint32_t)_file_hashes.size();
   }
+  inline uint32_t max_hash() const noexcept { return _max_hash; }
+  inline uint64_t blk_off(const uint32_t idx) const noexcept {
+    return _layout->off(idx);
+  }
+  // length of block idx within the file
+  inline uint64_t blk_len(const uint32_t idx) const noexcept {
+    const auto off = std::min(blk_off(idx), size());
+    return std::min(_layout->len(idx), size() - off);
+  }
+  inline hash_algo_t hash_algo() const noexcept { return _hash_algo; }
+  inline bool valid() const noexcept { return _valid; }
+
+  inline const file_entry_t &entry() const noexcept { return _file_entry; }
+  inline std::filesystem::path &path() noexcept { return _path; }
+  inline const std::filesystem::path &path() const noexcept { return _path; }
   inline uint64_t size() const noexcept { return _file_entry.size(); }
+  inline bool sparse() const noexcept { return _file_entry.sparse(); }
+  // device and inode, zero if unknown
+  inline uint64_t dev() const noexcept { return _file_entry.stat().dev; }
+  inline uint64_t ino() const noexcept { return _file_entry.stat().ino; }
+
+  inline std::vector<std::filesystem::path> &links() noexcept {
+    return _links;
+  }
+
+  /**
+   * @brief store hashes computed in this run to cache
+   *
+   * @param cache hash cache
+   */
+  void save_hash(hash_cache_t &cache) const;
 };
 
 }  // namespace detail_v1_0_0
 
-}  // namespace dedupe
\ No newline at end of file
+}  // namespace dedupe
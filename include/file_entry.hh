@@ -1,31 +1,56 @@
 #pragma once
 
 #include <cstdint>
-#include <filesystem>
-#include <utility>
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
+// identity of a file captured while listing, zero if unknown
+struct file_stat_t {
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+  int64_t mtime_ns = 0;
+  int64_t ctime_ns = 0;
+};
+
+// compact file record, name and parent directory live in file_table_t
 class file_entry_t {
-  std::filesystem::path _path;
   uint64_t _size = 0;
+  uint64_t _name_off = 0;
+  uint32_t _parent = 0;
+  // entry names are at most NAME_MAX
+  uint16_t _name_len = 0;
+  // fewer blocks allocated than size, may have holes
+  bool _sparse = false;
+  file_stat_t _stat;
 
  public:
-  template <typename Tp>
-  inline file_entry_t(Tp &&path, const uint64_t size) noexcept(
-      noexcept(std::filesystem::path(std::forward<Tp>(path))))
-      : _path(std::forward<Tp>(path)), _size(size) {}
+  inline file_entry_t(const uint32_t parent, const uint64_t name_off,
+                      const uint32_t name_len, const uint64_t size,
+                      const file_stat_t &stat = {},
+                      const bool sparse = false) noexcept
+      : _size(size),
+        _name_off(name_off),
+        _parent(parent),
+        _name_len((uint16_t)name_len),
+        _sparse(sparse),
+        _stat(stat) {}
 
   inline file_entry_t(const file_entry_t &rhs) = default;
   inline file_entry_t(file_entry_t &&rhs) = default;
   inline file_entry_t &operator=(const file_entry_t &rhs) = default;
   inline file_entry_t &operator=(file_entry_t &&rhs) = default;
 
-  inline std::filesystem::path &path() noexcept { return _path; }
-  inline const std::filesystem::path &path() const noexcept { return _path; }
+  inline uint32_t parent() const noexcept { return _parent; }
+  inline uint64_t name_off() const noexcept { return _name_off; }
+  inline uint32_t name_len() const noexcept { return _name_len; }
   inline uint64_t size() const noexcept { return _size; }
+  inline bool sparse() const noexcept { return _sparse; }
+  inline const file_stat_t &stat() const noexcept { return _stat; }
+
+  // move name offset when a batch is appended to a table
+  inline void rebase(const uint64_t base) noexcept { _name_off += base; }
 };
 
 }  // namespace detail_v1_0_0
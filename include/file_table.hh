@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_entry.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// directory in parent-pointer tree, search roots hold their full path
+struct dir_node_t {
+  uint64_t name_off;
+  uint32_t name_len;
+  uint32_t parent;
+};
+
+/**
+ * @brief compact file list, names of files and directories are stored once
+ * in an arena, full paths are only built on demand
+ */
+class file_table_t {
+  std::string _names;
+  std::vector<dir_node_t> _dirs;
+  std::vector<file_entry_t> _files;
+
+ public:
+  static constexpr uint32_t no_parent = UINT32_MAX;
+  // dev_tag of append_table keeps hosts in the top byte of device numbers
+  static constexpr auto host_tag_shift = 56U;
+
+  file_table_t() = default;
+  // table from parts read back from disk
+  inline file_table_t(std::string names, std::vector<dir_node_t> dirs,
+                      std::vector<file_entry_t> files) noexcept
+      : _names(std::move(names)),
+        _dirs(std::move(dirs)),
+        _files(std::move(files)) {}
+  file_table_t(const file_table_t &) = delete;
+  file_table_t(file_table_t &&) = default;
+  file_table_t &operator=(const file_table_t &) = delete;
+  file_table_t &operator=(file_table_t &&) = default;
+
+  /**
+   * @brief add search root, not thread safe
+   *
+   * @param path full path of root
+   * @return directory index
+   */
+  uint32_t add_root(std::string_view path);
+
+  /**
+   * @brief append batch listed from one directory, not thread safe
+   *
+   * @param names name arena of batch, name offsets of batch are relative
+   * @param files files of batch, rebased in place
+   * @return offset of batch names in table
+   */
+  uint64_t append(std::string_view names, std::span<file_entry_t> files);
+
+  /**
+   * @brief add directory whose name was appended, not thread safe
+   *
+   * @param parent parent directory index
+   * @param name_off name offset in table
+   * @param name_len name length
+   * @return directory index
+   */
+  uint32_t add_dir(uint32_t parent, uint64_t name_off, uint32_t name_len);
+
+  /**
+   * @brief append all directories and files of rhs, not thread safe
+   *
+   * @param rhs table to append
+   * @param dev_tag xor-ed into device numbers of rhs, keeps devices of
+   * tables listed on other hosts apart
+   */
+  void append_table(const file_table_t &rhs, uint64_t dev_tag);
+
+  // bytes held by the table, capacity included
+  inline uint64_t mem() const noexcept {
+    return _names.capacity() + _dirs.capacity() * sizeof(dir_node_t) +
+           _files.capacity() * sizeof(file_entry_t);
+  }
+
+  inline std::vector<file_entry_t> &files() noexcept { return _files; }
+  inline const std::vector<file_entry_t> &files() const noexcept {
+    return _files;
+  }
+  inline uint32_t dir_cnt() const noexcept { return (uint32_t)_dirs.size(); }
+  inline const std::vector<dir_node_t> &dirs() const noexcept { return _dirs; }
+  inline const std::string &names() const noexcept { return _names; }
+  inline std::string_view name(const file_entry_t &file) const noexcept {
+    return {_names.data() + file.name_off(), file.name_len()};
+  }
+
+  /**
+   * @brief build full path of directory
+   *
+   * @param dir directory index
+   * @param[out] out path is appended
+   */
+  void append_dir_path(uint32_t dir, std::string &out) const;
+
+  // build full path of file
+  std::filesystem::path path(const file_entry_t &file) const;
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <xxhash.h>
+
+#include <atomic>
+#include <compare>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// identifies a specific version of a file,
+// any change of content is expected to change mtime or ctime
+struct cache_key_t {
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  int64_t ctime_ns = 0;
+
+  auto operator<=>(const cache_key_t &rhs) const = default;
+};
+
+// on-disk record, hashes are stored in a separate array
+struct cache_rec_t {
+  cache_key_t key;
+  uint64_t hash_off;
+  uint32_t hash_cnt;
+  // generation of the last full merge that looked it up or stored it
+  uint32_t gen;
+};
+
+/**
+ * @brief persistent cache of file hash prefix chains,
+ * previous content is memory-mapped read-only and looked up in place,
+ * new chains are merged in on save, kept in memory for later lookups and
+ * written atomically unless the cache has no path, records not looked up
+ * in cache_max_age full merges are dropped, merge and flush split a save
+ * for callers that merge more often than they write.
+ */
+class hash_cache_t {
+  std::filesystem::path _path;
+  hash_algo_t _hash_algo;
+  blk_sched_t _blk_sched;
+  void *_map = nullptr;
+  uint64_t _map_sz = 0;
+  const cache_rec_t *_recs = nullptr;
+  uint64_t _rec_cnt = 0;
+  const XXH128_hash_t *_hashes = nullptr;
+  uint64_t _hash_cnt = 0;
+  // generation of the next full merge
+  uint32_t _gen = 1;
+  // records looked up since the last save
+  std::unique_ptr<std::atomic<uint8_t>[]> _seen;
+  // merged content after save, replaces the mapping
+  std::vector<cache_rec_t> _own_recs;
+  std::vector<XXH128_hash_t> _own_hashes;
+  // merged content not yet written
+  bool _dirty = false;
+  // chains merged since the last write
+  uint64_t _unsaved_cnt = 0;
+
+  std::mutex _mtx;
+  std::vector<std::pair<cache_key_t, std::vector<XXH128_hash_t>>> _updates;
+
+  void load();
+  void unload() noexcept;
+  // records are sorted by key and their chains are in bounds
+  bool valid() const noexcept;
+  // write records and hashes to path through a temporary file
+  void write(const std::vector<cache_rec_t> &recs,
+             const std::vector<XXH128_hash_t> &hashes) const;
+
+ public:
+  hash_cache_t() = delete;
+  // empty path keeps the cache in memory only, a cache written under
+  // another hash_algo or blk_sched is ignored
+  explicit hash_cache_t(std::filesystem::path path,
+                        hash_algo_t hash_algo = hash_algo_t::xxh128,
+                        const blk_sched_t &blk_sched = {});
+  ~hash_cache_t() noexcept;
+
+  hash_cache_t(const hash_cache_t &) = delete;
+  hash_cache_t(hash_cache_t &&) = delete;
+  hash_cache_t &operator=(const hash_cache_t &) = delete;
+  hash_cache_t &operator=(hash_cache_t &&) = delete;
+
+  /**
+   * @brief block schedule a cache was written under, without loading it
+   *
+   * @param path cache path
+   * @param hash_algo hash algorithm of the search
+   * @return schedule, empty if there is no cache of hash_algo at path
+   */
+  static std::optional<blk_sched_t> read_sched(
+      const std::filesystem::path &path, hash_algo_t hash_algo);
+
+  /**
+   * @brief find cached hash chain, thread safe
+   *
+   * @param key file identity
+   * @return span[hash] cached chain, empty if not found
+   */
+  std::span<const XXH128_hash_t> lookup(const cache_key_t &key) const noexcept;
+
+  /**
+   * @brief record hash chain of file, thread safe
+   *
+   * @param key file identity
+   * @param hashes hash chain, starting from first block
+   */
+  void store(const cache_key_t &key, std::span<const XXH128_hash_t> hashes);
+
+  /**
+   * @brief merge stored chains into lookups, in memory only, not thread safe
+   * against lookup
+   *
+   * @param full whether the search looked up every file it holds, only
+   * full merges age records that were not looked up
+   */
+  void merge(bool full = true);
+
+  /**
+   * @brief write merged cache to disk if it changed since the last write,
+   * replacing previous file
+   */
+  void flush();
+
+  /**
+   * @brief merge, then flush
+   *
+   * @param full as for merge
+   */
+  void save(bool full = true);
+
+  // chains merged but not yet written
+  uint64_t unsaved() const noexcept { return _unsaved_cnt; }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
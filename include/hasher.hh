@@ -0,0 +1,141 @@
+#pragma once
+
+#include <xxhash.h>
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef DEDUPE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "config.hh"
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief streaming digest of one hash block, the algorithm is picked on
+ * every reset from the hash_algo_t of the search and the block level,
+ * digests shorter than 128 bits are zero-extended so every level is stored
+ * alike, vector instructions are picked by the hash libraries
+ */
+class hasher_t {
+ public:
+  enum class kind_t : uint8_t { xxh64, xxh128, blake3 };
+
+ private:
+  XXH3_state_t *_state;
+#ifdef DEDUPE_BLAKE3
+  blake3_hasher _blake3;
+#endif
+  kind_t _kind = kind_t::xxh128;
+
+ public:
+  hasher_t() {
+    _state = XXH3_createState();
+    if (_state == nullptr) {
+      throw std::runtime_error("XXH3_createState failed");
+    }
+  }
+  ~hasher_t() noexcept {
+    if (_state != nullptr) {
+      XXH3_freeState(_state);
+    }
+  }
+
+  hasher_t(const hasher_t &rhs) = delete;
+  hasher_t(hasher_t &&rhs) = delete;
+  hasher_t &operator=(const hasher_t &rhs) = delete;
+  hasher_t &operator=(hasher_t &&rhs) = delete;
+
+  // digest kind of block lvl under algo
+  static constexpr kind_t kind(const hash_algo_t algo,
+                               const uint32_t lvl) noexcept {
+    switch (algo) {
+      case hash_algo_t::xxh64_early:
+        return lvl < short_hash_lvl ? kind_t::xxh64 : kind_t::xxh128;
+      case hash_algo_t::blake3:
+        return kind_t::blake3;
+      default:
+        return kind_t::xxh128;
+    }
+  }
+
+  // XXH3-128, for digests outside the hash chain
+  void reset() { reset(kind_t::xxh128); }
+  // digest of block lvl under algo
+  void reset(const hash_algo_t algo, const uint32_t lvl) {
+    reset(kind(algo, lvl));
+  }
+  void reset(const kind_t kind) {
+    _kind = kind;
+    switch (kind) {
+      case kind_t::xxh64:
+        if (XXH3_64bits_reset_withSeed(_state, hash_seed) == XXH_ERROR) {
+          throw std::runtime_error("XXH3_64bits_reset_withSeed failed");
+        }
+        break;
+      case kind_t::xxh128:
+        if (XXH3_128bits_reset_withSeed(_state, hash_seed) == XXH_ERROR) {
+          throw std::runtime_error("XXH3_128bits_reset_withSeed failed");
+        }
+        break;
+      case kind_t::blake3:
+#ifdef DEDUPE_BLAKE3
+        blake3_hasher_init(&_blake3);
+        break;
+#else
+        throw std::runtime_error("built without BLAKE3");
+#endif
+    }
+  }
+  inline kind_t kind() const noexcept { return _kind; }
+
+  void update(const char *data, const uint64_t size) {
+    switch (_kind) {
+      case kind_t::xxh64:
+        if (XXH3_64bits_update(_state, data, size) == XXH_ERROR) {
+          throw std::runtime_error("XXH3_64bits_update failed");
+        }
+        break;
+      case kind_t::xxh128:
+        if (XXH3_128bits_update(_state, data, size) == XXH_ERROR) {
+          throw std::runtime_error("XXH3_128bits_update failed");
+        }
+        break;
+      case kind_t::blake3:
+#ifdef DEDUPE_BLAKE3
+        blake3_hasher_update(&_blake3, data, size);
+#endif
+        break;
+    }
+  }
+  XXH128_hash_t digest() noexcept {
+    XXH128_hash_t hash{};
+    switch (_kind) {
+      case kind_t::xxh64:
+        hash.low64 = XXH3_64bits_digest(_state);
+        break;
+      case kind_t::xxh128:
+        hash = XXH3_128bits_digest(_state);
+        break;
+      case kind_t::blake3: {
+#ifdef DEDUPE_BLAKE3
+        uint8_t out[sizeof(hash)];
+        blake3_hasher_finalize(&_blake3, out, sizeof(out));
+        std::memcpy(&hash, out, sizeof(hash));
+#endif
+        break;
+      }
+    }
+    return hash;
+  }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
 #include <mutex>
-#include <regex>
+#include <string>
 #include <vector>
 
-#include "file_entry.hh"
+#include "exclude.hh"
+#include "file_table.hh"
+#include "prehash.hh"
+#include "spill.hh"
+#include "stats.hh"
 
 #include <boost/asio/thread_pool.hpp>
 
@@ -13,29 +19,50 @@ namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
-inline bool is_excluded(const std::filesystem::path &path,
-                       const std::vector<std::regex> &exclude_regex) {
-  for (const auto &regex : exclude_regex) {
-    if (std::regex_match(path.native(), regex)) {
-      return true;
-    }
-  }
-  return false;
-}
+// shared by all ls_dir_rec jobs of a search
+struct ls_ctx_t {
+  // file table, files and subdirectories are appended
+  file_table_t &table;
+  // protects table
+  std::mutex &mtx;
+  // thread pool for recursive calls
+  boost::asio::thread_pool &pool;
+  // patterns to exclude files or directories
+  const exclude_t &exclude;
+  // pipelined hashing of listed files, nullable
+  prehash_t *prehash;
+  stats_sum_t &stats;
+  // takes listed files instead of table, which then only holds the roots,
+  // nullable
+  spill_t *spill = nullptr;
+  // directories posted and not listed yet, the walk is done at 0
+  mutable std::atomic<uint64_t> pending_dir{0};
+};
 
 /**
- * @brief list directory recursively
+ * @brief list directory recursively with getdents64, entry type is taken
+ * from d_type when known and only regular files are stat-ed, relative to
+ * the directory fd, subdirectories are opened relative to it without
+ * following symlinks, they are posted to pool, or listed in place
+ * once ls_queue_max directories are waiting, prehash is told when the last
+ * posted directory is listed
  *
- * @param dir directory path
- * @param[out] file_list file list
- * @param mtx mutex for protecting file_list
- * @param pool thread pool for recursive calls
- * @param exclude_regex regular expression to exclude files or directories
+ * @param dir directory index in table, unused with spill
+ * @param dir_path directory path
+ * @param ctx listing context
  */
-void ls_dir_rec(const std::filesystem::path dir,
-                std::vector<file_entry_t> &file_list, std::mutex &mtx,
-                boost::asio::thread_pool &pool,
-                const std::vector<std::regex> &exclude_regex);
+void ls_dir_rec(const uint32_t dir, const std::string dir_path,
+                const ls_ctx_t &ctx);
+
+/**
+ * @brief add search directories to table as roots and post their listing to
+ * pool, excluded ones are skipped, caller joins pool
+ *
+ * @param search_dir directories to search
+ * @param ctx listing context, must outlive the pool jobs
+ */
+void ls_roots(const std::vector<std::filesystem::path> &search_dir,
+              const ls_ctx_t &ctx);
 
 }  // namespace detail_v1_0_0
 
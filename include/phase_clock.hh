@@ -0,0 +1,49 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstddef>
+
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// wall and cpu time of phases, sink is told at boundaries
+class phase_clock_t {
+  result_sink_t &_sink;
+  stats_t &_stats;
+  std::chrono::steady_clock::time_point _wall;
+  double _cpu_ms = 0;
+
+  static double cpu_ms() noexcept {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+           (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+  }
+
+ public:
+  phase_clock_t(result_sink_t &sink, stats_t &stats) noexcept
+      : _sink(sink), _stats(stats) {}
+
+  void start(const phase_t phase) {
+    _sink.on_phase_start(phase);
+    _wall = std::chrono::steady_clock::now();
+    _cpu_ms = cpu_ms();
+  }
+  void end(const phase_t phase) {
+    auto &time = _stats.phase_time[(std::size_t)phase];
+    time.wall_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - _wall)
+                       .count();
+    time.cpu_ms = cpu_ms() - _cpu_ms;
+    _sink.on_phase_end(phase);
+  }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
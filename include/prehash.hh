@@ -0,0 +1,121 @@
+#pragma once
+
+#include <xxhash.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "blk_layout.hh"
+#include "file_entry.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
+#include "stats.hh"
+
+#include <boost/asio/thread_pool.hpp>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief hashes early blocks of candidates while listing is still running,
+ * files are bucketed by size as they are listed, once a bucket has two files
+ * its members are posted to the listing pool for hashing up to prehash_lvl,
+ * results are picked up by file_cmp_t after listing, once the walk is done
+ * every size group is final and queued jobs are dropped, so the search of
+ * the groups doesn't wait for them
+ */
+class prehash_t {
+  static constexpr auto shard_cnt = 64UL;
+  // bucket holds index of its first file, or active once it has two
+  static constexpr auto active = UINT64_MAX;
+
+  struct key_hash_t {
+    inline std::size_t operator()(const cache_key_t &key) const noexcept {
+      return std::hash<uint64_t>{}(key.dev * 0x9e3779b97f4a7c15UL ^ key.ino);
+    }
+  };
+
+  struct bucket_shard_t {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, uint64_t> bucket;
+  };
+  // keyed by file version like the cache, a file changed while listing
+  // is not matched by hashes of its earlier content
+  struct hash_shard_t {
+    std::mutex mtx;
+    std::unordered_map<cache_key_t, std::vector<XXH128_hash_t>, key_hash_t>
+        hashes;
+  };
+
+  std::array<bucket_shard_t, shard_cnt> _buckets;
+  std::array<hash_shard_t, shard_cnt> _hashes;
+  file_table_t &_table;
+  std::mutex &_table_mtx;
+  boost::asio::thread_pool &_pool;
+  const hash_cache_t *_cache;
+  stats_sum_t &_stats;
+  hash_algo_t _hash_algo;
+  blk_layout_t _layout;
+  std::atomic<bool> _walk_done{false};
+  std::atomic<uint64_t> _dropped{0};
+
+  // hash early blocks of file at index idx of table
+  void hash(uint64_t idx);
+
+ public:
+  prehash_t() = delete;
+  prehash_t(file_table_t &table, std::mutex &table_mtx,
+            boost::asio::thread_pool &pool, const hash_cache_t *cache,
+            stats_sum_t &stats, hash_algo_t hash_algo,
+            const blk_layout_t &layout)
+      : _table(table),
+        _table_mtx(table_mtx),
+        _pool(pool),
+        _cache(cache),
+        _stats(stats),
+        _hash_algo(hash_algo),
+        _layout(layout) {}
+
+  prehash_t(const prehash_t &) = delete;
+  prehash_t(prehash_t &&) = delete;
+  prehash_t &operator=(const prehash_t &) = delete;
+  prehash_t &operator=(prehash_t &&) = delete;
+
+  /**
+   * @brief register files appended to table, thread safe
+   *
+   * @param files files appended
+   * @param idx index of first file in table
+   */
+  void add(std::span<const file_entry_t> files, uint64_t idx);
+
+  /**
+   * @brief find early hashes of file, only valid after listing pool joined
+   *
+   * @param key file version
+   * @return span[hash] hashes from first block, empty if not found
+   */
+  std::span<const XXH128_hash_t> lookup(const cache_key_t &key) const;
+
+  // every directory is listed, jobs not started yet are dropped, thread safe
+  inline void walk_done() noexcept {
+    _walk_done.store(true, std::memory_order_relaxed);
+  }
+
+  // number of files hashed, only valid after listing pool joined
+  uint64_t size() const;
+  // number of files left to the search by walk_done
+  inline uint64_t dropped() const noexcept {
+    return _dropped.load(std::memory_order_relaxed);
+  }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "config.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// per-thread resource manager, Rsrc is default constructed on first use
+template <typename Rsrc>
+class rsrc_man_t {
+  std::unordered_map<std::thread::id, std::unique_ptr<Rsrc>> rsrc_map;
+  std::shared_mutex rw_lck;
+
+ public:
+  rsrc_man_t() = default;
+
+  // this is dangerous, make sure no one is using resource
+  void clear() noexcept {
+    std::unique_lock lck(rw_lck);
+    rsrc_map.clear();
+  }
+
+  Rsrc &get_rsrc() {
+    auto id = std::this_thread::get_id();
+    {
+      std::shared_lock lck(rw_lck);
+      auto it = rsrc_map.find(id);
+      if (it != rsrc_map.end()) {
+        return *it->second;
+      }
+    }
+    auto rsrc = std::make_unique<Rsrc>();
+    std::unique_lock lck(rw_lck);
+    return *rsrc_map.emplace(id, std::move(rsrc)).first->second;
+  }
+
+  ~rsrc_man_t() noexcept { clear(); }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
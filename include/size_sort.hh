@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "file_entry.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief sort files by size through compact (size, index) keys, the keys
+ * are radix sorted in parallel, only bytes of the size that differ between
+ * files are passes, entries are moved once at the end, files of a size keep
+ * their order
+ *
+ * @param[in,out] files files to sort
+ * @param max_thread threads of the passes
+ * @param keep_unique keep files whose size no other file has, they can't
+ * have duplicates unless merged with files listed elsewhere
+ * @return number of files dropped
+ */
+uint64_t sort_by_size(std::vector<file_entry_t> &files, uint32_t max_thread,
+                      bool keep_unique);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
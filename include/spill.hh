@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_table.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief external memory of listed files, listed batches are kept in a
+ * table of their own under their full directory path, the table is written
+ * to a run sorted by size and emptied once it passes its share of the
+ * budget, so neither files nor directories accumulate, runs are merged back
+ * one size group at a time
+ */
+class spill_t {
+  std::filesystem::path _dir;
+  // table bytes that trigger a spill
+  uint64_t _table_limit;
+  // estimated bytes of a size group past which it is skipped
+  uint64_t _group_limit;
+  uint32_t _max_thread;
+  // batches listed since the last spill, one root per directory
+  file_table_t _table;
+  std::vector<std::filesystem::path> _runs;
+  uint64_t _file_cnt = 0;
+  uint64_t _bytes = 0;
+  uint64_t _oversized_cnt = 0;
+  // first failure of add, later batches are dropped
+  std::exception_ptr _err;
+
+  // merge runs in [st, ed) into one, fan-in reduction
+  void merge_runs(uint64_t st, uint64_t ed);
+
+ public:
+  /**
+   * @param tmp_dir directory of runs, the system temporary directory if
+   * empty
+   * @param mem_limit memory budget, a third of it goes to the table, a
+   * size group may take half of it
+   * @param max_thread threads sorting a run
+   * @throw std::runtime_error if tmp_dir is not a directory
+   */
+  spill_t(const std::filesystem::path &tmp_dir, uint64_t mem_limit,
+          uint32_t max_thread);
+  // runs are removed
+  ~spill_t() noexcept;
+
+  spill_t(const spill_t &) = delete;
+  spill_t(spill_t &&) = delete;
+  spill_t &operator=(const spill_t &) = delete;
+  spill_t &operator=(spill_t &&) = delete;
+
+  /**
+   * @brief add batch listed from one directory, the table is spilled once
+   * it passes its share, a failed spill is kept for rethrow and later
+   * batches are dropped, not thread safe
+   *
+   * @param dir_path full path of directory
+   * @param names name arena of batch, name offsets of batch are relative
+   * @param files files of batch, rebuilt in place
+   */
+  void add(std::string_view dir_path, std::string_view names,
+           std::span<file_entry_t> files);
+
+  // a spill of add failed, listing can stop
+  inline bool failed() const noexcept { return (bool)_err; }
+
+  /**
+   * @brief rethrow the failure of add, call after listing pool joined
+   *
+   * @throw std::runtime_error of the failed spill
+   */
+  void rethrow() const;
+
+  /**
+   * @brief write files of table to a new run sorted by size and empty the
+   * table, not thread safe
+   *
+   * @throw std::runtime_error on write error
+   */
+  void spill();
+
+  // files listed when nothing was spilled, as a table of their own
+  inline file_table_t take() noexcept { return std::exchange(_table, {}); }
+
+  inline uint64_t run_cnt() const noexcept { return _runs.size(); }
+  // files added, spilled or not
+  inline uint64_t file_cnt() const noexcept {
+    return _file_cnt + _table.files().size();
+  }
+  inline uint64_t bytes() const noexcept { return _bytes; }
+  // files of size groups skipped by merge
+  inline uint64_t oversized_cnt() const noexcept { return _oversized_cnt; }
+
+  /**
+   * @brief merge runs, tables of one size group are handed out in
+   * ascending size order, a group is read fully before it is handed out,
+   * groups estimated past half of the budget are skipped with a warning
+   *
+   * @param fn receives a table of the files of each size with more than
+   * one file
+   * @return number of files of a size of their own
+   * @throw std::runtime_error on read or write error
+   */
+  uint64_t merge(const std::function<void(file_table_t &&)> &fn);
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
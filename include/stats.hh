@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <mutex>
+
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// depth of a pool queue, push before post and pop when the job starts
+class queue_gauge_t {
+  std::atomic<int64_t> _depth{0};
+  std::atomic<int64_t> _max{0};
+
+ public:
+  inline void push() noexcept {
+    const auto depth = _depth.fetch_add(1, std::memory_order_relaxed) + 1;
+    auto max = _max.load(std::memory_order_relaxed);
+    while (depth > max &&
+           !_max.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {
+    }
+  }
+  inline void pop() noexcept { _depth.fetch_sub(1, std::memory_order_relaxed); }
+  inline uint64_t depth() const noexcept {
+    return (uint64_t)_depth.load(std::memory_order_relaxed);
+  }
+  inline uint64_t max() const noexcept {
+    return (uint64_t)_max.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * @brief sums stats of a search, jobs count into a local stats_t and add it
+ * once when done, so reads and directory entries are counted without locks
+ */
+class stats_sum_t {
+  std::mutex _mtx;
+  stats_t _total;
+
+ public:
+  queue_gauge_t list_queue;
+  queue_gauge_t hash_queue;
+
+  inline void add(const stats_t &stats) {
+    std::lock_guard lk(_mtx);
+    _total.merge(stats);
+  }
+
+  // sum of added stats, only valid after pools joined
+  inline stats_t total() const {
+    auto stats = _total;
+    stats.max_list_queue = list_queue.max();
+    stats.max_hash_queue = hash_queue.max();
+    return stats;
+  }
+};
+
+// count a finished size group that took us microseconds
+inline void add_group_latency(stats_t &stats, const uint64_t us) noexcept {
+  ++stats.group_cnt;
+  stats.group_us_total += us;
+  stats.group_us_max = std::max(stats.group_us_max, us);
+  ++stats.group_us_hist[std::min((uint32_t)std::bit_width(us),
+                                 stats_t::hist_cnt - 1)];
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+#include "file_table.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief boot id of this host, device numbers are only comparable between
+ * listings of the same boot
+ *
+ * @return boot id, empty if unknown
+ */
+std::string boot_id();
+
+/**
+ * @brief write table with the boot id of this host, through a temporary
+ * file renamed over path
+ *
+ * @param path table path
+ * @param table file table, files sorted by size
+ * @throw std::runtime_error on write error
+ */
+void write_table(const std::filesystem::path &path, const file_table_t &table);
+
+/**
+ * @brief read table written by write_table
+ *
+ * @param path table path
+ * @param[out] host boot id of the listing host, nullable
+ * @return file table, files sorted by size
+ * @throw std::runtime_error on read error or incompatible table
+ */
+file_table_t read_table(const std::filesystem::path &path,
+                        std::string *host = nullptr);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+// elapsed time between calls, for progress logs
+class timer_t {
+  std::chrono::steady_clock::time_point _prev_time;
+
+ public:
+  timer_t() noexcept : _prev_time(std::chrono::steady_clock::now()) {}
+  std::chrono::milliseconds time() noexcept {
+    auto cur_time = std::chrono::steady_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        cur_time - _prev_time);
+    _prev_time = cur_time;
+    return duration;
+  }
+};
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
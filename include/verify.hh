@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "file_cmp.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+/**
+ * @brief compare bytes for equality, vectorized when cpu supports it
+ *
+ * @return true if equal
+ */
+bool bytes_equal(const char *lhs, const char *rhs, uint64_t size) noexcept;
+
+/**
+ * @brief split files of equal hashes by exact content, all members are read
+ * once in lockstep and split wherever bytes differ
+ *
+ * @param files files of the same size, unreadable ones are invalidated
+ * @return vector[vector[index]] partition of valid files by content,
+ * singletons included
+ */
+std::vector<std::vector<uint32_t>> verify_group(std::span<file_cmp_t> files);
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,52 @@
+#include "blk_layout.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+blk_layout_t::blk_layout_t(const blk_sched_t &sched) noexcept
+    : _first(sched.first_blk),
+      _growth(sched.growth),
+      _max_blk(sched.max_blk) {
+  if (_max_blk == 0) {
+    return;
+  }
+  auto lvl = 1U;
+  while (len(lvl) <= _max_blk) {
+    ++lvl;
+  }
+  _cap_off = geo_off(lvl);
+  _cap_lvl = lvl;
+}
+
+uint32_t blk_layout_t::blk_cnt(const uint64_t size) const noexcept {
+  // smallest n >= 1 with off(n) >= size
+  auto off = _first;
+  for (auto lvl = 1U; lvl < _cap_lvl; ++lvl) {
+    if (off >= size) {
+      return lvl;
+    }
+    off = off > UINT64_MAX / _growth ? UINT64_MAX : off * _growth;
+  }
+  if (_cap_off >= size) {
+    return _cap_lvl;
+  }
+  const auto capped = (size - _cap_off + _max_blk - 1) / _max_blk;
+  return (uint32_t)std::min<uint64_t>(_cap_lvl + capped, UINT32_MAX);
+}
+
+void check_blk_sched(const blk_sched_t &sched) {
+  constexpr auto min_cap = 1UL << 20;
+  if (sched.first_blk == 0 || sched.growth < 2 || sched.growth > 1024 ||
+      (sched.max_blk != 0 &&
+       sched.max_blk < std::max(sched.first_blk, min_cap))) {
+    throw std::invalid_argument("invalid block schedule");
+  }
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,440 @@
+#include "blk_reader.hh"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef DEDUPE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "config.hh"
+#include "hasher.hh"
+#include "oss.hh"
+#include "rsrc_man.hh"
+
+#endif
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+#ifdef DEDUPE_IO_URING
+
+namespace {
+
+// minimal io_uring over raw syscalls, single submitter
+class uring_t {
+  int _fd = -1;
+  void *_sq_ptr = MAP_FAILED;
+  uint64_t _sq_sz = 0;
+  void *_cq_ptr = MAP_FAILED;
+  uint64_t _cq_sz = 0;
+  void *_sqes_ptr = MAP_FAILED;
+  uint64_t _sqes_sz = 0;
+
+  io_uring_sqe *_sqes = nullptr;
+  unsigned *_sq_head = nullptr;
+  unsigned *_sq_tail = nullptr;
+  unsigned *_sq_mask = nullptr;
+  unsigned *_sq_array = nullptr;
+  unsigned _sq_entries = 0;
+  unsigned *_cq_head = nullptr;
+  unsigned *_cq_tail = nullptr;
+  unsigned *_cq_mask = nullptr;
+  io_uring_cqe *_cqes = nullptr;
+  unsigned _to_submit = 0;
+
+  void release() noexcept {
+    if (_sqes_ptr != MAP_FAILED) {
+      ::munmap(_sqes_ptr, _sqes_sz);
+    }
+    if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) {
+      ::munmap(_cq_ptr, _cq_sz);
+    }
+    if (_sq_ptr != MAP_FAILED) {
+      ::munmap(_sq_ptr, _sq_sz);
+    }
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+    _sqes_ptr = _cq_ptr = _sq_ptr = MAP_FAILED;
+    _fd = -1;
+  }
+
+  void *map_ring(const uint64_t size, const off_t off) noexcept {
+    return ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, _fd, off);
+  }
+
+ public:
+  explicit uring_t(const unsigned entries) noexcept {
+    io_uring_params params{};
+    _fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0) {
+      return;
+    }
+    // IORING_OP_READ needs 5.6, fast poll implies 5.7
+    if ((params.features & IORING_FEAT_FAST_POLL) == 0) {
+      release();
+      return;
+    }
+    _sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      _sq_sz = _cq_sz = std::max(_sq_sz, _cq_sz);
+    }
+    _sq_ptr = map_ring(_sq_sz, IORING_OFF_SQ_RING);
+    _cq_ptr = single_mmap ? _sq_ptr : map_ring(_cq_sz, IORING_OFF_CQ_RING);
+    _sqes_sz = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes_ptr = map_ring(_sqes_sz, IORING_OFF_SQES);
+    if (_sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED ||
+        _sqes_ptr == MAP_FAILED) {
+      release();
+      return;
+    }
+
+    auto *sq = static_cast<char *>(_sq_ptr);
+    _sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    _sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    _sq_entries = params.sq_entries;
+    auto *cq = static_cast<char *>(_cq_ptr);
+    _cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    _cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    _sqes = static_cast<io_uring_sqe *>(_sqes_ptr);
+  }
+  ~uring_t() noexcept { release(); }
+
+  uring_t(const uring_t &) = delete;
+  uring_t(uring_t &&) = delete;
+  uring_t &operator=(const uring_t &) = delete;
+  uring_t &operator=(uring_t &&) = delete;
+
+  bool valid() const noexcept { return _fd >= 0; }
+
+  // queue read, submitted by next submit_wait
+  bool push_read(const int fd, char *buf, const unsigned len,
+                 const uint64_t off, const uint64_t user_data) noexcept {
+    const auto tail = *_sq_tail;
+    const auto head =
+        std::atomic_ref(*_sq_head).load(std::memory_order_acquire);
+    if (tail - head >= _sq_entries) {
+      return false;
+    }
+    const auto idx = tail & *_sq_mask;
+    auto &sqe = _sqes[idx];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(buf);
+    sqe.len = len;
+    sqe.off = off;
+    sqe.user_data = user_data;
+    _sq_array[idx] = idx;
+    std::atomic_ref(*_sq_tail).store(tail + 1, std::memory_order_release);
+    ++_to_submit;
+    return true;
+  }
+
+  // submit queued reads and wait for at least one completion
+  bool submit_wait() noexcept {
+    while (true) {
+      const auto ret = ::syscall(__NR_io_uring_enter, _fd, _to_submit, 1U,
+                                 IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret >= 0) {
+        _to_submit -= (unsigned)ret;
+        return true;
+      }
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+  }
+
+  bool pop_cqe(io_uring_cqe &cqe) noexcept {
+    const auto head = *_cq_head;
+    if (head == std::atomic_ref(*_cq_tail).load(std::memory_order_acquire)) {
+      return false;
+    }
+    cqe = _cqes[head & *_cq_mask];
+    std::atomic_ref(*_cq_head).store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// a file being hashed, owns one chunk of the buffer
+struct slot_t {
+  file_cmp_t *file = nullptr;
+  int fd = -1;
+  uint64_t pos = 0;
+  uint64_t remain = 0;
+  hasher_t hasher;
+};
+
+// per-thread ring, buffer and hashers
+struct uring_rsrc_t {
+  std::unique_ptr<uring_t> ring;
+  std::unique_ptr<char[]> buf;
+  std::vector<std::unique_ptr<slot_t>> slots;
+  uint64_t chunk_sz = 0;
+  uint32_t depth = 0;
+  // a failed ring and its buffer are kept, reads it left in flight may
+  // still land in buf
+  bool failed = false;
+  uint32_t inflight = 0;
+
+  uring_rsrc_t() = default;
+  ~uring_rsrc_t() noexcept {
+    // closing the ring doesn't wait for its reads, buf outlives them
+    ring.reset();
+    if (inflight > 0) {
+      (void)buf.release();
+    }
+  }
+
+  uring_rsrc_t(const uring_rsrc_t &) = delete;
+  uring_rsrc_t(uring_rsrc_t &&) = delete;
+  uring_rsrc_t &operator=(const uring_rsrc_t &) = delete;
+  uring_rsrc_t &operator=(uring_rsrc_t &&) = delete;
+
+  // setup for io_depth, false if io_uring is unavailable
+  bool init(const uint32_t io_depth) {
+    if (failed) {
+      return false;
+    }
+    if (ring != nullptr && depth == io_depth) {
+      return true;
+    }
+    ring = std::make_unique<uring_t>(io_depth);
+    if (!ring->valid()) {
+      ring.reset();
+      failed = true;
+      static std::once_flag warned;
+      std::call_once(warned, [] {
+        oss(std::cerr) << "[warn] io_uring unavailable, use blocking reads\n";
+      });
+      return false;
+    }
+    depth = io_depth;
+    // chunks are page aligned
+    chunk_sz = std::max(buf_sz / depth / 4096UL, 1UL) * 4096UL;
+    buf = std::make_unique_for_overwrite<char[]>(chunk_sz * depth);
+    slots.clear();
+    for (auto i = 0U; i < depth; ++i) {
+      slots.emplace_back(std::make_unique<slot_t>());
+    }
+    return true;
+  }
+};
+
+rsrc_man_t<uring_rsrc_t> uring_rsrc_man;
+
+/**
+ * @brief hash block idx of files with io_uring
+ *
+ * @return false if ring failed, unfinished files are left unhashed
+ */
+bool uring_hash_blk(uring_rsrc_t &rsrc, std::span<file_cmp_t *const> files,
+                    const uint32_t idx) {
+  auto &ring = *rsrc.ring;
+  auto next = files.begin();
+  uint32_t inflight = 0;
+
+  auto issue = [&](const uint32_t slot_idx) {
+    auto &slot = *rsrc.slots[slot_idx];
+    const auto len = std::min(rsrc.chunk_sz, slot.remain);
+    ring.push_read(slot.fd, rsrc.buf.get() + slot_idx * rsrc.chunk_sz,
+                   (unsigned)len, slot.pos, slot_idx);
+    ++inflight;
+  };
+  auto finish = [](slot_t &slot, const bool success) {
+    ::close(slot.fd);
+    slot.fd = -1;
+    if (success) {
+      slot.file->add_hash(slot.hasher.digest());
+    } else {
+      slot.file->set_invalid();
+    }
+    slot.file = nullptr;
+  };
+  // start next file that lacks block idx, sparse files are left to
+  // blocking reads, which skip holes
+  auto start = [&](const uint32_t slot_idx) {
+    auto &slot = *rsrc.slots[slot_idx];
+    while (next != files.end()) {
+      auto &file = **next++;
+      if (!file.valid() || idx < file.hash_cnt() || file.sparse()) {
+        continue;
+      }
+      slot.pos = std::min(file.blk_off(idx), file.size());
+      slot.remain = file.blk_len(idx);
+      slot.hasher.reset(file.hash_algo(), idx);
+      if (slot.remain == 0) {
+        file.add_hash(slot.hasher.digest());
+        continue;
+      }
+      slot.fd = ::open(file.path().c_str(), O_RDONLY | O_CLOEXEC);
+      if (slot.fd < 0) {
+        file.set_invalid();
+        continue;
+      }
+      slot.file = &file;
+      issue(slot_idx);
+      return;
+    }
+  };
+
+  for (auto i = 0U; i < rsrc.depth; ++i) {
+    start(i);
+  }
+  while (inflight > 0) {
+    if (!ring.submit_wait()) {
+      // leave in-flight files to blocking reads, the ring holds its own
+      // reference of their fds, ring and buf stay unused until the thread
+      // resource goes away
+      for (auto &slot : rsrc.slots) {
+        if (slot->file != nullptr) {
+          ::close(slot->fd);
+          slot->fd = -1;
+          slot->file = nullptr;
+        }
+      }
+      rsrc.failed = true;
+      rsrc.inflight = inflight;
+      return false;
+    }
+    io_uring_cqe cqe;
+    while (ring.pop_cqe(cqe)) {
+      --inflight;
+      const auto slot_idx = (uint32_t)cqe.user_data;
+      auto &slot = *rsrc.slots[slot_idx];
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        issue(slot_idx);
+        continue;
+      }
+      if (cqe.res <= 0) {
+        // error or unexpected eof
+        finish(slot, false);
+        start(slot_idx);
+        continue;
+      }
+      slot.hasher.update(rsrc.buf.get() + slot_idx * rsrc.chunk_sz,
+                         (uint64_t)cqe.res);
+      slot.pos += (uint64_t)cqe.res;
+      slot.remain -= (uint64_t)cqe.res;
+      if (slot.remain > 0) {
+        issue(slot_idx);
+      } else {
+        finish(slot, true);
+        start(slot_idx);
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+#endif
+
+namespace {
+
+// physical offset of byte off of file, UINT64_MAX if unknown
+uint64_t phys_off(const file_cmp_t &file, const uint64_t off) noexcept {
+  const int fd = ::open(file.path().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return UINT64_MAX;
+  }
+  // room for one extent after the header
+  alignas(fiemap) char buf[sizeof(fiemap) + sizeof(fiemap_extent)] = {};
+  auto &map = *reinterpret_cast<fiemap *>(buf);
+  auto &extent = *reinterpret_cast<fiemap_extent *>(buf + sizeof(fiemap));
+  map.fm_start = off;
+  map.fm_length = 1;
+  map.fm_extent_count = 1;
+  const auto ret = ::ioctl(fd, FS_IOC_FIEMAP, &map);
+  ::close(fd);
+  // holes, delayed allocation and inline data have no useful position
+  constexpr auto no_pos = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                          FIEMAP_EXTENT_DATA_INLINE |
+                          FIEMAP_EXTENT_NOT_ALIGNED;
+  if (ret != 0 || map.fm_mapped_extents == 0 ||
+      (extent.fe_flags & no_pos) != 0 || extent.fe_logical > off) {
+    return UINT64_MAX;
+  }
+  return extent.fe_physical + (off - extent.fe_logical);
+}
+
+// order files lacking block idx by device and physical offset of the block
+void sort_by_extent(std::vector<file_cmp_t *> &order, const uint32_t idx) {
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, file_cmp_t *>> keyed;
+  keyed.reserve(order.size());
+  for (auto *file : order) {
+    if (!file->valid() || idx < file->hash_cnt()) {
+      continue;
+    }
+    const auto pos = file->blk_off(idx) < file->size()
+                         ? phys_off(*file, file->blk_off(idx))
+                         : 0;
+    keyed.emplace_back(std::pair(file->dev(), pos), file);
+  }
+  // unknown positions keep their order at the end of their device
+  std::stable_sort(
+      keyed.begin(), keyed.end(),
+      [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+  order.clear();
+  for (const auto &[key, file] : keyed) {
+    order.emplace_back(file);
+  }
+}
+
+}  // namespace
+
+void hash_blk_batch(std::span<file_cmp_t> files, const uint32_t idx,
+                    const uint32_t io_depth, const bool extent_order) {
+  std::vector<file_cmp_t *> order;
+  order.reserve(files.size());
+  for (auto &file : files) {
+    order.emplace_back(&file);
+  }
+  if (extent_order && files.size() > 1) {
+    sort_by_extent(order, idx);
+  }
+#ifdef DEDUPE_IO_URING
+  if (io_depth > 1 && order.size() > 1) {
+    auto &rsrc = uring_rsrc_man.get_rsrc();
+    // files left by io_uring, sparse or unfinished, are read below
+    if (rsrc.init(io_depth)) {
+      uring_hash_blk(rsrc, order, idx);
+    }
+  }
+#else
+  (void)io_depth;
+#endif
+  for (auto *file : order) {
+    file->hash_blk(idx);
+  }
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
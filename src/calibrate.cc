@@ -0,0 +1,202 @@
+#include "calibrate.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include "blk_layout.hh"
+#include "hash_cache.hh"
+#include "oss.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// probe budget per root
+constexpr auto probe_entry_cnt = 4096U;
+constexpr auto probe_file_cnt = 8U;
+constexpr auto probe_min_sz = 64UL * 1024UL;
+constexpr auto probe_small = 4UL * 1024UL;
+constexpr auto probe_large = 1024UL * 1024UL;
+
+struct dev_probe_t {
+  // median latency of a small read, seconds
+  double latency = 0;
+  // bytes per second of a large read
+  double bandwidth = 0;
+};
+
+// bytes in flight between request and first byte
+inline double bdp(const dev_probe_t &probe) noexcept {
+  return probe.latency * probe.bandwidth;
+}
+
+// device classes by bandwidth-delay product, in ascending order
+struct dev_class_t {
+  double max_bdp;
+  const char *name;
+  blk_sched_t sched;
+};
+constexpr dev_class_t dev_classes[] = {
+    {256.0 * 1024.0, "low latency", {4096, 2, 64UL << 20U, false}},
+    {4.0 * 1024.0 * 1024.0, "disk", {64UL * 1024UL, 4, 1UL << 30U, false}},
+    {0, "high latency", {1024UL * 1024UL, 8, 0, false}},
+};
+
+struct aligned_free_t {
+  void operator()(char *ptr) const noexcept { std::free(ptr); }
+};
+
+/**
+ * @brief time reads of one file, O_DIRECT where supported so the page
+ * cache does not answer, buffered reads otherwise
+ *
+ * @return seconds of each small read, then of the large read, empty if
+ * the file could not be read
+ */
+std::vector<double> time_reads(const std::filesystem::path &path,
+                               const uint64_t size, char *buf) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+  if (fd < 0) {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    return {};
+  }
+  std::vector<double> secs;
+  auto time_read = [&](const uint64_t off, const uint64_t len) {
+    const auto st = std::chrono::steady_clock::now();
+    const auto read_len = ::pread(fd, buf, len, (off_t)off);
+    const auto ed = std::chrono::steady_clock::now();
+    if (read_len != (ssize_t)len) {
+      return false;
+    }
+    secs.emplace_back(std::chrono::duration<double>(ed - st).count());
+    return true;
+  };
+  // spread small reads so no read-ahead of an earlier one serves them
+  const auto stride = (size / 4 / probe_small) * probe_small;
+  auto ok = true;
+  for (auto i = 0U; ok && i < 4; ++i) {
+    ok = time_read(i * stride, probe_small);
+  }
+  if (ok && size >= probe_large) {
+    ok = time_read(0, std::min(probe_large, (size / probe_small) *
+                                               probe_small));
+  }
+  ::close(fd);
+  if (!ok) {
+    return {};
+  }
+  return secs;
+}
+
+dev_probe_t probe_root(const std::filesystem::path &root) {
+  std::unique_ptr<char, aligned_free_t> buf(
+      static_cast<char *>(std::aligned_alloc(probe_small, probe_large)));
+  std::vector<double> latency;
+  double large_bytes = 0;
+  double large_secs = 0;
+  std::error_code ec;
+  std::filesystem::recursive_directory_iterator it(
+      root, std::filesystem::directory_options::skip_permission_denied, ec);
+  auto entry_cnt = 0U;
+  auto file_cnt = 0U;
+  for (; !ec && it != std::filesystem::recursive_directory_iterator() &&
+         entry_cnt < probe_entry_cnt && file_cnt < probe_file_cnt;
+       it.increment(ec), ++entry_cnt) {
+    std::error_code stat_ec;
+    if (!it->is_regular_file(stat_ec)) {
+      continue;
+    }
+    const auto size = it->file_size(stat_ec);
+    if (stat_ec || size < probe_min_sz) {
+      continue;
+    }
+    auto secs = time_reads(it->path(), size, buf.get());
+    if (secs.empty()) {
+      continue;
+    }
+    ++file_cnt;
+    if (secs.size() > 4) {
+      large_bytes += (double)std::min(probe_large, size);
+      large_secs += secs.back();
+      secs.pop_back();
+    }
+    latency.insert(latency.end(), secs.begin(), secs.end());
+  }
+
+  dev_probe_t probe;
+  if (latency.empty()) {
+    return probe;
+  }
+  auto mid = latency.begin() + (int64_t)latency.size() / 2;
+  std::nth_element(latency.begin(), mid, latency.end());
+  probe.latency = *mid;
+  if (large_secs > 0) {
+    probe.bandwidth = large_bytes / large_secs;
+  } else {
+    // no file past a large read, small reads bound the bandwidth
+    probe.bandwidth = (double)probe_small / std::max(probe.latency, 1e-9);
+  }
+  return probe;
+}
+
+}  // namespace
+
+blk_sched_t pick_blk_sched(const blk_sched_t &sched,
+                           const std::vector<std::filesystem::path> &roots,
+                           const std::filesystem::path &cache_path,
+                           const hash_algo_t hash_algo) {
+  check_blk_sched(sched);
+  if (!sched.auto_calibrate) {
+    return sched;
+  }
+  if (!cache_path.empty()) {
+    // probes vary between runs, a flip of class would drop the cache
+    if (const auto cached = hash_cache_t::read_sched(cache_path, hash_algo)) {
+      oss(std::cerr) << "[log] block schedule of cache: " << cached->first_blk
+                     << ", growth " << cached->growth << ", cap "
+                     << cached->max_blk << '\n';
+      return *cached;
+    }
+  }
+  const dev_class_t *picked = nullptr;
+  for (const auto &root : roots) {
+    const auto probe = probe_root(root);
+    if (probe.latency == 0) {
+      oss(std::cerr) << "[log] calibrate " << root << ": nothing to probe\n";
+      continue;
+    }
+    const auto *cls = std::begin(dev_classes);
+    while (cls + 1 != std::end(dev_classes) && bdp(probe) >= cls->max_bdp) {
+      ++cls;
+    }
+    oss(std::cerr) << "[log] calibrate " << root << ": latency "
+                   << probe.latency * 1e6 << "us, bandwidth "
+                   << probe.bandwidth / 1e6 << "MB/s, " << cls->name << '\n';
+    if (picked == nullptr || cls > picked) {
+      picked = cls;
+    }
+  }
+  if (picked == nullptr) {
+    // defaults, calibration is only an optimization
+    return blk_sched_t{};
+  }
+  oss(std::cerr) << "[log] block schedule: " << picked->sched.first_blk
+                 << ", growth " << picked->sched.growth << ", cap "
+                 << picked->sched.max_blk << '\n';
+  return picked->sched;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
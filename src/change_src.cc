@@ -0,0 +1,317 @@
+#include "change_src.hh"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+
+#include "oss.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// 64KiB, room for hundreds of events per read
+constexpr auto event_buf_sz = 64UL * 1024UL;
+
+// wait until fd is readable, false on error
+bool wait_readable(const int fd, const int timeout_ms) {
+  pollfd pfd{fd, POLLIN, 0};
+  while (true) {
+    const auto ret = ::poll(&pfd, 1, timeout_ms);
+    if (ret >= 0) {
+      return true;
+    }
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+// path of dir and name, name "." is dir itself
+std::string join_path(std::string dir, const std::string_view name) {
+  if (name.empty() || name == ".") {
+    return dir;
+  }
+  if (dir.empty() || dir.back() != '/') {
+    dir += '/';
+  }
+  dir += name;
+  return dir;
+}
+
+/**
+ * @brief one mark per filesystem of the roots, events name the parent
+ * directory by file handle, which is opened to find its current path
+ */
+class fanotify_src_t : public change_src_t {
+  static constexpr auto mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM |
+                               FAN_MOVED_TO | FAN_MODIFY | FAN_CLOSE_WRITE |
+                               FAN_ATTRIB | FAN_ONDIR;
+  // entries of directories, other events on them are left out
+  static constexpr auto dir_mask =
+      FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO;
+
+  int _fd = -1;
+  std::vector<std::string> _roots;
+  // fd of a root per filesystem id, for open_by_handle_at
+  std::vector<std::pair<fsid_t, int>> _mounts;
+  std::unique_ptr<char[]> _buf;
+
+  void release() noexcept {
+    for (const auto &[id, fd] : _mounts) {
+      ::close(fd);
+    }
+    _mounts.clear();
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+
+  int mount_fd(const __kernel_fsid_t &fsid) const noexcept {
+    for (const auto &[id, fd] : _mounts) {
+      if (std::memcmp(&id, &fsid, sizeof(fsid)) == 0) {
+        return fd;
+      }
+    }
+    return -1;
+  }
+
+ public:
+  explicit fanotify_src_t(const std::vector<std::string> &roots)
+      : _roots(roots) {
+    _fd = ::fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                              FAN_REPORT_DFID_NAME,
+                          O_RDONLY | O_LARGEFILE);
+    if (_fd < 0) {
+      throw std::system_error(errno, std::system_category(), "fanotify_init");
+    }
+    for (const auto &root : roots) {
+      const int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      struct statfs st {};
+      if (fd < 0 || ::fstatfs(fd, &st) != 0) {
+        const auto err = errno;
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        release();
+        throw std::system_error(err, std::system_category(), root);
+      }
+      _mounts.emplace_back(st.f_fsid, fd);
+      if (::fanotify_mark(_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask,
+                          AT_FDCWD, root.c_str()) != 0) {
+        const auto err = errno;
+        release();
+        throw std::system_error(err, std::system_category(), "fanotify_mark");
+      }
+    }
+    _buf = std::make_unique_for_overwrite<char[]>(event_buf_sz);
+  }
+  ~fanotify_src_t() noexcept override { release(); }
+
+  fanotify_src_t(const fanotify_src_t &) = delete;
+  fanotify_src_t(fanotify_src_t &&) = delete;
+  fanotify_src_t &operator=(const fanotify_src_t &) = delete;
+  fanotify_src_t &operator=(fanotify_src_t &&) = delete;
+
+  void add_dir(const std::string &path) override { (void)path; }
+
+  bool wait(const int timeout_ms, std::vector<std::string> &changed) override {
+    if (!wait_readable(_fd, timeout_ms)) {
+      return false;
+    }
+    bool overflow = false;
+    while (true) {
+      auto len = ::read(_fd, _buf.get(), event_buf_sz);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          break;
+        }
+        return false;
+      }
+      const auto *meta =
+          reinterpret_cast<const fanotify_event_metadata *>(_buf.get());
+      for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+        if (meta->vers != FANOTIFY_METADATA_VERSION) {
+          return false;
+        }
+        if ((meta->mask & FAN_Q_OVERFLOW) != 0) {
+          overflow = true;
+          continue;
+        }
+        if ((meta->mask & FAN_ONDIR) != 0 && (meta->mask & dir_mask) == 0) {
+          continue;
+        }
+        const auto *info =
+            reinterpret_cast<const fanotify_event_info_fid *>(meta + 1);
+        if (meta->event_len < sizeof(*meta) + sizeof(*info) ||
+            info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+          continue;
+        }
+        const int mnt_fd = mount_fd(info->fsid);
+        if (mnt_fd < 0) {
+          continue;
+        }
+        // handle is followed by the entry name
+        auto *handle = reinterpret_cast<file_handle *>(
+            const_cast<unsigned char *>(info->handle));
+        const auto *name =
+            reinterpret_cast<const char *>(handle->f_handle) +
+            handle->handle_bytes;
+        const int dir_fd =
+            ::open_by_handle_at(mnt_fd, handle, O_PATH | O_CLOEXEC);
+        if (dir_fd < 0) {
+          // directory gone, its own deletion is reported by its parent
+          continue;
+        }
+        char dir_path[4096];
+        const auto path_len =
+            ::readlink(("/proc/self/fd/" + std::to_string(dir_fd)).c_str(),
+                       dir_path, sizeof(dir_path));
+        ::close(dir_fd);
+        if (path_len <= 0 || (uint64_t)path_len == sizeof(dir_path)) {
+          continue;
+        }
+        changed.emplace_back(
+            join_path(std::string(dir_path, (uint64_t)path_len), name));
+      }
+    }
+    if (overflow) {
+      oss(std::cerr) << "[warn] change events lost, scan again\n";
+      changed.insert(changed.end(), _roots.begin(), _roots.end());
+    }
+    return true;
+  }
+};
+
+/**
+ * @brief one watch per directory, watch descriptors map to the path the
+ * directory was added under
+ */
+class inotify_src_t : public change_src_t {
+  static constexpr uint32_t mask =
+      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+      IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+  static constexpr uint32_t dir_mask =
+      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+  int _fd = -1;
+  std::vector<std::string> _roots;
+  std::unordered_map<int, std::string> _dirs;
+  std::unique_ptr<char[]> _buf;
+  bool _warned = false;
+
+ public:
+  explicit inotify_src_t(const std::vector<std::string> &roots)
+      : _roots(roots) {
+    _fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd < 0) {
+      throw std::system_error(errno, std::system_category(), "inotify_init1");
+    }
+    _buf = std::make_unique_for_overwrite<char[]>(event_buf_sz);
+  }
+  ~inotify_src_t() noexcept override {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+
+  inotify_src_t(const inotify_src_t &) = delete;
+  inotify_src_t(inotify_src_t &&) = delete;
+  inotify_src_t &operator=(const inotify_src_t &) = delete;
+  inotify_src_t &operator=(inotify_src_t &&) = delete;
+
+  void add_dir(const std::string &path) override {
+    const auto wd = ::inotify_add_watch(_fd, path.c_str(), mask);
+    if (wd >= 0) {
+      // same wd if already watched, under its old path if it was moved
+      _dirs[wd] = path;
+    } else if (errno == ENOSPC && !_warned) {
+      _warned = true;
+      oss(std::cerr) << "[warn] out of inotify watches, raise "
+                        "fs.inotify.max_user_watches: "
+                     << path << '\n';
+    }
+  }
+
+  bool wait(const int timeout_ms, std::vector<std::string> &changed) override {
+    if (!wait_readable(_fd, timeout_ms)) {
+      return false;
+    }
+    bool overflow = false;
+    while (true) {
+      const auto len = ::read(_fd, _buf.get(), event_buf_sz);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          break;
+        }
+        return false;
+      }
+      for (auto off = 0L; off < len;) {
+        const auto *event =
+            reinterpret_cast<const inotify_event *>(_buf.get() + off);
+        off += (int64_t)(sizeof(inotify_event) + event->len);
+        if ((event->mask & IN_Q_OVERFLOW) != 0) {
+          overflow = true;
+          continue;
+        }
+        if ((event->mask & IN_IGNORED) != 0) {
+          _dirs.erase(event->wd);
+          continue;
+        }
+        // events of the directory itself are reported by its parent
+        if (event->len == 0 ||
+            ((event->mask & IN_ISDIR) != 0 && (event->mask & dir_mask) == 0)) {
+          continue;
+        }
+        const auto it = _dirs.find(event->wd);
+        if (it != _dirs.end()) {
+          changed.emplace_back(join_path(it->second, event->name));
+        }
+      }
+    }
+    if (overflow) {
+      oss(std::cerr) << "[warn] change events lost, scan again\n";
+      changed.insert(changed.end(), _roots.begin(), _roots.end());
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<change_src_t> make_change_src(
+    const std::vector<std::string> &roots) {
+  try {
+    auto src = std::make_unique<fanotify_src_t>(roots);
+    oss(std::cerr) << "[log] watch with fanotify\n";
+    return src;
+  } catch (const std::system_error &e) {
+    oss(std::cerr) << "[log] fanotify unavailable, watch with inotify - "
+                   << e.what() << '\n';
+  }
+  return std::make_unique<inotify_src_t>(roots);
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
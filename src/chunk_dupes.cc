@@ -0,0 +1,268 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <xxhash.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chunk_index.hh"
+#include "chunker.hh"
+#include "config.hh"
+#include "dedupe.hh"
+#include "exclude.hh"
+#include "file_table.hh"
+#include "ls_dir_rec.hh"
+#include "oss.hh"
+#include "rsrc_man.hh"
+#include "stats.hh"
+#include "timer.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+using chunk_list_t = std::vector<std::pair<XXH128_hash_t, chunk_ref_t>>;
+
+// per-thread read buffer
+struct chunk_rsrc_t {
+  std::unique_ptr<unsigned char[]> buf =
+      std::make_unique_for_overwrite<unsigned char[]>(buf_sz);
+};
+
+rsrc_man_t<chunk_rsrc_t> chunk_rsrc_man;
+
+/**
+ * @brief split file into chunks, reading it once in buf_sz pieces, the
+ * unfinished tail of a piece is moved to the front before the next read
+ *
+ * @param path file path
+ * @param file index of file in table
+ * @param chunker cut point finder
+ * @return digest and place of chunks, nullopt on read error
+ */
+std::optional<chunk_list_t> chunk_file(const std::filesystem::path &path,
+                                       const uint32_t file,
+                                       const chunker_t &chunker) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  auto *buf = chunk_rsrc_man.get_rsrc().buf.get();
+  chunk_list_t chunks;
+  // file offset of buf[0]
+  uint64_t buf_off = 0;
+  uint64_t fill = 0;
+  bool eof = false;
+  while (!eof) {
+    const auto read_len =
+        ::pread(fd, buf + fill, buf_sz - fill, (off_t)(buf_off + fill));
+    if (read_len < 0) {
+      ::close(fd);
+      return std::nullopt;
+    }
+    eof = read_len == 0;
+    fill += (uint64_t)read_len;
+    // a chunk may end before max_sz only if all of it is in buf
+    uint64_t st = 0;
+    while (st < fill && (eof || fill - st >= chunker.max_sz())) {
+      const auto len = chunker.cut(buf + st, fill - st);
+      chunks.emplace_back(XXH3_128bits_withSeed(buf + st, len, hash_seed),
+                          chunk_ref_t{file, (uint32_t)len, buf_off + st});
+      st += len;
+    }
+    std::memmove(buf, buf + st, fill - st);
+    buf_off += st;
+    fill -= st;
+  }
+  ::close(fd);
+  return chunks;
+}
+
+using pair_map_t = std::unordered_map<uint64_t, uint64_t>;
+
+// key of pair of file indices, lhs < rhs
+inline uint64_t pair_key(const uint32_t lhs, const uint32_t rhs) noexcept {
+  return (uint64_t)lhs << 32U | rhs;
+}
+
+}  // namespace
+
+void DEDUPE_EXPORT chunk_dupes(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const chunk_opts_t &opts,
+    chunk_sink_t &sink) {
+  const chunker_t chunker(opts.min_chunk, opts.avg_chunk, opts.max_chunk);
+  const auto max_thread = opts.max_thread;
+  const exclude_t exclude(opts.exclude_pattern, exclude_regex);
+  stats_sum_t stats_sum;
+
+  // generate file list
+  timer_t timer;
+  file_table_t table;
+  const auto &file_list = table.files();
+  std::cerr << "[log] list files..." << std::endl;
+  {
+    std::mutex mtx;
+    boost::asio::thread_pool pool(max_thread);
+    const ls_ctx_t ls_ctx{table, mtx, pool, exclude, nullptr, stats_sum};
+    ls_roots(search_dir, ls_ctx);
+    pool.join();
+  }
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] file count: " << file_list.size() << std::endl;
+  if (file_list.size() > UINT32_MAX) {
+    // chunk_ref_t and pair keys hold 32-bit file indices
+    throw std::length_error("too many files to chunk: " +
+                            std::to_string(file_list.size()));
+  }
+
+  // chunk files, hard links once
+  std::cerr << "[log] chunk files..." << std::endl;
+  chunk_index_t index;
+  std::atomic<uint64_t> chunk_cnt = 0;
+  std::atomic<uint64_t> byte_cnt = 0;
+  {
+    std::set<std::pair<uint64_t, uint64_t>> inodes;
+    boost::asio::thread_pool pool(max_thread);
+    for (auto i = 0UL; i < file_list.size(); ++i) {
+      const auto &stat = file_list[i].stat();
+      if (stat.ino != 0 && !inodes.emplace(stat.dev, stat.ino).second) {
+        continue;
+      }
+      boost::asio::post(pool, [i, &table, &chunker, &index, &chunk_cnt,
+                               &byte_cnt] {
+        const auto &file = table.files()[i];
+        const auto path = table.path(file);
+        auto chunks = chunk_file(path, (uint32_t)i, chunker);
+        if (!chunks) {
+          oss(std::cerr) << "[err] read error: " << path << '\n';
+          return;
+        }
+        chunk_cnt.fetch_add(chunks->size(), std::memory_order_relaxed);
+        byte_cnt.fetch_add(file.size(), std::memory_order_relaxed);
+        index.add(*chunks);
+      });
+    }
+    pool.join();
+  }
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] chunk count: " << chunk_cnt << " (" << byte_cnt
+            << " bytes), index up to " << chunk_cnt * chunk_index_t::chunk_mem
+            << " bytes" << std::endl;
+
+  // sum common chunks per pair, one job per shard
+  std::cerr << "[log] match chunks..." << std::endl;
+  pair_map_t pair_map;
+  std::mutex mtx;
+  std::atomic<uint64_t> dupe_chunk_cnt = 0;
+  std::atomic<uint64_t> fanout_cnt = 0;
+  {
+    boost::asio::thread_pool pool(max_thread);
+    for (auto shard = 0UL; shard < chunk_index_t::shard_cnt; ++shard) {
+      boost::asio::post(pool, [shard, &index, &table, &opts, &sink, &pair_map,
+                               &mtx, &dupe_chunk_cnt, &fanout_cnt] {
+        pair_map_t local;
+        // (file, count) of one digest
+        std::vector<std::pair<uint32_t, uint32_t>> counts;
+        std::vector<chunk_ref_t> refs;
+        index.visit(shard, [&](const XXH128_hash_t &,
+                               std::span<const chunk_ref_t> chunk_refs) {
+          if (chunk_refs.size() < 2) {
+            return;
+          }
+          dupe_chunk_cnt.fetch_add(1, std::memory_order_relaxed);
+          refs.assign(chunk_refs.begin(), chunk_refs.end());
+          std::sort(refs.begin(), refs.end(),
+                    [](const auto &lhs, const auto &rhs) {
+                      return std::pair(lhs.file, lhs.off) <
+                             std::pair(rhs.file, rhs.off);
+                    });
+          const auto len = refs.front().len;
+          if (opts.chunk_map) {
+            std::vector<chunk_loc_t> locs;
+            locs.reserve(refs.size());
+            for (const auto &ref : refs) {
+              locs.emplace_back(table.path(table.files()[ref.file]), ref.off);
+            }
+            std::lock_guard lk(mtx);
+            sink.on_chunk(len, std::move(locs));
+          }
+          counts.clear();
+          for (const auto &ref : refs) {
+            if (counts.empty() || counts.back().first != ref.file) {
+              counts.emplace_back(ref.file, 0);
+            }
+            ++counts.back().second;
+          }
+          if (counts.size() > opts.max_pair_fanout) {
+            fanout_cnt.fetch_add(1, std::memory_order_relaxed);
+            return;
+          }
+          for (auto i = 0UL; i < counts.size(); ++i) {
+            for (auto j = i + 1; j < counts.size(); ++j) {
+              local[pair_key(counts[i].first, counts[j].first)] +=
+                  (uint64_t)len *
+                  std::min(counts[i].second, counts[j].second);
+            }
+          }
+        });
+        std::lock_guard lk(mtx);
+        for (const auto &[key, shared] : local) {
+          pair_map[key] += shared;
+        }
+      });
+    }
+    pool.join();
+  }
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] repeated chunk count: " << dupe_chunk_cnt << std::endl;
+  if (fanout_cnt > 0) {
+    std::cerr << "[log] chunks in more than " << opts.max_pair_fanout
+              << " files, left out of pairs: " << fanout_cnt << std::endl;
+  }
+
+  // report pairs, most shared first
+  std::vector<std::pair<uint64_t, uint64_t>> pair_list;
+  pair_list.reserve(pair_map.size());
+  for (const auto &[key, shared] : pair_map) {
+    if (shared >= opts.min_shared) {
+      pair_list.emplace_back(shared, key);
+    }
+  }
+  pair_map = {};
+  std::sort(pair_list.begin(), pair_list.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return lhs.first != rhs.first ? lhs.first > rhs.first
+                                            : lhs.second < rhs.second;
+            });
+  std::cerr << "[log] pair count: " << pair_list.size() << std::endl;
+  for (const auto &[shared, key] : pair_list) {
+    const auto &lhs = file_list[key >> 32U];
+    const auto &rhs = file_list[key & UINT32_MAX];
+    sink.on_pair({table.path(lhs), table.path(rhs), lhs.size(), rhs.size(),
+                  shared});
+  }
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
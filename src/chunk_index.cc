@@ -0,0 +1,30 @@
+#include "chunk_index.hh"
+
+#include <algorithm>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+void chunk_index_t::add(
+    std::span<std::pair<XXH128_hash_t, chunk_ref_t>> chunks) {
+  std::sort(chunks.begin(), chunks.end(), [](const auto &lhs, const auto &rhs) {
+    return shard_of(lhs.first) < shard_of(rhs.first);
+  });
+  auto st = chunks.begin();
+  while (st != chunks.end()) {
+    const auto shard = shard_of(st->first);
+    auto ed = std::find_if(st, chunks.end(), [shard](const auto &chunk) {
+      return shard_of(chunk.first) != shard;
+    });
+    auto &[mtx, refs] = _shards[shard];
+    std::lock_guard lk(mtx);
+    for (; st != ed; ++st) {
+      refs[st->first].emplace_back(st->second);
+    }
+  }
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
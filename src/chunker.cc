@@ -0,0 +1,77 @@
+#include "chunker.hh"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <stdexcept>
+
+#include "config.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// random value per byte, from splitmix64 so the table is fixed across builds
+constexpr std::array<uint64_t, 256> gear = [] {
+  std::array<uint64_t, 256> table{};
+  uint64_t state = 0x6a09e667f3bcc908UL;
+  for (auto &val : table) {
+    state += 0x9e3779b97f4a7c15UL;
+    auto z = state;
+    z = (z ^ (z >> 30U)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27U)) * 0x94d049bb133111ebUL;
+    val = z ^ (z >> 31U);
+  }
+  return table;
+}();
+
+// top bit_cnt bits, which depend on the last 64 bytes
+constexpr uint64_t top_mask(const uint32_t bit_cnt) noexcept {
+  return bit_cnt == 0 ? 0 : ~0UL << (64U - bit_cnt);
+}
+
+}  // namespace
+
+chunker_t::chunker_t(const uint64_t min_sz, const uint64_t avg_sz,
+                     const uint64_t max_sz)
+    : _min_sz(min_sz), _avg_sz(avg_sz), _max_sz(max_sz) {
+  if (min_sz < 64 || min_sz > avg_sz || avg_sz > max_sz || max_sz > buf_sz ||
+      !std::has_single_bit(avg_sz)) {
+    throw std::invalid_argument("invalid chunk sizes");
+  }
+  // normalized chunking level 1, one bit harder before avg_sz, one easier
+  // after
+  const auto bit_cnt = (uint32_t)std::countr_zero(avg_sz);
+  _mask_s = top_mask(bit_cnt + 1);
+  _mask_l = top_mask(bit_cnt - 1);
+}
+
+uint64_t chunker_t::cut(const unsigned char *data,
+                        const uint64_t len) const noexcept {
+  if (len <= _min_sz) {
+    return len;
+  }
+  const auto ed = std::min(len, _max_sz);
+  const auto normal_ed = std::min(ed, _avg_sz);
+  uint64_t hash = 0;
+  auto i = _min_sz;
+  for (; i < normal_ed; ++i) {
+    hash = (hash << 1U) + gear[data[i]];
+    if ((hash & _mask_s) == 0) {
+      return i + 1;
+    }
+  }
+  for (; i < ed; ++i) {
+    hash = (hash << 1U) + gear[data[i]];
+    if ((hash & _mask_l) == 0) {
+      return i + 1;
+    }
+  }
+  return ed;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
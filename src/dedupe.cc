@@ -6,103 +6,236 @@
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <optional>
 #include <regex>
+#include <stdexcept>
 #include <vector>
 
+#include "calibrate.hh"
 #include "config.hh"
+#include "dedupe.hh"
 #include "dedupe_same_sz.hh"
 #include "file_entry.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
 #include "ls_dir_rec.hh"
 #include "oss.hh"
+#include "phase_clock.hh"
+#include "prehash.hh"
+#include "size_sort.hh"
+#include "spill.hh"
+#include "stats.hh"
+#include "timer.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
-class timer_t {
-  std::chrono::steady_clock::time_point _prev_time;
+namespace {
+
+// collects streamed results for vector interface
+class collect_sink_t : public result_sink_t {
+  std::vector<std::vector<std::filesystem::path>> &_dupe_list;
+  std::vector<std::vector<std::filesystem::path>> &_linked_list;
 
  public:
-  timer_t() noexcept : _prev_time(std::chrono::steady_clock::now()) {}
-  std::chrono::milliseconds time() noexcept {
-    auto cur_time = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-        cur_time - _prev_time);
-    _prev_time = cur_time;
-    return duration;
+  collect_sink_t(std::vector<std::vector<std::filesystem::path>> &dupe_list,
+                 std::vector<std::vector<std::filesystem::path>> &linked_list)
+      : _dupe_list(dupe_list), _linked_list(linked_list) {}
+
+  void on_dupe(std::vector<std::filesystem::path> &&group) override {
+    _dupe_list.emplace_back(std::move(group));
+  }
+  void on_linked(std::vector<std::filesystem::path> &&group) override {
+    _linked_list.emplace_back(std::move(group));
   }
 };
 
-std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT dedupe(
-    const std::vector<std::filesystem::path> &search_dir,
-    const std::vector<std::regex> &exclude_regex, const uint32_t max_thread) {
+}  // namespace
+
+bool DEDUPE_EXPORT hash_algo_supported(const hash_algo_t algo) noexcept {
+#ifdef DEDUPE_BLAKE3
+  (void)algo;
+  return true;
+#else
+  return algo != hash_algo_t::blake3;
+#endif
+}
+
+void DEDUPE_EXPORT dedupe(const std::vector<std::filesystem::path> &search_dir,
+                          const std::vector<std::regex> &exclude_regex,
+                          const options_t &opts, result_sink_t &sink) {
+  if (!hash_algo_supported(opts.hash_algo)) {
+    throw std::invalid_argument("hash algorithm not supported by this build");
+  }
+  const auto max_thread = opts.max_thread;
+  const auto blk_sched = pick_blk_sched(opts.blk_sched, search_dir,
+                                        opts.cache_path, opts.hash_algo);
+  std::optional<hash_cache_t> cache;
+  if (!opts.cache_path.empty()) {
+    cache.emplace(opts.cache_path, opts.hash_algo, blk_sched);
+  }
+  same_sz_ctx_t ctx;
+  ctx.layout = blk_layout_t(blk_sched);
+  ctx.cache = cache ? &*cache : nullptr;
+  ctx.io_depth = opts.io_depth;
+  ctx.verify = opts.verify;
+  ctx.extent_order = opts.extent_order;
+  ctx.sample = opts.sample;
+  ctx.hash_algo = opts.hash_algo;
+  ctx.dev_limits = opts.dev_limits;
+  const exclude_t exclude(opts.exclude_pattern, exclude_regex);
+  stats_sum_t stats_sum;
+  ctx.stats = &stats_sum;
+  stats_t stats;
+  phase_clock_t clock(sink, stats);
+
   // generate file list
   timer_t timer;
-  std::vector<file_entry_t> file_list;
+  file_table_t table;
+  auto &file_list = table.files();
   std::cerr << "[log] list files..." << std::endl;
+  clock.start(phase_t::list);
+  // hashes of early blocks computed while listing, outlives listing pool
+  std::optional<prehash_t> prehash;
+  // runs of listed files past the memory limit
+  std::optional<spill_t> spill;
+  if (opts.mem_limit != 0) {
+    spill.emplace(opts.tmp_dir, opts.mem_limit, max_thread);
+  }
+  std::mutex table_mtx;
   {
     boost::asio::thread_pool pool(max_thread);
-    std::mutex mtx;
-    for (const auto &dir : search_dir) {
-      if (is_excluded(dir, exclude_regex)) {
-        oss(std::cerr) << "[log] exclude: " << dir << '\n';
-        continue;
-      }
-      boost::asio::post(
-          pool, std::bind(ls_dir_rec, dir, std::ref(file_list), std::ref(mtx),
-                          std::ref(pool), std::cref(exclude_regex)));
+    auto &mtx = table_mtx;
+    // prehashed files are found by table index, which spilling resets
+    if (opts.pipeline && !spill) {
+      prehash.emplace(table, mtx, pool, ctx.cache, stats_sum, opts.hash_algo,
+                      ctx.layout);
+      ctx.prehash = &*prehash;
     }
+    const ls_ctx_t ls_ctx{table, mtx, pool, exclude,
+                          prehash ? &*prehash : nullptr, stats_sum,
+                          spill ? &*spill : nullptr};
+    ls_roots(search_dir, ls_ctx);
     pool.join();
   }
+  if (spill) {
+    // runs written so far are removed with spill
+    spill->rethrow();
+  }
+  clock.end(phase_t::list);
   std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
-  std::cerr << "[log] file count: " << file_list.size() << std::endl;
+  std::cerr << "[log] file count: "
+            << file_list.size() + (spill ? spill->file_cnt() : 0) << std::endl;
+  if (prehash) {
+    std::cerr << "[log] prehashed file count: " << prehash->size()
+              << ", left after listing: " << prehash->dropped() << std::endl;
+  }
 
-  // sort files by size
-  std::cerr << "[log] sort files..." << std::endl;
-  std::sort(
-      file_list.begin(), file_list.end(),
-      [](const auto &lhs, const auto &rhs) { return lhs.size() < rhs.size(); });
-  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  result_out_t out(sink);
+  if (spill && spill->run_cnt() != 0) {
+    // rest of the listing joins the runs, groups are then merged back and
+    // hashed a batch at a time
+    std::cerr << "[log] spill files..." << std::endl;
+    clock.start(phase_t::sort);
+    spill->spill();
+    clock.end(phase_t::sort);
+    std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+    oss(std::cerr) << "[log] run count: " << spill->run_cnt() << ", "
+                   << spill->bytes() << " bytes\n";
 
-  // detect duplicates
-  std::vector<std::vector<std::filesystem::path>> dupe_list;
-  uint64_t job_count = 0;
-  std::cerr << "[log] detect duplicates..." << std::endl;
-  if (file_list.size() > 1) {
-    // finding union of same file size
-    auto union_st = file_list.begin();
-    auto union_ed = union_st + 1;
-    boost::asio::thread_pool pool(max_thread);
-    std::mutex mtx;
-    while (true) {
-      if (union_ed == file_list.end() || union_ed->size() != union_st->size()) {
-        // end of union
-        auto union_sz = std::distance(union_st, union_ed);
-        if (union_sz > 1) {
-          // dispatch to detect duplicates for same file size
-          // &(*) is workaround for libc++ bug
-          boost::asio::post(
-              pool,
-              std::bind(dedupe_same_sz, std::span(&(*union_st), &(*union_ed)),
-                        std::ref(dupe_list), std::ref(mtx)));
-          ++job_count;
-        }
-        if (union_ed == file_list.end()) {
-          break;
-        }
-        union_st = union_ed;
+    std::cerr << "[log] detect duplicates..." << std::endl;
+    clock.start(phase_t::hash);
+    std::vector<file_table_t> batch;
+    uint64_t batch_mem = 0;
+    auto flush = [&] {
+      dedupe_groups(batch, out, ctx, max_thread);
+      batch.clear();
+      batch_mem = 0;
+    };
+    const auto unique_cnt = spill->merge([&](file_table_t &&group) {
+      batch_mem += group_mem(group);
+      batch.emplace_back(std::move(group));
+      if (batch_mem > opts.mem_limit / 2) {
+        flush();
       }
-      ++union_ed;
+    });
+    flush();
+    clock.end(phase_t::hash);
+    std::cerr << "[log] unique size count: " << unique_cnt << std::endl;
+    stats.oversized_cnt = spill->oversized_cnt();
+  } else {
+    if (spill) {
+      // listing fit in its share, spilled batches are the table
+      table = spill->take();
     }
-    oss(std::cerr) << "[log] job count: " << job_count << std::endl;
-    pool.join();
+    // sort files by size, files of a size of their own are dropped
+    std::cerr << "[log] sort files..." << std::endl;
+    clock.start(phase_t::sort);
+    const auto unique_cnt = sort_by_size(file_list, max_thread, false);
+    clock.end(phase_t::sort);
+    std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+    std::cerr << "[log] unique size count: " << unique_cnt << std::endl;
+
+    // detect duplicates
+    std::cerr << "[log] detect duplicates..." << std::endl;
+    clock.start(phase_t::hash);
+    dedupe_sorted(file_list, table, out, ctx, max_thread);
+    clock.end(phase_t::hash);
   }
   std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
-  std::cerr << "[log] duplicate group count: " << dupe_list.size() << std::endl;
+  std::cerr << "[log] duplicate group count: " << out.dupe_cnt() << std::endl;
+  std::cerr << "[log] linked group count: " << out.linked_cnt() << std::endl;
 
+  if (cache) {
+    std::cerr << "[log] save cache..." << std::endl;
+    clock.start(phase_t::save);
+    cache->save();
+    clock.end(phase_t::save);
+    std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  }
+
+  stats.merge(stats_sum.total());
+  stats.dupe_cnt = out.dupe_cnt();
+  stats.linked_cnt = out.linked_cnt();
+  sink.on_stats(stats);
+}
+
+std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts,
+    std::vector<std::vector<std::filesystem::path>> &linked_list) {
+  std::vector<std::vector<std::filesystem::path>> dupe_list;
+  collect_sink_t sink(dupe_list, linked_list);
+  dedupe(search_dir, exclude_regex, opts, sink);
   return dupe_list;
 }
 
+std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts) {
+  std::vector<std::vector<std::filesystem::path>> linked_list;
+  return dedupe(search_dir, exclude_regex, opts, linked_list);
+}
+
+std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const uint32_t max_thread) {
+  options_t opts;
+  opts.max_thread = max_thread;
+  return dedupe(search_dir, exclude_regex, opts);
+}
+
+std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT dedupe(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex,
+    const std::filesystem::path &cache_path, const uint32_t max_thread) {
+  options_t opts;
+  opts.max_thread = max_thread;
+  opts.cache_path = cache_path;
+  return dedupe(search_dir, exclude_regex, opts);
+}
+
 }  // namespace detail_v1_0_0
 
 }  // namespace dedupe
\ No newline at end of file
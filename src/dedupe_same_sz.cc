@@ -1,63 +1,399 @@
 #include "dedupe_same_sz.hh"
 
 #include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <memory>
 #include <utility>
 
+#include "blk_reader.hh"
 #include "config.hh"
+#include "dev_sched.hh"
 #include "file_cmp.hh"
+#include "oss.hh"
+#include "verify.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
+namespace {
+
+// candidates of one size, files of a bucket had equal digests so far,
+// buckets are contiguous and end at the offsets in ed
+struct buckets_t {
+  std::vector<file_cmp_t> files;
+  std::vector<std::size_t> ed;
+};
+
+template <typename It>
+std::vector<std::filesystem::path> make_group(It st, const It ed) {
+  std::vector<std::filesystem::path> group;
+  for (; st != ed; ++st) {
+    group.emplace_back(std::move(st->path()));
+    std::move(st->links().begin(), st->links().end(),
+              std::back_inserter(group));
+  }
+  return group;
+}
+
+inline void drop(file_cmp_t &file, const same_sz_ctx_t &ctx) {
+  if (ctx.cache != nullptr) {
+    file.save_hash(*ctx.cache);
+  }
+}
+
+// split every bucket by digest, files alone in their bucket are unique
+template <typename Digest>
+void split(buckets_t &cur, const Digest digest, uint64_t &eliminated,
+           result_out_t &out, const same_sz_ctx_t &ctx) {
+  buckets_t next;
+  next.files.reserve(cur.files.size());
+  auto bucket_st = cur.files.begin();
+  for (auto ed : cur.ed) {
+    auto bucket_ed_it = cur.files.begin() + (std::ptrdiff_t)ed;
+    // unreadable files are dropped
+    auto valid_ed =
+        std::partition(bucket_st, bucket_ed_it,
+                       [](const auto &file) { return file.valid(); });
+    std::sort(bucket_st, valid_ed, [&](const auto &lhs, const auto &rhs) {
+      return hash_lt(digest(lhs), digest(rhs));
+    });
+    // finding union of same digest
+    auto union_st = bucket_st;
+    while (union_st != valid_ed) {
+      auto union_ed =
+          std::find_if(union_st + 1, valid_ed, [&](const auto &file) {
+            return !hash_eq(digest(file), digest(*union_st));
+          });
+      if (union_ed - union_st > 1) {
+        std::move(union_st, union_ed, std::back_inserter(next.files));
+        next.ed.emplace_back(next.files.size());
+      } else {
+        if (!union_st->links().empty()) {
+          // unique content, only hard linked
+          out.linked(make_group(union_st, union_ed));
+        }
+        drop(*union_st, ctx);
+        ++eliminated;
+      }
+      union_st = union_ed;
+    }
+    bucket_st = bucket_ed_it;
+  }
+  cur = std::move(next);
+}
+
+// bytes of sequential blocks not known yet, readable files only
+uint64_t unread(const buckets_t &cur) {
+  uint64_t sum = 0;
+  for (const auto &file : cur.files) {
+    if (file.valid()) {
+      const auto known = std::min(file.size(), file.blk_off(file.hash_cnt()));
+      sum += file.size() - known;
+    }
+  }
+  return sum;
+}
+
+// remaining buckets have all block hashes equal, duplicates found
+void report(buckets_t &cur, result_out_t &out, const same_sz_ctx_t &ctx,
+            stats_t &stats) {
+  auto bucket_st = cur.files.begin();
+  for (auto ed : cur.ed) {
+    auto bucket_ed_it = cur.files.begin() + (std::ptrdiff_t)ed;
+    std::for_each(bucket_st, bucket_ed_it,
+                  [&](auto &file) { drop(file, ctx); });
+    if (!ctx.verify) {
+      out.dupe(make_group(bucket_st, bucket_ed_it));
+    } else {
+      std::span bucket(bucket_st, bucket_ed_it);
+      const auto parts = verify_group(bucket);
+      stats.verify_split_cnt += parts.size() > 1;
+      for (const auto &part : parts) {
+        if (part.size() == 1 && bucket[part[0]].links().empty()) {
+          continue;
+        }
+        std::vector<std::filesystem::path> group;
+        for (const auto idx : part) {
+          auto &file = bucket[idx];
+          group.emplace_back(std::move(file.path()));
+          std::move(file.links().begin(), file.links().end(),
+                    std::back_inserter(group));
+        }
+        if (part.size() == 1) {
+          out.linked(std::move(group));
+        } else {
+          out.dupe(std::move(group));
+        }
+      }
+    }
+    bucket_st = bucket_ed_it;
+  }
+}
+
+void refine(buckets_t cur, uint32_t lvl, uint32_t dev, result_out_t &out,
+            const same_sz_ctx_t &ctx, stats_t &stats);
+
+/**
+ * @brief move buckets but the first to jobs of their own while threads of
+ * ctx.sched wait for work, so one large group doesn't run on one thread
+ *
+ * @param cur buckets, the ones kept are left
+ * @param lvl next block level
+ * @param dev device index of the group
+ */
+void hand_off(buckets_t &cur, const uint32_t lvl, const uint32_t dev,
+              result_out_t &out, const same_sz_ctx_t &ctx) {
+  const auto size = cur.files.front().size();
+  const auto remain = size - std::min(size, cur.files.front().blk_off(lvl));
+  buckets_t keep;
+  auto bucket_st = 0UL;
+  for (auto i = 0UL; i < cur.ed.size(); ++i) {
+    const auto bucket_ed = cur.ed[i];
+    const auto cost = remain * (bucket_ed - bucket_st);
+    auto st_it = cur.files.begin() + (std::ptrdiff_t)bucket_st;
+    auto ed_it = cur.files.begin() + (std::ptrdiff_t)bucket_ed;
+    if (i == 0 || cost < split_min_bytes || !ctx.sched->hungry()) {
+      std::move(st_it, ed_it, std::back_inserter(keep.files));
+      keep.ed.emplace_back(keep.files.size());
+    } else {
+      // std::function needs a copyable job, file_cmp_t is move only
+      auto part = std::make_shared<buckets_t>();
+      std::move(st_it, ed_it, std::back_inserter(part->files));
+      part->ed.emplace_back(part->files.size());
+      ctx.sched->post(dev, cost, [part, lvl, dev, &out, &ctx] {
+        stats_t stats;
+        refine(std::move(*part), lvl, dev, out, ctx, stats);
+        if (ctx.stats != nullptr) {
+          ctx.stats->add(stats);
+        }
+      });
+    }
+    bucket_st = bucket_ed;
+  }
+  cur = std::move(keep);
+}
+
+/**
+ * @brief hash block lvl and later of every candidate, one round per level,
+ * until buckets are settled, then report them
+ *
+ * @param cur buckets to refine
+ * @param lvl first block level to compare
+ * @param dev device index of the group for hand_off
+ * @param[out] out receiver of results
+ * @param ctx search settings
+ * @param[out] stats counters of the job
+ */
+void refine(buckets_t cur, uint32_t lvl, const uint32_t dev,
+            result_out_t &out, const same_sz_ctx_t &ctx, stats_t &stats) {
+  const auto max_hash = cur.files.empty() ? 0 : cur.files.front().max_hash();
+  for (; lvl < max_hash && !cur.files.empty(); ++lvl) {
+    uint64_t to_read = 0;
+    for (const auto &file : cur.files) {
+      to_read += file.valid() && file.hash_cnt() <= lvl;
+    }
+    hash_blk_batch(cur.files, lvl, ctx.io_depth, ctx.extent_order);
+    // files of a group share the size, every block read has the same length
+    uint64_t read_err = 0;
+    for (const auto &file : cur.files) {
+      read_err += !file.valid();
+    }
+    // capped schedules can run past the last level of stats
+    const auto stat_lvl = std::min(lvl, stats_t::max_lvl - 1);
+    stats.files_opened += to_read;
+    stats.read_error_cnt += read_err;
+    stats.blk_hashed[stat_lvl] += to_read - read_err;
+    stats.bytes_read[stat_lvl] +=
+        (to_read - read_err) * cur.files.front().blk_len(lvl);
+    split(cur, [lvl](const file_cmp_t &file) { return file.hash(lvl); },
+          stats.eliminated[stat_lvl], out, ctx);
+    if (ctx.sched != nullptr && cur.ed.size() > 1 && lvl + 1 < max_hash) {
+      hand_off(cur, lvl + 1, dev, out, ctx);
+    }
+  }
+  report(cur, out, ctx, stats);
+}
+
+}  // namespace
+
 void dedupe_same_sz(std::span<file_entry_t> file_list,
-                    std::vector<std::vector<std::filesystem::path>> &dupe_list,
-                    std::mutex &mtx) {
+                    const file_table_t &table, result_out_t &out,
+                    const same_sz_ctx_t &ctx) {
+  const auto start_time = std::chrono::steady_clock::now();
+  stats_t stats;
+  const auto dev = ctx.sched != nullptr ? ctx.sched->dev_of(file_list) : 0;
+  // collapse hard links by inode, only one file per inode is hashed
+  std::sort(file_list.begin(), file_list.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return std::pair(lhs.stat().dev, lhs.stat().ino) <
+                     std::pair(rhs.stat().dev, rhs.stat().ino);
+            });
+  auto same_inode = [](const file_entry_t &lhs, const file_entry_t &rhs) {
+    return lhs.stat().ino != 0 && lhs.stat().dev == rhs.stat().dev &&
+           lhs.stat().ino == rhs.stat().ino;
+  };
+
   // gernerate comparer for file list
-  std::vector<file_cmp_t> file_cmp_list;
-  file_cmp_list.reserve(file_list.size());
-  uint32_t max_hash =
-      (uint32_t)log2_ceil(div_ceil(file_list[0].size(), hash_blk_sz)) + 1;
-  for (auto &file : file_list) {
-    file_cmp_list.emplace_back(std::move(file), max_hash);
-  }
-
-  // detect duplicates
-  // sort file by hash
-  std::sort(file_cmp_list.begin(), file_cmp_list.end());
-  std::vector<std::vector<std::filesystem::path>> dupe_list_tmp;
-  {
-    // finding union of same file hash
-    auto union_st = file_cmp_list.begin();
+  // each round hashes block lvl of every candidate in one batch, then splits
+  // buckets by digest, files left alone in their bucket are unique
+  buckets_t cur;
+  cur.files.reserve(file_list.size());
+  for (auto it = file_list.begin(); it != file_list.end();) {
+    auto rep = it++;
+    auto &file_cmp = cur.files.emplace_back(*rep, table, ctx.layout, ctx.cache,
+                                            ctx.prehash, ctx.hash_algo);
+    for (; it != file_list.end() && same_inode(*it, *rep); ++it) {
+      file_cmp.links().emplace_back(table.path(*it));
+    }
+  }
+  cur.ed.emplace_back(cur.files.size());
+  if (cur.files.size() == 1) {
+    // all files are links of one inode, nothing to hash
+    out.linked(make_group(cur.files.begin(), cur.files.end()));
+    cur.files.clear();
+    cur.ed.clear();
+  }
+
+  // levels known to every file, from the cache or prehashing, split first
+  // so samples are only read for the buckets they leave
+  auto known = cur.files.empty() ? 0U : cur.files.front().max_hash();
+  for (const auto &file : cur.files) {
+    known = std::min(known, file.hash_cnt());
+  }
+  for (auto lvl = 0U; lvl < known && !cur.files.empty(); ++lvl) {
+    split(cur, [lvl](const file_cmp_t &file) { return file.hash(lvl); },
+          stats.eliminated[std::min(lvl, stats_t::max_lvl - 1)], out, ctx);
+  }
+
+  // samples first, unless all blocks are known already
+  const auto sample_offs = sample_offsets(ctx.sample, file_list[0].size());
+  if (!sample_offs.empty() &&
+      std::any_of(cur.files.begin(), cur.files.end(), [](const auto &file) {
+        return file.hash_cnt() < file.max_hash();
+      })) {
+    uint64_t read_err = 0;
+    for (auto &file : cur.files) {
+      read_err += !file.hash_samples(sample_offs, ctx.sample.len);
+    }
+    const auto unread_st = unread(cur);
+    const auto sampled = cur.files.size() - read_err;
+    stats.files_opened += cur.files.size();
+    stats.read_error_cnt += read_err;
+    stats.sample_hashed += sampled;
+    stats.sample_bytes_read += sampled * sample_offs.size() * ctx.sample.len;
+    split(cur, [](const file_cmp_t &file) { return file.sample_hash(); },
+          stats.sample_eliminated, out, ctx);
+    stats.sample_bytes_skipped += unread_st - unread(cur);
+  }
+
+  refine(std::move(cur), known, dev, out, ctx, stats);
+
+  if (ctx.stats != nullptr) {
+    // parts handed off to other jobs are not included
+    add_group_latency(
+        stats, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start_time)
+                   .count());
+    ctx.stats->add(stats);
+  }
+}
+
+uint64_t group_cost(std::span<const file_entry_t> files,
+                    const same_sz_ctx_t &ctx) {
+  const auto size = files.front().size();
+  if (ctx.cache == nullptr && ctx.prehash == nullptr) {
+    return size * files.size();
+  }
+  // files whose known first block is unique are settled without reads
+  std::vector<XXH128_hash_t> first;
+  uint64_t unknown = 0;
+  for (const auto &file : files) {
+    const auto &stat = file.stat();
+    const cache_key_t key{stat.dev, stat.ino, size, stat.mtime_ns,
+                          stat.ctime_ns};
+    std::span<const XXH128_hash_t> known;
+    if (ctx.cache != nullptr && stat.ino != 0) {
+      known = ctx.cache->lookup(key);
+    }
+    if (known.empty() && ctx.prehash != nullptr) {
+      known = ctx.prehash->lookup(key);
+    }
+    if (known.empty()) {
+      ++unknown;
+    } else {
+      first.emplace_back(known.front());
+    }
+  }
+  std::sort(first.begin(), first.end(), hash_lt);
+  uint64_t candidates = unknown;
+  for (auto st = 0UL; st < first.size();) {
+    auto ed = st + 1;
+    while (ed < first.size() && hash_eq(first[ed], first[st])) {
+      ++ed;
+    }
+    // a lone known digest can still match a file of unknown digest
+    candidates += ed - st > 1 || unknown != 0 ? ed - st : 0;
+    st = ed;
+  }
+  // count breaks ties of groups that read nothing
+  return size * candidates + files.size();
+}
+
+uint64_t dedupe_sorted(std::span<file_entry_t> file_list,
+                       const file_table_t &table, result_out_t &out,
+                       const same_sz_ctx_t &ctx, const uint32_t max_thread) {
+  uint64_t job_count = 0;
+  if (file_list.size() > 1) {
+    dev_sched_t sched(ctx.dev_limits, max_thread,
+                      ctx.stats != nullptr ? &ctx.stats->hash_queue : nullptr);
+    auto job_ctx = ctx;
+    job_ctx.sched = &sched;
+    // finding union of same file size
+    auto union_st = file_list.begin();
     auto union_ed = union_st + 1;
     while (true) {
-      if (union_ed == file_cmp_list.end() || *union_ed != *union_st) {
+      if (union_ed == file_list.end() || union_ed->size() != union_st->size()) {
         // end of union
         auto union_sz = std::distance(union_st, union_ed);
         if (union_sz > 1) {
-          // union size > 1, duplicates found
-          auto &group = dupe_list_tmp.emplace_back();
-          group.reserve((uint64_t)union_sz);
-          for (; union_st != union_ed; ++union_st) {
-            group.emplace_back(std::move(union_st->path()));
-          }
+          // dispatch to detect duplicates for same file size
+          // &(*) is workaround for libc++ bug
+          const auto files = std::span(&(*union_st), &(*union_ed));
+          sched.post(files, group_cost(files, ctx),
+                     [files, &table, &out, &job_ctx] {
+                       dedupe_same_sz(files, table, out, job_ctx);
+                     });
+          ++job_count;
         }
-        if (union_ed == file_cmp_list.end()) {
+        if (union_ed == file_list.end()) {
           break;
         }
         union_st = union_ed;
       }
       ++union_ed;
     }
+    oss(std::cerr) << "[log] job count: " << job_count << std::endl;
+    sched.run();
   }
+  return job_count;
+}
 
-  // append to global list
-  if (!dupe_list_tmp.empty()) {
-    std::lock_guard lk(mtx);
-    dupe_list.insert(dupe_list.end(),
-                     std::make_move_iterator(dupe_list_tmp.begin()),
-                     std::make_move_iterator(dupe_list_tmp.end()));
+void dedupe_groups(std::span<file_table_t> tables, result_out_t &out,
+                   const same_sz_ctx_t &ctx, const uint32_t max_thread) {
+  dev_sched_t sched(ctx.dev_limits, max_thread,
+                    ctx.stats != nullptr ? &ctx.stats->hash_queue : nullptr);
+  auto job_ctx = ctx;
+  job_ctx.sched = &sched;
+  for (auto &table : tables) {
+    sched.post(table.files(), group_cost(table.files(), ctx),
+               [&table, &out, &job_ctx] {
+                 dedupe_same_sz(table.files(), table, out, job_ctx);
+               });
   }
+  sched.run();
 }
 
 }  // namespace detail_v1_0_0
@@ -0,0 +1,192 @@
+#include "dev_sched.hh"
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "file_table.hh"
+#include "oss.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// 1 if dev is a rotational disk, 0 if not, -1 if unknown
+int rotational(const uint64_t dev) {
+  if (dev >> file_table_t::host_tag_shift != 0) {
+    // listed on another host
+    return -1;
+  }
+  const auto sys_path = "/sys/dev/block/" + std::to_string(major(dev)) + ':' +
+                        std::to_string(minor(dev));
+  // partitions take the flag of their disk
+  for (const auto *queue : {"/queue/rotational", "/../queue/rotational"}) {
+    std::ifstream ifs(sys_path + queue);
+    int flag = 0;
+    if (ifs >> flag) {
+      return flag != 0 ? 1 : 0;
+    }
+  }
+  return -1;
+}
+
+inline bool cost_lt(const std::pair<uint64_t, std::function<void()>> &lhs,
+                    const std::pair<uint64_t, std::function<void()>> &rhs) {
+  return lhs.first < rhs.first;
+}
+
+}  // namespace
+
+dev_sched_t::dev_sched_t(const dev_limits_t &limits, const uint32_t max_thread,
+                         queue_gauge_t *gauge)
+    : _max_thread(std::max(max_thread, 1U)),
+      _rotational(limits.rotational),
+      _solid(limits.solid),
+      _gauge(gauge) {
+  for (const auto &[path, limit] : limits.per_path) {
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0) {
+      oss(std::cerr) << "[warn] skip device limit: " << path << '\n';
+      continue;
+    }
+    _per_dev[st.st_dev] = limit;
+  }
+}
+
+uint32_t dev_sched_t::dev_idx(const uint64_t dev) {
+  auto [it, inserted] = _dev_idx.try_emplace(dev, (uint32_t)_devs.size());
+  if (!inserted) {
+    return it->second;
+  }
+  uint32_t limit = 0;
+  const char *kind = "set";
+  if (auto per_it = _per_dev.find(dev); per_it != _per_dev.end()) {
+    limit = per_it->second;
+  } else if (rotational(dev) == 1) {
+    limit = _rotational;
+    kind = "rotational";
+  } else {
+    limit = _solid;
+    kind = "solid";
+  }
+  limit = limit == 0 ? _max_thread : std::min(limit, _max_thread);
+  if (limit < _max_thread) {
+    oss(std::cerr) << "[log] device " << major(dev) << ':' << minor(dev)
+                   << ": " << kind << ", " << limit << " jobs\n";
+  }
+  _devs.push_back({dev, limit, 0, {}});
+  return it->second;
+}
+
+uint32_t dev_sched_t::dev_of(std::span<const file_entry_t> files) {
+  std::lock_guard lk(_mtx);
+  auto idx = dev_idx(files.front().stat().dev);
+  auto last_dev = files.front().stat().dev;
+  for (const auto &file : files) {
+    if (file.stat().dev == last_dev) {
+      continue;
+    }
+    last_dev = file.stat().dev;
+    const auto file_idx = dev_idx(last_dev);
+    if (_devs[file_idx].limit < _devs[idx].limit) {
+      idx = file_idx;
+    }
+  }
+  return idx;
+}
+
+void dev_sched_t::post(const uint32_t dev, const uint64_t cost,
+                       std::function<void()> job) {
+  if (_gauge != nullptr) {
+    _gauge->push();
+  }
+  {
+    std::lock_guard lk(_mtx);
+    auto &jobs = _devs[dev].jobs;
+    jobs.emplace_back(cost, std::move(job));
+    std::push_heap(jobs.begin(), jobs.end(), cost_lt);
+    ++_pending;
+  }
+  _cv.notify_one();
+}
+
+bool dev_sched_t::hungry() const {
+  std::lock_guard lk(_mtx);
+  return _idle > _pending;
+}
+
+std::function<void()> dev_sched_t::take(uint32_t &idx) {
+  std::unique_lock lk(_mtx);
+  while (_pending != 0 || _running != 0) {
+    // most expensive job of the devices below their limit
+    dev_t *best = nullptr;
+    for (auto &dev : _devs) {
+      if (!dev.jobs.empty() && dev.running < dev.limit &&
+          (best == nullptr ||
+           dev.jobs.front().first > best->jobs.front().first)) {
+        best = &dev;
+      }
+    }
+    if (best != nullptr) {
+      idx = (uint32_t)(best - _devs.data());
+      std::pop_heap(best->jobs.begin(), best->jobs.end(), cost_lt);
+      auto job = std::move(best->jobs.back().second);
+      best->jobs.pop_back();
+      ++best->running;
+      ++_running;
+      --_pending;
+      if (_gauge != nullptr) {
+        _gauge->pop();
+      }
+      return job;
+    }
+    // every device with jobs is at its limit, or running jobs may still
+    // queue more
+    ++_idle;
+    _cv.wait(lk);
+    --_idle;
+  }
+  return {};
+}
+
+void dev_sched_t::work() {
+  uint32_t idx = 0;
+  while (auto job = take(idx)) {
+    job();
+    {
+      std::lock_guard lk(_mtx);
+      --_devs[idx].running;
+      --_running;
+    }
+    _cv.notify_all();
+  }
+}
+
+void dev_sched_t::run() {
+  // threads past the sum of limits would only wait
+  uint64_t thread_cnt = 0;
+  for (const auto &dev : _devs) {
+    thread_cnt += dev.limit;
+  }
+  thread_cnt = std::min<uint64_t>(thread_cnt, _max_thread);
+  if (_pending == 0) {
+    return;
+  }
+  boost::asio::thread_pool pool(thread_cnt);
+  for (auto i = 0UL; i < thread_cnt; ++i) {
+    boost::asio::post(pool, [this] { work(); });
+  }
+  pool.join();
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
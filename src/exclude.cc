@@ -0,0 +1,164 @@
+#include "exclude.hh"
+
+#include <algorithm>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// pattern of form [.*]literal[.*], anchors at the ends are ignored
+struct literal_t {
+  std::string lit;
+  bool lead = false;
+  bool trail = false;
+};
+
+constexpr std::string_view syntax_chars = "^$\\.*+?()[]{}|/";
+
+std::optional<literal_t> parse_literal(std::string_view pattern) {
+  literal_t ret;
+  if (pattern.starts_with('^')) {
+    pattern.remove_prefix(1);
+  }
+  if (pattern.starts_with(".*")) {
+    ret.lead = true;
+    pattern.remove_prefix(2);
+  }
+  for (auto i = 0UL; i < pattern.size(); ++i) {
+    const auto ch = pattern[i];
+    if (ch == '\\') {
+      // only escaped syntax characters are literal, \d \w \1 etc. are not
+      if (i + 1 == pattern.size() ||
+          syntax_chars.find(pattern[i + 1]) == std::string_view::npos) {
+        return std::nullopt;
+      }
+      ret.lit += pattern[++i];
+    } else if (ch == '.' && pattern.substr(i) == ".*") {
+      ret.trail = true;
+      break;
+    } else if (ch == '.' && pattern.substr(i) == ".*$") {
+      ret.trail = true;
+      break;
+    } else if (ch == '$' && i + 1 == pattern.size()) {
+      break;
+    } else if (syntax_chars.find(ch) != std::string_view::npos &&
+               ch != '/') {
+      return std::nullopt;
+    } else {
+      ret.lit += ch;
+    }
+  }
+  if (ret.lit.empty()) {
+    return std::nullopt;
+  }
+  return ret;
+}
+
+bool has_back_ref(const std::string_view pattern) {
+  for (auto i = 0UL; i + 1 < pattern.size(); ++i) {
+    if (pattern[i] == '\\') {
+      if (pattern[i + 1] >= '1' && pattern[i + 1] <= '9') {
+        return true;
+      }
+      // skip escaped character
+      ++i;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+exclude_t::exclude_t(const std::vector<std::string> &patterns,
+                     const std::vector<std::regex> &regexes)
+    : _opaque(regexes) {
+  std::string combined;
+  for (const auto &pattern : patterns) {
+    // also validates pattern on its own, so it can't leak into others
+    _all.emplace_back(pattern);
+    if (has_back_ref(pattern)) {
+      _single.emplace_back(pattern);
+      continue;
+    }
+    auto literal = parse_literal(pattern);
+    if (!literal) {
+      if (!combined.empty()) {
+        combined += '|';
+      }
+      combined += "(?:" + pattern + ")";
+      continue;
+    }
+    auto &lit = literal->lit;
+    if (literal->lead && literal->trail) {
+      _contains.emplace_back(std::move(lit));
+    } else if (literal->trail) {
+      _prefixes.emplace_back(std::move(lit));
+    } else if (!literal->lead) {
+      _exact.emplace(std::move(lit));
+    } else if (lit.size() > 1 && lit[0] == '/' &&
+               lit.find('/', 1) == std::string::npos) {
+      // ".*/name" is the entry name
+      _names.emplace(lit.substr(1));
+    } else if (lit[0] == '.' &&
+               lit.find_first_of("./", 1) == std::string::npos) {
+      // ".*\.ext" is the entry extension
+      _exts.emplace(std::move(lit));
+    } else {
+      _suffixes.emplace_back(std::move(lit));
+    }
+  }
+  if (!combined.empty()) {
+    _combined.emplace(combined, std::regex::optimize);
+  }
+}
+
+bool exclude_t::empty() const noexcept {
+  return _all.empty() && _opaque.empty();
+}
+
+bool exclude_t::match(const std::string_view path) const {
+  auto regex_match = [path](const std::regex &regex) {
+    return std::regex_match(path.begin(), path.end(), regex);
+  };
+  if (!_all.empty()) {
+    if (path.find_first_of("\n\r") != std::string_view::npos) {
+      if (std::any_of(_all.begin(), _all.end(), regex_match)) {
+        return true;
+      }
+    } else {
+      const auto slash = path.rfind('/');
+      const auto name = path.substr(slash + 1);
+      const auto dot = name.rfind('.');
+      // ".*/name" needs the slash, a relative root may have none
+      if (_exact.contains(path) ||
+          (slash != std::string_view::npos && _names.contains(name)) ||
+          (dot != std::string_view::npos && _exts.contains(name.substr(dot)))) {
+        return true;
+      }
+      auto any_of = [](const auto &list, auto pred) {
+        return std::any_of(list.begin(), list.end(), pred);
+      };
+      if (any_of(_prefixes, [path](const auto &lit) {
+            return path.starts_with(lit);
+          }) ||
+          any_of(_suffixes,
+                 [path](const auto &lit) { return path.ends_with(lit); }) ||
+          any_of(_contains, [path](const auto &lit) {
+            return path.find(lit) != std::string_view::npos;
+          })) {
+        return true;
+      }
+      if ((_combined && regex_match(*_combined)) ||
+          std::any_of(_single.begin(), _single.end(), regex_match)) {
+        return true;
+      }
+    }
+  }
+  return std::any_of(_opaque.begin(), _opaque.end(), regex_match);
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
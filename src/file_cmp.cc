@@ -1,173 +1,262 @@
 #include "file_cmp.hh"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
-#include <exception>
+#include <cerrno>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
-#include <thread>
+#include <optional>
 #include <unordered_map>
 
 #include "config.hh"
+#include "hasher.hh"
 #include "oss.hh"
+#include "rsrc_man.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
-// RAII wrapper for xxhash library.
-class hasher_t {
-  XXH3_state_t *_state;
+namespace {
 
- public:
-  hasher_t() {
-    _state = XXH3_createState();
-    if (_state == nullptr) {
-      throw std::runtime_error("XXH3_createState failed");
-    }
+// per-thread read buffer and hasher for blocking reads
+struct hash_rsrc_t {
+  std::unique_ptr<char[]> buf = std::make_unique_for_overwrite<char[]>(buf_sz);
+  hasher_t hasher;
+};
+
+rsrc_man_t<hash_rsrc_t> rsrc_man;
+
+// 64KiB of zeros standing in for holes
+constexpr auto zero_buf_sz = 64UL * 1024UL;
+alignas(64) constexpr char zero_buf[zero_buf_sz] = {};
+
+void update_zero(hasher_t &hasher, uint64_t len) {
+  while (len > 0) {
+    const auto update_len = std::min(zero_buf_sz, len);
+    hasher.update(zero_buf, update_len);
+    len -= update_len;
   }
-  ~hasher_t() noexcept {
-    if (_state != nullptr) {
-      XXH3_freeState(_state);
+}
+
+// hash of len zero bytes with freshly reset hasher, blocks of one level
+// that are entirely holes share it, so it is computed once per length and
+// digest kind
+XXH128_hash_t zero_hash(const uint64_t len, hasher_t &hasher) {
+  static std::mutex mtx;
+  static std::unordered_map<uint64_t, XXH128_hash_t> known;
+  // lengths are below 2^62, kind goes in the top bits
+  const auto key = len | (uint64_t)hasher.kind() << 62U;
+  {
+    std::lock_guard lk(mtx);
+    if (auto it = known.find(key); it != known.end()) {
+      return it->second;
     }
   }
+  update_zero(hasher, len);
+  const auto hash = hasher.digest();
+  std::lock_guard lk(mtx);
+  known.emplace(key, hash);
+  return hash;
+}
 
-  hasher_t(const hasher_t &rhs) = delete;
-  hasher_t(hasher_t &&rhs) = delete;
-  hasher_t &operator=(const hasher_t &rhs) = delete;
-  hasher_t &operator=(hasher_t &&rhs) = delete;
-
-  void reset() {
-    if (XXH3_128bits_reset_withSeed(_state, hash_seed) == XXH_ERROR) {
-      throw std::runtime_error("XXH3_128bits_reset_withSeed failed");
+/**
+ * @brief hash [off, off + len) of fd reading only data ranges into freshly
+ * reset hasher, same hash as reading every byte
+ *
+ * @return nullopt on read error or if file is shorter than off + len
+ */
+std::optional<XXH128_hash_t> hash_sparse(const int fd, const uint64_t off,
+                                         const uint64_t len, char *buf,
+                                         hasher_t &hasher) {
+  const auto ed = off + len;
+  // next data at or after pos, ed if none before ed
+  auto next_data = [fd, ed](const uint64_t pos) -> std::optional<uint64_t> {
+    const auto data = ::lseek(fd, (off_t)pos, SEEK_DATA);
+    if (data >= 0) {
+      return std::min((uint64_t)data, ed);
     }
-  }
-  void update(const char *data, const uint64_t size) {
-    if (XXH3_128bits_update(_state, data, size) == XXH_ERROR) {
-      throw std::runtime_error("XXH3_128bits_update failed");
+    // no data up to eof, but eof must not be before ed
+    if (errno == ENXIO && ::lseek(fd, 0, SEEK_END) >= (off_t)ed) {
+      return ed;
     }
-  }
-  XXH128_hash_t digest() noexcept { return XXH3_128bits_digest(_state); }
-};
+    return std::nullopt;
+  };
 
-// resource manager
-class rsrc_man_t {
-  std::unordered_map<std::thread::id, std::pair<char *, hasher_t *>> rsrc_map;
-  std::shared_mutex rw_lck;
-
- public:
-  rsrc_man_t() = default;
-
-  // this is dangerous, make sure no one is using resource
-  void clear() noexcept {
-    std::unique_lock lck(rw_lck);
-    for (auto &rsrc : rsrc_map) {
-      auto &[buf, hasher] = rsrc.second;
-      delete[] buf;
-      delete hasher;
+  auto data = next_data(off);
+  if (!data) {
+    return std::nullopt;
+  }
+  if (*data == ed) {
+    return zero_hash(len, hasher);
+  }
+  auto pos = off;
+  while (pos < ed) {
+    update_zero(hasher, *data - pos);
+    pos = *data;
+    if (pos == ed) {
+      break;
     }
-    rsrc_map.clear();
-  }
-
-  auto get_rsrc() {
-    auto id = std::this_thread::get_id();
-    char *buf = nullptr;
-    hasher_t *hasher = nullptr;
-    {
-      std::shared_lock lck(rw_lck);
-      auto it = rsrc_map.find(id);
-      if (it != rsrc_map.end()) {
-        buf = it->second.first;
-        hasher = it->second.second;
-      }
+    const auto hole = ::lseek(fd, (off_t)pos, SEEK_HOLE);
+    if (hole < 0) {
+      return std::nullopt;
     }
-    if (buf == nullptr) {
-      buf = new char[buf_sz];
-      if (buf == nullptr) {
-        throw std::runtime_error("allocation failed");
-      }
-      hasher = new hasher_t;
-      if (hasher == nullptr) {
-        delete[] buf;
-        throw std::runtime_error("allocation failed");
-      }
-      {
-        std::unique_lock lck(rw_lck);
-        rsrc_map.emplace(id, std::make_pair(buf, hasher));
+    const auto data_ed = std::min((uint64_t)hole, ed);
+    while (pos < data_ed) {
+      const auto read_len =
+          ::pread(fd, buf, std::min(buf_sz, data_ed - pos), (off_t)pos);
+      if (read_len <= 0) {
+        return std::nullopt;
       }
+      hasher.update(buf, (uint64_t)read_len);
+      pos += (uint64_t)read_len;
+    }
+    if (pos < ed && !(data = next_data(pos))) {
+      return std::nullopt;
     }
-    return std::make_pair(buf, hasher);
   }
+  return hasher.digest();
+}
 
-  ~rsrc_man_t() noexcept { clear(); }
-};
+}  // namespace
 
-rsrc_man_t rsrc_man;
-
-std::strong_ordering file_cmp_t::operator<=>(const file_cmp_t &rhs) const {
-  // check for hard link equality
-  if (_hard_link_cnt > 1 && _hard_link_cnt == rhs._hard_link_cnt &&
-      std::filesystem::equivalent(_file_entry.path(), rhs._file_entry.path())) {
-    return std::strong_ordering::equal;
-  }
-  // compare hashes
-  std::strong_ordering cmp = std::strong_ordering::equal;
-  for (auto i = 0U; i < _max_hash; ++i) {
-    lazy_hash(i);
-    rhs.lazy_hash(i);
-    cmp = _file_hashes[i].high64 <=> rhs._file_hashes[i].high64;
-    if (cmp != std::strong_ordering::equal) {
-      break;
-    }
-    cmp = _file_hashes[i].low64 <=> rhs._file_hashes[i].low64;
-    if (cmp != std::strong_ordering::equal) {
-      break;
-    }
+std::vector<uint64_t> sample_offsets(const sample_opts_t &opts,
+                                     const uint64_t size) {
+  std::vector<uint64_t> offs;
+  if (opts.min_size == 0 || size < opts.min_size || opts.len == 0 ||
+      size < opts.len) {
+    return offs;
+  }
+  for (const auto point : opts.points) {
+    const auto off = size / 1000 * std::min(point, 1000U) +
+                     size % 1000 * std::min(point, 1000U) / 1000;
+    offs.emplace_back(std::min(off / opts.len * opts.len, size - opts.len));
   }
-  close_file();
-  rhs.close_file();
-  return cmp;
+  std::sort(offs.begin(), offs.end());
+  offs.erase(std::unique(offs.begin(), offs.end()), offs.end());
+  return offs;
 }
 
-void file_cmp_t::open_file() const noexcept {
-  if (!_file_stream.is_open()) {
-    _file_stream.open(_file_entry.path(), std::ios::binary);
-    auto processed = _file_entry.size() - _remain_sz;
-    _file_stream.seekg((int64_t)processed);
+void file_cmp_t::init(const hash_cache_t *cache,
+                      const prehash_t *prehash) noexcept {
+  const auto &stat = _file_entry.stat();
+  if (stat.ino == 0) {
+    // identity unknown, can't be cached
+    return;
+  }
+  _cache_key = {stat.dev, stat.ino, _file_entry.size(), stat.mtime_ns,
+                stat.ctime_ns};
+  _cacheable = true;
+  std::span<const XXH128_hash_t> known;
+  if (cache != nullptr) {
+    known = cache->lookup(_cache_key);
+    _cached_cnt = (uint32_t)std::min<uint64_t>(known.size(), _max_hash);
+  }
+  if (prehash != nullptr) {
+    auto prehashed = prehash->lookup(_cache_key);
+    if (prehashed.size() > known.size()) {
+      known = prehashed;
+    }
   }
+  const auto known_cnt = std::min<uint64_t>(known.size(), _max_hash);
+  _file_hashes.assign(known.begin(), known.begin() + (int64_t)known_cnt);
 }
 
-void file_cmp_t::close_file() const noexcept {
-  if (_file_stream.is_open()) {
-    _file_stream.close();
+void file_cmp_t::save_hash(hash_cache_t &cache) const {
+  if (_cacheable && _valid && _file_hashes.size() > _cached_cnt) {
+    cache.store(_cache_key, _file_hashes);
   }
 }
 
-void file_cmp_t::lazy_hash(const uint32_t idx) const {
+bool file_cmp_t::hash_blk(const uint32_t idx) {
+  if (!_valid) {
+    return false;
+  }
   if (idx < _file_hashes.size()) {
-    return;
+    return true;
+  }
+  const auto off = blk_off(idx);
+  auto remain = blk_len(idx);
+  auto &rsrc = rsrc_man.get_rsrc();
+  auto *buf = rsrc.buf.get();
+  auto &hasher = rsrc.hasher;
+  hasher.reset(_hash_algo, idx);
+
+  const int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && remain > 0 && _file_entry.sparse()) {
+    const auto hash = hash_sparse(fd, off, remain, buf, hasher);
+    ::close(fd);
+    if (!hash) {
+      set_invalid();
+      return false;
+    }
+    _file_hashes.emplace_back(*hash);
+    return true;
+  }
+  auto pos = (off_t)off;
+  while (fd >= 0 && remain > 0) {
+    const auto read_len = ::pread(fd, buf, std::min(buf_sz, remain), pos);
+    if (read_len <= 0) {
+      break;
+    }
+    hasher.update(buf, (uint64_t)read_len);
+    remain -= (uint64_t)read_len;
+    pos += read_len;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (fd < 0 || remain > 0) {
+    set_invalid();
+    return false;
+  }
+  _file_hashes.emplace_back(hasher.digest());
+  return true;
+}
+
+bool file_cmp_t::hash_samples(const std::span<const uint64_t> offs,
+                              const uint32_t len) {
+  if (!_valid) {
+    return false;
+  }
+  auto &rsrc = rsrc_man.get_rsrc();
+  auto *buf = rsrc.buf.get();
+  auto &hasher = rsrc.hasher;
+  hasher.reset();
+
+  const int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    set_invalid();
+    return false;
   }
-  open_file();
-  auto [buf, hasher] = rsrc_man.get_rsrc();
-  hasher->reset();
-
-  auto blk_sz =
-      std::min(idx == 0U ? hash_blk_sz : hash_blk_sz << (idx - 1U), _remain_sz);
-  _remain_sz -= blk_sz;
-
-  while (blk_sz > 0) {
-    const auto read_sz = std::min(buf_sz, blk_sz);
-    const auto read_len = _file_stream.read(buf, (int64_t)read_sz).gcount();
-    if (read_sz != (uint64_t)read_len) {
-      oss(std::cerr) << "[err] read error: " << _file_entry.path() << '\n';
-      _file_hashes.resize(_max_hash);
-      _remain_sz = 0;
-      return;
+  // random access, keep readahead from pulling in what follows each sample
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+  for (const auto off : offs) {
+    auto remain = (uint64_t)len;
+    auto pos = (off_t)off;
+    while (remain > 0) {
+      const auto read_len = ::pread(fd, buf, std::min(buf_sz, remain), pos);
+      if (read_len <= 0) {
+        ::close(fd);
+        set_invalid();
+        return false;
+      }
+      hasher.update(buf, (uint64_t)read_len);
+      remain -= (uint64_t)read_len;
+      pos += read_len;
     }
-    hasher->update(buf, read_sz);
-    blk_sz -= read_sz;
   }
-  _file_hashes.emplace_back(hasher->digest());
+  ::close(fd);
+  _sample_hash = hasher.digest();
+  return true;
+}
+
+void file_cmp_t::set_invalid() noexcept {
+  oss(std::cerr) << "[err] read error: " << _path << '\n';
+  _valid = false;
 }
 
 }  // namespace detail_v1_0_0
@@ -0,0 +1,87 @@
+#include "file_table.hh"
+
+#include <iterator>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+uint32_t file_table_t::add_root(std::string_view path) {
+  const auto name_off = _names.size();
+  _names.append(path);
+  return add_dir(no_parent, name_off, (uint32_t)path.size());
+}
+
+uint64_t file_table_t::append(std::string_view names,
+                              std::span<file_entry_t> files) {
+  const auto base = _names.size();
+  _names.append(names);
+  for (auto &file : files) {
+    file.rebase(base);
+  }
+  _files.insert(_files.end(), files.begin(), files.end());
+  return base;
+}
+
+uint32_t file_table_t::add_dir(const uint32_t parent, const uint64_t name_off,
+                               const uint32_t name_len) {
+  _dirs.push_back({name_off, name_len, parent});
+  return (uint32_t)(_dirs.size() - 1);
+}
+
+void file_table_t::append_table(const file_table_t &rhs,
+                                const uint64_t dev_tag) {
+  const auto dir_base = (uint32_t)_dirs.size();
+  const auto name_base = _names.size();
+  _names += rhs._names;
+  _dirs.reserve(_dirs.size() + rhs._dirs.size());
+  for (const auto &dir : rhs._dirs) {
+    _dirs.push_back({dir.name_off + name_base, dir.name_len,
+                     dir.parent == no_parent ? no_parent
+                                             : dir.parent + dir_base});
+  }
+  _files.reserve(_files.size() + rhs._files.size());
+  for (const auto &file : rhs._files) {
+    auto stat = file.stat();
+    stat.dev ^= dev_tag;
+    _files.emplace_back(file.parent() + dir_base, file.name_off() + name_base,
+                        file.name_len(), file.size(), stat, file.sparse());
+  }
+}
+
+void file_table_t::append_dir_path(const uint32_t dir,
+                                   std::string &out) const {
+  // walk up to root, then emit names top-down
+  uint32_t chain[256];
+  auto depth = 0U;
+  auto cur = dir;
+  while (cur != no_parent && depth < std::size(chain)) {
+    chain[depth++] = cur;
+    cur = _dirs[cur].parent;
+  }
+  if (cur != no_parent) {
+    // deeper than chain, build ancestors first
+    append_dir_path(cur, out);
+  }
+  while (depth > 0) {
+    const auto &node = _dirs[chain[--depth]];
+    if (!out.empty() && out.back() != '/') {
+      out += '/';
+    }
+    out.append(_names, node.name_off, node.name_len);
+  }
+}
+
+std::filesystem::path file_table_t::path(const file_entry_t &file) const {
+  std::string out;
+  append_dir_path(file.parent(), out);
+  if (!out.empty() && out.back() != '/') {
+    out += '/';
+  }
+  out += name(file);
+  return out;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,388 @@
+#include "hash_cache.hh"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <tuple>
+
+#include "config.hh"
+#include "oss.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+constexpr char cache_magic[8] = {'D', 'D', 'P', 'C', 'A', 'C', 'H', 'E'};
+// version 2 appends the block schedule, version 1 implies the default one
+constexpr uint32_t cache_version = 2;
+
+struct cache_hdr_t {
+  char magic[8];
+  uint32_t version;
+  // hash_algo_t, 0 for caches written before it was recorded
+  uint32_t hash_algo;
+  // first block of the schedule
+  uint64_t blk_sz;
+  uint64_t seed;
+  uint64_t rec_cnt;
+  uint64_t hash_cnt;
+  uint32_t growth;
+  // generation of the save that wrote it, 0 before it was recorded
+  uint32_t gen;
+  uint64_t max_blk;
+};
+
+// header of version 1, a prefix of version 2
+constexpr auto hdr_v1_sz = offsetof(cache_hdr_t, growth);
+
+inline bool same_file(const cache_key_t &lhs, const cache_key_t &rhs) noexcept {
+  return lhs.dev == rhs.dev && lhs.ino == rhs.ino;
+}
+
+// magic, version, seed and hash_algo match, hdr holds hdr_v1_sz bytes
+inline bool compatible(const cache_hdr_t &hdr,
+                       const hash_algo_t hash_algo) noexcept {
+  return std::memcmp(hdr.magic, cache_magic, sizeof(cache_magic)) == 0 &&
+         (hdr.version == 1 || hdr.version == cache_version) &&
+         hdr.seed == hash_seed && hdr.hash_algo == (uint32_t)hash_algo;
+}
+
+// schedule of a compatible header, version 1 implies the default one
+inline blk_sched_t hdr_sched(const cache_hdr_t &hdr) noexcept {
+  blk_sched_t sched;
+  sched.first_blk = hdr.blk_sz;
+  if (hdr.version != 1) {
+    sched.growth = hdr.growth;
+    sched.max_blk = hdr.max_blk;
+  }
+  return sched;
+}
+
+inline std::string err_msg(const int err) {
+  return std::error_code(err, std::system_category()).message();
+}
+
+// write all of buf, retried on short writes
+bool write_all(const int fd, const void *buf, const uint64_t len) noexcept {
+  const auto *data = static_cast<const char *>(buf);
+  for (auto off = 0UL; off < len;) {
+    const auto write_len = ::write(fd, data + off, len - off);
+    if (write_len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    off += (uint64_t)write_len;
+  }
+  return true;
+}
+
+inline std::unique_ptr<std::atomic<uint8_t>[]> new_seen(const uint64_t cnt) {
+  return std::make_unique<std::atomic<uint8_t>[]>(cnt);
+}
+
+}  // namespace
+
+hash_cache_t::hash_cache_t(std::filesystem::path path,
+                           const hash_algo_t hash_algo,
+                           const blk_sched_t &blk_sched)
+    : _path(std::move(path)), _hash_algo(hash_algo), _blk_sched(blk_sched) {
+  if (!_path.empty()) {
+    load();
+  }
+}
+
+hash_cache_t::~hash_cache_t() noexcept { unload(); }
+
+void hash_cache_t::load() {
+  int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    oss(std::cerr) << "[log] new cache: " << _path << '\n';
+    return;
+  }
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || (uint64_t)st.st_size < hdr_v1_sz) {
+    ::close(fd);
+    oss(std::cerr) << "[warn] ignore invalid cache: " << _path << '\n';
+    return;
+  }
+  _map_sz = (uint64_t)st.st_size;
+  _map = ::mmap(nullptr, _map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (_map == MAP_FAILED) {
+    _map = nullptr;
+    oss(std::cerr) << "[warn] ignore invalid cache: " << _path << '\n';
+    return;
+  }
+
+  const auto *hdr = static_cast<const cache_hdr_t *>(_map);
+  const auto hdr_sz = hdr->version == 1 ? hdr_v1_sz : sizeof(cache_hdr_t);
+  const auto expect_sz = hdr_sz + hdr->rec_cnt * sizeof(cache_rec_t) +
+                         hdr->hash_cnt * sizeof(XXH128_hash_t);
+  if (!compatible(*hdr, _hash_algo) ||
+      hdr->rec_cnt > _map_sz / sizeof(cache_rec_t) ||
+      hdr->hash_cnt > _map_sz / sizeof(XXH128_hash_t) || expect_sz != _map_sz) {
+    // different format or hash parameters, start over
+    oss(std::cerr) << "[warn] ignore incompatible cache: " << _path << '\n';
+    unload();
+    return;
+  }
+  const auto sched = hdr_sched(*hdr);
+  if (sched.first_blk != _blk_sched.first_blk ||
+      sched.growth != _blk_sched.growth ||
+      sched.max_blk != _blk_sched.max_blk) {
+    // every chain is cut at other block boundaries
+    oss(std::cerr) << "[warn] ignore cache of block schedule "
+                   << sched.first_blk << ", growth " << sched.growth
+                   << ", cap " << sched.max_blk << ", searching with "
+                   << _blk_sched.first_blk << ", growth " << _blk_sched.growth
+                   << ", cap " << _blk_sched.max_blk
+                   << ", all files are hashed again: " << _path << '\n';
+    unload();
+    return;
+  }
+  const auto gen = hdr->version == 1 ? 0U : hdr->gen;
+  _rec_cnt = hdr->rec_cnt;
+  _hash_cnt = hdr->hash_cnt;
+  _recs = reinterpret_cast<const cache_rec_t *>(
+      static_cast<const char *>(_map) + hdr_sz);
+  _hashes = reinterpret_cast<const XXH128_hash_t *>(_recs + _rec_cnt);
+  if (!valid()) {
+    // lookup and save trust order and bounds of records
+    oss(std::cerr) << "[warn] ignore invalid cache: " << _path << '\n';
+    unload();
+    return;
+  }
+  _gen = gen + 1;
+  _seen = new_seen(_rec_cnt);
+}
+
+std::optional<blk_sched_t> hash_cache_t::read_sched(
+    const std::filesystem::path &path, const hash_algo_t hash_algo) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  cache_hdr_t hdr{};
+  const auto read_len = ::pread(fd, &hdr, sizeof(hdr), 0);
+  ::close(fd);
+  if (read_len < (int64_t)hdr_v1_sz || !compatible(hdr, hash_algo) ||
+      (hdr.version != 1 && read_len != (int64_t)sizeof(hdr))) {
+    return std::nullopt;
+  }
+  return hdr_sched(hdr);
+}
+
+bool hash_cache_t::valid() const noexcept {
+  for (auto i = 0UL; i < _rec_cnt; ++i) {
+    const auto &rec = _recs[i];
+    if (rec.hash_off > _hash_cnt || rec.hash_cnt > _hash_cnt - rec.hash_off ||
+        (i != 0 && !(_recs[i - 1].key < rec.key))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void hash_cache_t::unload() noexcept {
+  if (_map != nullptr) {
+    ::munmap(_map, _map_sz);
+  }
+  _map = nullptr;
+  _map_sz = 0;
+  _recs = nullptr;
+  _rec_cnt = 0;
+  _hashes = nullptr;
+  _hash_cnt = 0;
+  _own_recs = {};
+  _own_hashes = {};
+  _seen.reset();
+}
+
+std::span<const XXH128_hash_t> hash_cache_t::lookup(
+    const cache_key_t &key) const noexcept {
+  const auto *recs_ed = _recs + _rec_cnt;
+  const auto *rec = std::lower_bound(
+      _recs, recs_ed, key,
+      [](const cache_rec_t &lhs, const cache_key_t &rhs) {
+        return lhs.key < rhs;
+      });
+  if (rec == recs_ed || rec->key != key) {
+    return {};
+  }
+  _seen[rec - _recs].store(1, std::memory_order_relaxed);
+  return {_hashes + rec->hash_off, rec->hash_cnt};
+}
+
+void hash_cache_t::store(const cache_key_t &key,
+                         std::span<const XXH128_hash_t> hashes) {
+  if (hashes.empty()) {
+    return;
+  }
+  std::vector<XXH128_hash_t> chain(hashes.begin(), hashes.end());
+  std::lock_guard lk(_mtx);
+  _updates.emplace_back(key, std::move(chain));
+}
+
+void hash_cache_t::merge(const bool full) {
+  std::lock_guard lk(_mtx);
+  // by file, its newest version and longest chain first, which the merge
+  // keeps
+  std::sort(_updates.begin(), _updates.end(),
+            [](const auto &lhs, const auto &rhs) {
+              const auto &l = lhs.first;
+              const auto &r = rhs.first;
+              return std::make_tuple(l.dev, l.ino, r.ctime_ns, r.mtime_ns,
+                                     r.size, rhs.second.size()) <
+                     std::make_tuple(r.dev, r.ino, l.ctime_ns, l.mtime_ns,
+                                     l.size, lhs.second.size());
+            });
+
+  // merge previous records with updates, both sorted by key,
+  // previous versions of an updated file are dropped, so are records not
+  // looked up for cache_max_age full merges
+  std::vector<cache_rec_t> recs;
+  std::vector<XXH128_hash_t> hashes;
+  recs.reserve(_rec_cnt + _updates.size());
+  auto emit = [&](const cache_key_t &key,
+                  std::span<const XXH128_hash_t> chain, const uint32_t gen) {
+    recs.push_back({key, hashes.size(), (uint32_t)chain.size(), gen});
+    hashes.insert(hashes.end(), chain.begin(), chain.end());
+  };
+  uint64_t expired_cnt = 0;
+  auto old_it = _recs;
+  const auto old_ed = _recs + _rec_cnt;
+  auto new_it = _updates.cbegin();
+  while (old_it != old_ed || new_it != _updates.cend()) {
+    if (new_it == _updates.cend() ||
+        (old_it != old_ed && old_it->key.dev < new_it->first.dev) ||
+        (old_it != old_ed && old_it->key.dev == new_it->first.dev &&
+         old_it->key.ino < new_it->first.ino)) {
+      const auto gen =
+          _seen[old_it - _recs].load(std::memory_order_relaxed) != 0
+              ? _gen
+              : old_it->gen;
+      if (!full || _gen - gen <= cache_max_age) {
+        emit(old_it->key, {_hashes + old_it->hash_off, old_it->hash_cnt},
+             gen);
+      } else {
+        ++expired_cnt;
+      }
+      ++old_it;
+      continue;
+    }
+    // updated file replaces its previous versions
+    const auto &key = new_it->first;
+    while (old_it != old_ed && same_file(old_it->key, key)) {
+      ++old_it;
+    }
+    emit(key, new_it->second, _gen);
+    while (new_it != _updates.cend() && same_file(new_it->first, key)) {
+      ++new_it;
+    }
+  }
+
+  unload();
+  _own_recs = std::move(recs);
+  _own_hashes = std::move(hashes);
+  _recs = _own_recs.data();
+  _rec_cnt = _own_recs.size();
+  _hashes = _own_hashes.data();
+  _hash_cnt = _own_hashes.size();
+  _seen = new_seen(_rec_cnt);
+  // a partial merge did not look up every file it could have
+  if (full) {
+    ++_gen;
+  }
+  _unsaved_cnt += _updates.size();
+  _updates.clear();
+  _dirty = true;
+  oss(std::cerr) << "[log] cache entries: " << _rec_cnt << ", expired "
+                 << expired_cnt << '\n';
+}
+
+void hash_cache_t::flush() {
+  if (!_dirty || _path.empty()) {
+    return;
+  }
+  write(_own_recs, _own_hashes);
+  _dirty = false;
+  _unsaved_cnt = 0;
+}
+
+void hash_cache_t::save(const bool full) {
+  merge(full);
+  flush();
+}
+
+void hash_cache_t::write(const std::vector<cache_rec_t> &recs,
+                         const std::vector<XXH128_hash_t> &hashes) const {
+  cache_hdr_t hdr{};
+  std::memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+  hdr.version = cache_version;
+  hdr.blk_sz = _blk_sched.first_blk;
+  hdr.growth = _blk_sched.growth;
+  hdr.max_blk = _blk_sched.max_blk;
+  hdr.seed = hash_seed;
+  hdr.hash_algo = (uint32_t)_hash_algo;
+  hdr.rec_cnt = recs.size();
+  hdr.hash_cnt = hashes.size();
+  hdr.gen = _gen;
+
+  // unique temporary name beside the cache, created with O_EXCL
+  auto tmp_path = _path.native() + ".XXXXXX";
+  const int fd = ::mkostemp(tmp_path.data(), O_CLOEXEC);
+  if (fd < 0) {
+    oss(std::cerr) << "[err] failed to write cache: " << _path << " - "
+                   << err_msg(errno) << '\n';
+    return;
+  }
+  // synced before rename, so a crash leaves the old or the new cache
+  bool ok =
+      write_all(fd, &hdr, sizeof(hdr)) &&
+      write_all(fd, recs.data(), recs.size() * sizeof(cache_rec_t)) &&
+      write_all(fd, hashes.data(), hashes.size() * sizeof(XXH128_hash_t)) &&
+      ::fsync(fd) == 0;
+  auto err = errno;
+  if (::close(fd) != 0 && ok) {
+    ok = false;
+    err = errno;
+  }
+  if (!ok) {
+    oss(std::cerr) << "[err] failed to write cache: " << tmp_path << " - "
+                   << err_msg(err) << '\n';
+    ::unlink(tmp_path.c_str());
+    return;
+  }
+  if (::rename(tmp_path.c_str(), _path.c_str()) != 0) {
+    oss(std::cerr) << "[err] failed to write cache: " << _path << " - "
+                   << err_msg(errno) << '\n';
+    ::unlink(tmp_path.c_str());
+    return;
+  }
+  // persist the rename
+  const auto dir = _path.has_parent_path() ? _path.parent_path()
+                                           : std::filesystem::path(".");
+  const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    ::fsync(dir_fd);
+    ::close(dir_fd);
+  }
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,458 @@
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "config.hh"
+#include "dedupe.hh"
+#include "oss.hh"
+#include "verify.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// length of one FIDEDUPERANGE call, filesystems cap it anyway
+constexpr uint64_t dedupe_range_sz = 16UL * 1024UL * 1024UL;
+
+// closes fd on scope exit
+class fd_t {
+  int _fd = -1;
+
+ public:
+  explicit fd_t(const int fd = -1) noexcept : _fd(fd) {}
+  ~fd_t() noexcept {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+  fd_t(const fd_t &) = delete;
+  fd_t &operator=(const fd_t &) = delete;
+
+  int get() const noexcept { return _fd; }
+  bool valid() const noexcept { return _fd >= 0; }
+};
+
+// a group member, opened relative to its parent directory
+struct member_t {
+  const std::filesystem::path *path = nullptr;
+  std::string name;
+  struct statx stx {};
+  bool valid = false;
+};
+
+struct counter_t {
+  std::atomic<uint64_t> linked{0};
+  std::atomic<uint64_t> skipped{0};
+  std::atomic<uint64_t> failed{0};
+  std::atomic<uint64_t> bytes{0};
+};
+
+enum class status_t { ok, unsupported, failed };
+
+inline std::string err_msg(const int err) {
+  return std::error_code(err, std::system_category()).message();
+}
+
+inline bool same_inode(const struct statx &lhs, const struct statx &rhs) {
+  return lhs.stx_dev_major == rhs.stx_dev_major &&
+         lhs.stx_dev_minor == rhs.stx_dev_minor && lhs.stx_ino == rhs.stx_ino;
+}
+
+inline bool same_dev(const struct statx &lhs, const struct statx &rhs) {
+  return lhs.stx_dev_major == rhs.stx_dev_major &&
+         lhs.stx_dev_minor == rhs.stx_dev_minor;
+}
+
+// unchanged since stat-ed
+inline bool unchanged(const struct statx &lhs, const struct statx &rhs) {
+  return same_inode(lhs, rhs) && lhs.stx_size == rhs.stx_size &&
+         lhs.stx_mtime.tv_sec == rhs.stx_mtime.tv_sec &&
+         lhs.stx_mtime.tv_nsec == rhs.stx_mtime.tv_nsec &&
+         lhs.stx_ctime.tv_sec == rhs.stx_ctime.tv_sec &&
+         lhs.stx_ctime.tv_nsec == rhs.stx_ctime.tv_nsec;
+}
+
+inline int64_t age_key(const struct statx &stx) {
+  const auto &ts =
+      (stx.stx_mask & STATX_BTIME) != 0 ? stx.stx_btime : stx.stx_mtime;
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+bool is_under(const std::filesystem::path &path,
+              const std::filesystem::path &dir) {
+  auto norm = dir.lexically_normal();
+  if (!norm.has_filename()) {
+    norm = norm.parent_path();
+  }
+  const auto file = path.lexically_normal();
+  return std::mismatch(norm.begin(), norm.end(), file.begin(), file.end())
+             .first == norm.end();
+}
+
+std::size_t pick_keeper(const std::vector<member_t> &members,
+                        const link_opts_t &opts) {
+  auto valid_ed = members.size();
+  auto oldest = [&] {
+    auto keeper = valid_ed;
+    for (auto i = 0UL; i < members.size(); ++i) {
+      if (members[i].valid &&
+          (keeper == valid_ed ||
+           age_key(members[i].stx) < age_key(members[keeper].stx))) {
+        keeper = i;
+      }
+    }
+    return keeper;
+  };
+  switch (opts.keeper) {
+    case keeper_t::shortest_path: {
+      auto keeper = valid_ed;
+      for (auto i = 0UL; i < members.size(); ++i) {
+        if (members[i].valid &&
+            (keeper == valid_ed || members[i].path->native().size() <
+                                       members[keeper].path->native().size())) {
+          keeper = i;
+        }
+      }
+      return keeper;
+    }
+    case keeper_t::preferred:
+      for (auto i = 0UL; i < members.size(); ++i) {
+        if (members[i].valid &&
+            is_under(*members[i].path, opts.preferred_dir)) {
+          return i;
+        }
+      }
+      return oldest();
+    case keeper_t::oldest:
+    default:
+      return oldest();
+  }
+}
+
+// content of fd equal to keeper, both of size
+bool same_content(const int keeper_fd, const int fd, const uint64_t size) {
+  auto lhs = std::make_unique_for_overwrite<char[]>(verify_blk_sz);
+  auto rhs = std::make_unique_for_overwrite<char[]>(verify_blk_sz);
+  for (uint64_t off = 0; off < size;) {
+    const auto len = std::min(verify_blk_sz, size - off);
+    for (auto [fd_i, buf] : {std::pair(keeper_fd, lhs.get()),
+                             std::pair(fd, rhs.get())}) {
+      for (uint64_t done = 0; done < len;) {
+        const auto ret =
+            ::pread(fd_i, buf + done, len - done, (off_t)(off + done));
+        if (ret <= 0) {
+          return false;
+        }
+        done += (uint64_t)ret;
+      }
+    }
+    if (!bytes_equal(lhs.get(), rhs.get(), len)) {
+      return false;
+    }
+    off += len;
+  }
+  return true;
+}
+
+// share extents of keeper in place, kernel compares content first
+status_t dedupe_range(const int keeper_fd, const int dir_fd,
+                      const member_t &dupe) {
+  auto fd_num =
+      ::openat(dir_fd, dupe.name.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd_num < 0) {
+    // owner may dedupe into read-only fd
+    fd_num =
+        ::openat(dir_fd, dupe.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  }
+  const fd_t fd(fd_num);
+  if (!fd.valid()) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(errno) << '\n';
+    return status_t::failed;
+  }
+  // room for one destination after the header
+  alignas(file_dedupe_range) char
+      buf[sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info)];
+  auto &range = *reinterpret_cast<file_dedupe_range *>(buf);
+  auto &info =
+      *reinterpret_cast<file_dedupe_range_info *>(buf + sizeof(range));
+  for (uint64_t off = 0; off < dupe.stx.stx_size;) {
+    std::memset(buf, 0, sizeof(buf));
+    range.src_offset = off;
+    range.src_length =
+        std::min(dedupe_range_sz, (uint64_t)(dupe.stx.stx_size - off));
+    range.dest_count = 1;
+    info.dest_fd = fd.get();
+    info.dest_offset = off;
+    if (::ioctl(keeper_fd, FIDEDUPERANGE, &range) != 0) {
+      const auto err = errno;
+      if (off == 0 && (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL ||
+                       err == EXDEV)) {
+        return status_t::unsupported;
+      }
+      oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                     << err_msg(err) << '\n';
+      return status_t::failed;
+    }
+    if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+      oss(std::cerr) << "[err] failed to link: " << *dupe.path
+                     << " - content differs\n";
+      return status_t::failed;
+    }
+    if (info.status < 0 || info.bytes_deduped == 0) {
+      const auto err = info.status < 0 ? -info.status : EIO;
+      if (off == 0 && (err == EOPNOTSUPP || err == EINVAL)) {
+        return status_t::unsupported;
+      }
+      oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                     << err_msg(err) << '\n';
+      return status_t::failed;
+    }
+    off += info.bytes_deduped;
+  }
+  return status_t::ok;
+}
+
+// unique name beside dupe for building its replacement
+std::string tmp_name() {
+  static std::atomic<uint64_t> cnt{0};
+  return ".dedupe." + std::to_string(::getpid()) + "." +
+         std::to_string(cnt.fetch_add(1, std::memory_order_relaxed)) + ".tmp";
+}
+
+// content check before a replacement that doesn't compare by itself
+bool check_dupe(const int keeper_fd, const int dir_fd, const member_t &dupe,
+                const link_opts_t &opts) {
+  fd_t fd(::openat(dir_fd, dupe.name.c_str(),
+                   O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+  struct statx stx {};
+  if (!fd.valid() ||
+      ::statx(fd.get(), "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx) != 0) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(errno) << '\n';
+    return false;
+  }
+  if (!unchanged(stx, dupe.stx)) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path
+                   << " - changed since stat\n";
+    return false;
+  }
+  if (opts.verify && !same_content(keeper_fd, fd.get(), stx.stx_size)) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path
+                   << " - content differs\n";
+    return false;
+  }
+  return true;
+}
+
+// rename tmp over dupe, remove tmp on failure
+bool rename_over(const int dir_fd, const std::string &tmp,
+                 const member_t &dupe) {
+  if (::renameat(dir_fd, tmp.c_str(), dir_fd, dupe.name.c_str()) != 0) {
+    const auto err = errno;
+    ::unlinkat(dir_fd, tmp.c_str(), 0);
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(err) << '\n';
+    return false;
+  }
+  return true;
+}
+
+// clone keeper to tmp with metadata of dupe, then rename over dupe
+status_t clone_over(const int keeper_fd, const int dir_fd,
+                    const member_t &dupe, const link_opts_t &opts) {
+  const auto tmp = tmp_name();
+  fd_t fd(::openat(dir_fd, tmp.c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                   dupe.stx.stx_mode & 07777));
+  if (!fd.valid()) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(errno) << '\n';
+    return status_t::failed;
+  }
+  if (::ioctl(fd.get(), FICLONE, keeper_fd) != 0) {
+    const auto err = errno;
+    ::unlinkat(dir_fd, tmp.c_str(), 0);
+    if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV) {
+      return status_t::unsupported;
+    }
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(err) << '\n';
+    return status_t::failed;
+  }
+  // owner change needs privilege, keep going without it
+  (void)::fchown(fd.get(), dupe.stx.stx_uid, dupe.stx.stx_gid);
+  ::fchmod(fd.get(), dupe.stx.stx_mode & 07777);
+  const timespec times[2] = {
+      {dupe.stx.stx_atime.tv_sec, dupe.stx.stx_atime.tv_nsec},
+      {dupe.stx.stx_mtime.tv_sec, dupe.stx.stx_mtime.tv_nsec}};
+  ::futimens(fd.get(), times);
+  if (!check_dupe(keeper_fd, dir_fd, dupe, opts)) {
+    ::unlinkat(dir_fd, tmp.c_str(), 0);
+    return status_t::failed;
+  }
+  return rename_over(dir_fd, tmp, dupe) ? status_t::ok : status_t::failed;
+}
+
+// hard link keeper to tmp, checked against keeper_fd, then rename over dupe
+status_t hardlink_over(const int keeper_fd, const int keeper_dir_fd,
+                       const member_t &keeper, const int dir_fd,
+                       const member_t &dupe, const link_opts_t &opts) {
+  if (!check_dupe(keeper_fd, dir_fd, dupe, opts)) {
+    return status_t::failed;
+  }
+  const auto tmp = tmp_name();
+  if (::linkat(keeper_dir_fd, keeper.name.c_str(), dir_fd, tmp.c_str(), 0) !=
+      0) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                   << err_msg(errno) << '\n';
+    return status_t::failed;
+  }
+  // keeper was linked by name, it may have been replaced since it was
+  // opened, the link must be the inode compared through keeper_fd
+  struct statx keeper_stx {};
+  struct statx tmp_stx {};
+  if (::statx(keeper_fd, "", AT_EMPTY_PATH, STATX_INO, &keeper_stx) != 0 ||
+      ::statx(dir_fd, tmp.c_str(), AT_SYMLINK_NOFOLLOW, STATX_INO,
+              &tmp_stx) != 0 ||
+      !same_inode(keeper_stx, tmp_stx)) {
+    oss(std::cerr) << "[err] failed to link: " << *dupe.path
+                   << " - keeper changed\n";
+    ::unlinkat(dir_fd, tmp.c_str(), 0);
+    return status_t::failed;
+  }
+  return rename_over(dir_fd, tmp, dupe) ? status_t::ok : status_t::failed;
+}
+
+fd_t open_parent(const std::filesystem::path &path) {
+  const auto parent = path.parent_path();
+  return fd_t(::open(parent.empty() ? "." : parent.c_str(),
+                     O_PATH | O_DIRECTORY | O_CLOEXEC));
+}
+
+void link_group(const std::vector<std::filesystem::path> &group,
+                const link_opts_t &opts, counter_t &cnt) {
+  std::vector<member_t> members(group.size());
+  for (auto i = 0UL; i < group.size(); ++i) {
+    auto &member = members[i];
+    member.path = &group[i];
+    member.name = group[i].filename().native();
+    member.valid =
+        ::statx(AT_FDCWD, group[i].c_str(), AT_SYMLINK_NOFOLLOW,
+                STATX_BASIC_STATS | STATX_BTIME, &member.stx) == 0 &&
+        S_ISREG(member.stx.stx_mode);
+    if (!member.valid) {
+      oss(std::cerr) << "[err] failed to link: " << group[i]
+                     << " - not a regular file\n";
+      cnt.failed.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  const auto keeper_idx = pick_keeper(members, opts);
+  if (keeper_idx == members.size()) {
+    return;
+  }
+  const auto &keeper = members[keeper_idx];
+  const auto keeper_dir = open_parent(*keeper.path);
+  const fd_t keeper_fd(
+      keeper_dir.valid()
+          ? ::openat(keeper_dir.get(), keeper.name.c_str(),
+                     O_RDONLY | O_NOFOLLOW | O_CLOEXEC)
+          : -1);
+  if (!keeper_fd.valid()) {
+    oss(std::cerr) << "[err] failed to open keeper: " << *keeper.path << " - "
+                   << err_msg(errno) << '\n';
+    cnt.failed.fetch_add(members.size() - 1, std::memory_order_relaxed);
+    return;
+  }
+
+  for (auto i = 0UL; i < members.size(); ++i) {
+    const auto &dupe = members[i];
+    if (i == keeper_idx || !dupe.valid) {
+      continue;
+    }
+    if (same_inode(dupe.stx, keeper.stx)) {
+      cnt.skipped.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    auto status = status_t::failed;
+    if (!same_dev(dupe.stx, keeper.stx) ||
+        dupe.stx.stx_size != keeper.stx.stx_size) {
+      oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                     << (same_dev(dupe.stx, keeper.stx) ? "size differs"
+                                                        : "other device")
+                     << '\n';
+    } else if (const auto dir = open_parent(*dupe.path); !dir.valid()) {
+      oss(std::cerr) << "[err] failed to link: " << *dupe.path << " - "
+                     << err_msg(errno) << '\n';
+    } else {
+      status = status_t::unsupported;
+      if (opts.mode != link_mode_t::hardlink) {
+        status = dedupe_range(keeper_fd.get(), dir.get(), dupe);
+        if (status == status_t::unsupported) {
+          status = clone_over(keeper_fd.get(), dir.get(), dupe, opts);
+        }
+        if (status == status_t::unsupported &&
+            opts.mode == link_mode_t::reflink) {
+          oss(std::cerr) << "[err] failed to link: " << *dupe.path
+                         << " - reflink unsupported\n";
+          status = status_t::failed;
+        }
+      }
+      if (status == status_t::unsupported) {
+        status = hardlink_over(keeper_fd.get(), keeper_dir.get(), keeper,
+                               dir.get(), dupe, opts);
+      }
+    }
+    if (status == status_t::ok) {
+      cnt.linked.fetch_add(1, std::memory_order_relaxed);
+      cnt.bytes.fetch_add(dupe.stx.stx_size, std::memory_order_relaxed);
+    } else {
+      cnt.failed.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+}  // namespace
+
+link_result_t DEDUPE_EXPORT link_dupes(
+    const std::vector<std::vector<std::filesystem::path>> &groups,
+    const link_opts_t &opts) {
+  counter_t cnt;
+  {
+    boost::asio::thread_pool pool(std::max(opts.max_thread, 1U));
+    for (const auto &group : groups) {
+      if (group.size() > 1) {
+        boost::asio::post(
+            pool, [&group, &opts, &cnt] { link_group(group, opts, cnt); });
+      }
+    }
+    pool.join();
+  }
+  link_result_t result;
+  result.linked_cnt = cnt.linked;
+  result.skipped_cnt = cnt.skipped;
+  result.failed_cnt = cnt.failed;
+  result.byte_cnt = cnt.bytes;
+  return result;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
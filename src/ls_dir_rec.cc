@@ -1,71 +1,316 @@
 #include "ls_dir_rec.hh"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <boost/asio.hpp>
-#include <functional>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
 
+#include "config.hh"
 #include "oss.hh"
+#include "rsrc_man.hh"
 
 namespace dedupe {
 
 inline namespace detail_v1_0_0 {
 
-void ls_dir_rec(const std::filesystem::path dir,
-                std::vector<file_entry_t> &file_list, std::mutex &mtx,
-                boost::asio::thread_pool &pool,
-                const std::vector<std::regex> &exclude_regex) {
+namespace {
+
+// 256KiB, fits thousands of entries per getdents64 call
+constexpr auto dirent_buf_sz = 256UL * 1024UL;
+
+struct dirent_rsrc_t {
+  std::unique_ptr<char[]> buf =
+      std::make_unique_for_overwrite<char[]>(dirent_buf_sz);
+};
+
+rsrc_man_t<dirent_rsrc_t> dirent_rsrc_man;
+
+inline std::string err_msg(const int err) {
+  return std::error_code(err, std::system_category()).message();
+}
+
+inline bool is_dot(const char *name) noexcept {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// queued directories each may hold an fd of their parent, a quarter of the
+// fd limit leaves the rest to jobs listing in place and to hashing
+uint64_t queue_max() noexcept {
+  static const auto max = [] {
+    rlimit lim{};
+    if (::getrlimit(RLIMIT_NOFILE, &lim) != 0 ||
+        lim.rlim_cur == RLIM_INFINITY) {
+      return (uint64_t)ls_queue_max;
+    }
+    return std::clamp<uint64_t>(lim.rlim_cur / 4, 1, ls_queue_max);
+  }();
+  return max;
+}
+
+// a posted directory or the posting of roots is done, size groups can no
+// longer grow once none is left
+void dir_done(const ls_ctx_t &ctx) {
+  if (ctx.pending_dir.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+      ctx.prehash != nullptr) {
+    ctx.prehash->walk_done();
+  }
+}
+
+// fd of a listed directory, shared by the jobs of its subdirectories until
+// they have opened them
+class dir_fd_t {
+  int _fd;
+
+ public:
+  explicit dir_fd_t(const int fd) noexcept : _fd(fd) {}
+  ~dir_fd_t() noexcept { ::close(_fd); }
+  dir_fd_t(const dir_fd_t &) = delete;
+  dir_fd_t &operator=(const dir_fd_t &) = delete;
+
+  inline int get() const noexcept { return _fd; }
+};
+
+using dir_fd_ptr = std::shared_ptr<const dir_fd_t>;
+
+void ls_dir(uint32_t dir, const std::string &dir_path, const dir_fd_ptr &fd,
+            const ls_ctx_t &ctx);
+
+inline void skip_dir(const std::string &dir_path, const int err,
+                     const ls_ctx_t &ctx) {
+  oss(std::cerr) << "[warn] skip directory: " << std::quoted(dir_path)
+                 << " - " << err_msg(err) << '\n';
+  stats_t stats;
+  ++stats.list_error_cnt;
+  ctx.stats.add(stats);
+}
+
+/**
+ * @brief open subdirectory relative to the fd of its parent, so a symlink
+ * swapped in after the parent was listed is not followed, then list it
+ *
+ * @param dir directory index in table
+ * @param dir_path directory path, ends with its name
+ * @param name_len length of name
+ * @param parent fd of parent, released once opened
+ * @param ctx listing context
+ */
+void ls_sub_dir(const uint32_t dir, const std::string &dir_path,
+                const uint32_t name_len, dir_fd_ptr parent,
+                const ls_ctx_t &ctx) {
+  const int fd =
+      ::openat(parent->get(), dir_path.c_str() + dir_path.size() - name_len,
+               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  const auto err = errno;
+  parent.reset();
+  if (fd < 0) {
+    skip_dir(dir_path, err, ctx);
+    return;
+  }
+  ls_dir(dir, dir_path, std::make_shared<const dir_fd_t>(fd), ctx);
+}
+
+void ls_dir(const uint32_t dir, const std::string &dir_path,
+            const dir_fd_ptr &fd, const ls_ctx_t &ctx) {
+  stats_t stats;
+  const int dir_fd = fd->get();
+  ++stats.dir_cnt;
+
+  // entry path is only built in place after the directory prefix
+  std::string path = dir_path;
+  if (path.empty() || path.back() != '/') {
+    path += '/';
+  }
+  const auto prefix_len = path.size();
+
+  // batch is appended to table at once, name offsets are relative to names
+  std::string names_tmp;
   std::vector<file_entry_t> file_list_tmp;
-  try {
-    for (const auto &dir_entry : std::filesystem::directory_iterator(dir)) {
-      if (is_excluded(dir_entry.path(), exclude_regex)) {
+  std::vector<std::pair<uint64_t, uint32_t>> sub_dir_tmp;
+  auto *buf = dirent_rsrc_man.get_rsrc().buf.get();
+  while (true) {
+    const auto read_len = ::getdents64(dir_fd, buf, dirent_buf_sz);
+    if (read_len < 0) {
+      // error iterate directory, skip rest
+      oss(std::cerr) << "[warn] skip directory: " << std::quoted(dir_path)
+                     << " - " << err_msg(errno) << '\n';
+      ++stats.list_error_cnt;
+      break;
+    }
+    if (read_len == 0) {
+      break;
+    }
+    for (auto off = 0L; off < read_len;) {
+      const auto *entry = reinterpret_cast<const dirent64 *>(buf + off);
+      off += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (is_dot(name)) {
+        continue;
+      }
+      path.resize(prefix_len);
+      path += name;
+      const auto name_len = (uint32_t)(path.size() - prefix_len);
+
+      if (ctx.exclude.match(path)) {
         // exclude, skip
-        oss(std::cerr) << "[log] skip exclude: " << dir_entry.path() << '\n';
+        oss(std::cerr) << "[log] skip exclude: " << std::quoted(path) << '\n';
+        ++stats.excluded_cnt;
+        continue;
+      }
 
-      } else if (dir_entry.is_symlink()) {
-        // symlink, skip
-        oss(std::cerr) << "[warn] skip symlink: " << dir_entry.path() << '\n';
-
-      } else if (dir_entry.is_directory()) {
-        // directory, recursive call
-        boost::asio::post(
-            pool,
-            std::bind(ls_dir_rec, dir_entry.path(), std::ref(file_list),
-                      std::ref(mtx), std::ref(pool), std::cref(exclude_regex)));
-
-      } else if (dir_entry.is_regular_file()) {
-        // regular file, add to list
-        std::error_code ec;
-        auto file_size = dir_entry.file_size(ec);
-        if (ec) {
+      // stat only regular files, or when type is unknown to filesystem
+      auto type = entry->d_type;
+      struct statx stx {};
+      if (type == DT_REG || type == DT_UNKNOWN) {
+        if (::statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                    STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME |
+                        STATX_CTIME | STATX_BLOCKS,
+                    &stx) != 0) {
           // error read file size, skip
-          oss(std::cerr) << "[warn] skip file: " << dir_entry.path() << " - "
-                         << ec.message() << '\n';
-        } else if (file_size > 0) {
+          oss(std::cerr) << "[warn] skip file: " << std::quoted(path) << " - "
+                         << err_msg(errno) << '\n';
+          ++stats.list_error_cnt;
+          continue;
+        }
+        type = (unsigned char)IFTODT(stx.stx_mode);
+      }
+
+      if (type == DT_LNK) {
+        // symlink, skip
+        oss(std::cerr) << "[warn] skip symlink: " << std::quoted(path) << '\n';
+        ++stats.skipped_cnt;
+
+      } else if (type == DT_DIR) {
+        // directory, recursive call after appended to table
+        sub_dir_tmp.emplace_back(names_tmp.size(), name_len);
+        names_tmp.append(name, name_len);
+
+      } else if (type == DT_REG) {
+        if (stx.stx_size > 0) {
           // file size > 0, add to list
-          file_list_tmp.emplace_back(dir_entry.path(), file_size);
+          file_stat_t stat;
+          stat.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+          stat.ino = stx.stx_ino;
+          stat.mtime_ns = stx.stx_mtime.tv_sec * 1000000000L +
+                          stx.stx_mtime.tv_nsec;
+          stat.ctime_ns = stx.stx_ctime.tv_sec * 1000000000L +
+                          stx.stx_ctime.tv_nsec;
+          // holes are skipped when hashing
+          const bool sparse = (stx.stx_mask & STATX_BLOCKS) != 0 &&
+                              stx.stx_blocks * 512UL < stx.stx_size;
+          file_list_tmp.emplace_back(dir, names_tmp.size(), name_len,
+                                     stx.stx_size, stat, sparse);
+          names_tmp.append(name, name_len);
         }
 
       } else {
         // other file type, skip
-        oss(std::cerr) << "[warn] skip unsupport file: " << dir_entry.path()
+        oss(std::cerr) << "[warn] skip unsupport file: " << std::quoted(path)
                        << '\n';
+        ++stats.skipped_cnt;
       }
     }
-  } catch (std::filesystem::filesystem_error &e) {
-    // error iterate directory, skip
-    oss(std::cerr) << "[warn] skip directory: " << dir << " - "
-                   << e.code().message() << '\n';
   }
+  // append to global table
+  std::vector<uint32_t> sub_dir_idx;
+  sub_dir_idx.reserve(sub_dir_tmp.size());
+  uint64_t file_idx = 0;
+  if (ctx.spill != nullptr) {
+    // spilled batches keep their full path, directories are not added
+    std::lock_guard lk(ctx.mtx);
+    ctx.spill->add(dir_path, names_tmp, file_list_tmp);
+    if (ctx.spill->failed()) {
+      // search fails after listing, the walk ends here
+      sub_dir_tmp.clear();
+    }
+    sub_dir_idx.resize(sub_dir_tmp.size(), file_table_t::no_parent);
+  } else if (!names_tmp.empty()) {
+    std::lock_guard lk(ctx.mtx);
+    file_idx = ctx.table.files().size();
+    const auto base = ctx.table.append(names_tmp, file_list_tmp);
+    for (const auto &[name_off, name_len] : sub_dir_tmp) {
+      sub_dir_idx.emplace_back(
+          ctx.table.add_dir(dir, base + name_off, name_len));
+    }
+  }
+  if (ctx.prehash != nullptr && !file_list_tmp.empty()) {
+    ctx.prehash->add(file_list_tmp, file_idx);
+  }
+  stats.file_cnt = file_list_tmp.size();
+  ctx.stats.add(stats);
+  for (auto i = 0UL; i < sub_dir_tmp.size(); ++i) {
+    const auto &[name_off, name_len] = sub_dir_tmp[i];
+    path.resize(prefix_len);
+    path.append(names_tmp, name_off, name_len);
+    if (ctx.stats.list_queue.depth() >= queue_max()) {
+      // queue is full, list depth first in this job
+      ls_sub_dir(sub_dir_idx[i], path, name_len, fd, ctx);
+      continue;
+    }
+    ctx.stats.list_queue.push();
+    ctx.pending_dir.fetch_add(1, std::memory_order_relaxed);
+    boost::asio::post(ctx.pool, [sub_dir = sub_dir_idx[i], sub_dir_path = path,
+                                 name_len, fd, &ctx] {
+      ctx.stats.list_queue.pop();
+      ls_sub_dir(sub_dir, sub_dir_path, name_len, fd, ctx);
+      dir_done(ctx);
+    });
+  }
+}
 
-  // append to global list
-  if (!file_list_tmp.empty()) {
-    std::lock_guard lk(mtx);
-    file_list.insert(file_list.end(),
-                     std::make_move_iterator(file_list_tmp.begin()),
-                     std::make_move_iterator(file_list_tmp.end()));
+}  // namespace
+
+void ls_dir_rec(const uint32_t dir, const std::string dir_path,
+                const ls_ctx_t &ctx) {
+  const int fd = ::open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    // error open directory, skip
+    skip_dir(dir_path, errno, ctx);
+    return;
+  }
+  ls_dir(dir, dir_path, std::make_shared<const dir_fd_t>(fd), ctx);
+}
+
+void ls_roots(const std::vector<std::filesystem::path> &search_dir,
+              const ls_ctx_t &ctx) {
+  stats_t stats;
+  // held while posting, roots listed meanwhile don't end the walk
+  ctx.pending_dir.fetch_add(1, std::memory_order_relaxed);
+  for (const auto &dir : search_dir) {
+    if (ctx.exclude.match(dir.native())) {
+      oss(std::cerr) << "[log] exclude: " << dir << '\n';
+      ++stats.excluded_cnt;
+      continue;
+    }
+    uint32_t dir_idx;
+    {
+      std::lock_guard lk(ctx.mtx);
+      dir_idx = ctx.table.add_root(dir.native());
+    }
+    ctx.stats.list_queue.push();
+    ctx.pending_dir.fetch_add(1, std::memory_order_relaxed);
+    boost::asio::post(ctx.pool, [dir_idx, dir_path = dir.native(), &ctx] {
+      ctx.stats.list_queue.pop();
+      ls_dir_rec(dir_idx, dir_path, ctx);
+      dir_done(ctx);
+    });
   }
+  ctx.stats.add(stats);
+  dir_done(ctx);
 }
 
 }  // namespace detail_v1_0_0
 
-}  // namespace dedupe
\ No newline at end of file
+}  // namespace dedupe
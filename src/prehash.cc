@@ -0,0 +1,110 @@
+#include "prehash.hh"
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <optional>
+
+#include "config.hh"
+#include "file_cmp.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+void prehash_t::add(std::span<const file_entry_t> files, uint64_t idx) {
+  std::vector<uint64_t> ready;
+  for (const auto &file : files) {
+    auto &shard = _buckets[std::hash<uint64_t>{}(file.size()) % shard_cnt];
+    {
+      std::lock_guard lk(shard.mtx);
+      auto [it, inserted] = shard.bucket.try_emplace(file.size(), idx);
+      if (!inserted) {
+        // second file activates bucket, later files are hashed on arrival
+        if (it->second != active) {
+          ready.emplace_back(it->second);
+          it->second = active;
+        }
+        ready.emplace_back(idx);
+      }
+    }
+    ++idx;
+  }
+  for (const auto file_idx : ready) {
+    boost::asio::post(_pool, [this, file_idx] { hash(file_idx); });
+  }
+}
+
+void prehash_t::hash(const uint64_t idx) {
+  if (_walk_done.load(std::memory_order_relaxed)) {
+    // group is final, its search reads the blocks with the rest
+    _dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  std::optional<file_cmp_t> file_cmp;
+  {
+    // table grows while listing
+    std::lock_guard lk(_table_mtx);
+    const auto &entry = _table.files()[idx];
+    if (entry.stat().ino == 0) {
+      return;
+    }
+    file_cmp.emplace(entry, _table, _layout, _cache, nullptr, _hash_algo);
+  }
+  const auto lvl_cnt = std::min(prehash_lvl, file_cmp->max_hash());
+  if (file_cmp->hash_cnt() >= lvl_cnt) {
+    // cached
+    return;
+  }
+  const auto &stat = file_cmp->entry().stat();
+  const cache_key_t key{stat.dev, stat.ino, file_cmp->size(), stat.mtime_ns,
+                        stat.ctime_ns};
+  auto &shard = _hashes[key_hash_t{}(key) % shard_cnt];
+  {
+    std::lock_guard lk(shard.mtx);
+    if (shard.hashes.contains(key)) {
+      // hard link of hashed file
+      return;
+    }
+  }
+  stats_t stats;
+  for (auto lvl = file_cmp->hash_cnt(); lvl < lvl_cnt; ++lvl) {
+    ++stats.files_opened;
+    if (!file_cmp->hash_blk(lvl)) {
+      ++stats.read_error_cnt;
+      _stats.add(stats);
+      return;
+    }
+    ++stats.blk_hashed[lvl];
+    stats.bytes_read[lvl] += file_cmp->blk_len(lvl);
+  }
+  _stats.add(stats);
+
+  std::vector<XXH128_hash_t> hashes(lvl_cnt);
+  for (auto lvl = 0U; lvl < lvl_cnt; ++lvl) {
+    hashes[lvl] = file_cmp->hash(lvl);
+  }
+  std::lock_guard lk(shard.mtx);
+  shard.hashes.try_emplace(key, std::move(hashes));
+}
+
+std::span<const XXH128_hash_t> prehash_t::lookup(
+    const cache_key_t &key) const {
+  const auto &shard = _hashes[key_hash_t{}(key) % shard_cnt];
+  auto it = shard.hashes.find(key);
+  if (it == shard.hashes.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+uint64_t prehash_t::size() const {
+  uint64_t cnt = 0;
+  for (const auto &shard : _hashes) {
+    cnt += shard.hashes.size();
+  }
+  return cnt;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "calibrate.hh"
+#include "config.hh"
+#include "dedupe.hh"
+#include "dedupe_same_sz.hh"
+#include "exclude.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
+#include "ls_dir_rec.hh"
+#include "oss.hh"
+#include "phase_clock.hh"
+#include "stats.hh"
+#include "size_sort.hh"
+#include "table_io.hh"
+#include "timer.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+/**
+ * @brief split sizes into ranges of about equal work, a size group of n
+ * files costs about size * n bytes to read
+ *
+ * @param files files sorted by size
+ * @param part_cnt number of ranges wanted
+ * @return ranges covering all sizes
+ */
+std::vector<size_range_t> split_sizes(const std::vector<file_entry_t> &files,
+                                      const uint32_t part_cnt) {
+  // (size, cost) of groups that are searched
+  std::vector<std::pair<uint64_t, uint64_t>> groups;
+  uint64_t total = 0;
+  for (auto st = 0UL; st < files.size();) {
+    auto ed = st + 1;
+    while (ed < files.size() && files[ed].size() == files[st].size()) {
+      ++ed;
+    }
+    if (ed - st > 1) {
+      const auto cost = files[st].size() * (ed - st);
+      groups.emplace_back(files[st].size(), cost);
+      total += cost;
+    }
+    st = ed;
+  }
+
+  std::vector<size_range_t> ranges(1);
+  uint64_t acc = 0;
+  for (const auto &[size, cost] : groups) {
+    if (ranges.size() == part_cnt) {
+      break;
+    }
+    acc += cost;
+    // close range once its share is reached, double avoids overflow
+    if ((double)acc >=
+        (double)total * (double)ranges.size() / (double)part_cnt) {
+      ranges.back().max = size;
+      ranges.push_back({size + 1, UINT64_MAX});
+    }
+  }
+  if (ranges.size() > 1 && ranges.back().min > groups.back().first) {
+    // nothing left past the last group
+    ranges.pop_back();
+    ranges.back().max = UINT64_MAX;
+  }
+  return ranges;
+}
+
+// search roots of table, roots listed on other hosts are probed only if
+// mounted at the same path here
+std::vector<std::filesystem::path> table_roots(const file_table_t &table) {
+  std::vector<std::filesystem::path> roots;
+  for (auto dir = 0U; dir < table.dir_cnt(); ++dir) {
+    if (table.dirs()[dir].parent == file_table_t::no_parent) {
+      std::string path;
+      table.append_dir_path(dir, path);
+      roots.emplace_back(std::move(path));
+    }
+  }
+  return roots;
+}
+
+}  // namespace
+
+void DEDUPE_EXPORT list_table(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts,
+    const std::filesystem::path &table_path) {
+  const exclude_t exclude(opts.exclude_pattern, exclude_regex);
+  stats_sum_t stats_sum;
+  timer_t timer;
+  file_table_t table;
+  std::cerr << "[log] list files..." << std::endl;
+  {
+    std::mutex mtx;
+    boost::asio::thread_pool pool(opts.max_thread);
+    const ls_ctx_t ls_ctx{table, mtx, pool, exclude, nullptr, stats_sum};
+    ls_roots(search_dir, ls_ctx);
+    pool.join();
+  }
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] file count: " << table.files().size() << std::endl;
+  // sizes unique here may match files listed on other hosts
+  sort_by_size(table.files(), opts.max_thread, true);
+  write_table(table_path, table);
+  std::cerr << "[log] table written: " << table_path << std::endl;
+}
+
+std::vector<size_range_t> DEDUPE_EXPORT
+merge_tables(const std::vector<std::filesystem::path> &tables,
+             const std::filesystem::path &out_path, const uint32_t part_cnt) {
+  timer_t timer;
+  file_table_t merged;
+  std::vector<std::string> hosts;
+  for (const auto &path : tables) {
+    std::string host;
+    auto table = read_table(path, &host);
+    auto host_idx = std::find(hosts.begin(), hosts.end(), host) - hosts.begin();
+    if ((uint64_t)host_idx == hosts.size()) {
+      hosts.emplace_back(std::move(host));
+    }
+    oss(std::cerr) << "[log] table " << path << ": "
+                   << table.files().size() << " files, host " << host_idx
+                   << '\n';
+    // host index in the top byte, listings of one host keep their devices
+    const auto dev_tag = (uint64_t)host_idx << file_table_t::host_tag_shift;
+    merged.append_table(table, dev_tag);
+  }
+  sort_by_size(merged.files(), std::thread::hardware_concurrency(), true);
+  write_table(out_path, merged);
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] file count: " << merged.files().size() << std::endl;
+  return split_sizes(merged.files(), std::max(part_cnt, 1U));
+}
+
+void DEDUPE_EXPORT dedupe_table(const std::filesystem::path &table_path,
+                                const size_range_t &range,
+                                const options_t &opts, result_sink_t &sink) {
+  if (!hash_algo_supported(opts.hash_algo)) {
+    throw std::invalid_argument("hash algorithm not supported by this build");
+  }
+  stats_sum_t stats_sum;
+  stats_t stats;
+  phase_clock_t clock(sink, stats);
+
+  // table is already sorted, reading it stands in for listing
+  timer_t timer;
+  std::cerr << "[log] read table..." << std::endl;
+  clock.start(phase_t::list);
+  auto table = read_table(table_path);
+  clock.end(phase_t::list);
+
+  const auto blk_sched = pick_blk_sched(opts.blk_sched, table_roots(table),
+                                        opts.cache_path, opts.hash_algo);
+  std::optional<hash_cache_t> cache;
+  if (!opts.cache_path.empty()) {
+    cache.emplace(opts.cache_path, opts.hash_algo, blk_sched);
+  }
+  same_sz_ctx_t ctx;
+  ctx.layout = blk_layout_t(blk_sched);
+  ctx.cache = cache ? &*cache : nullptr;
+  ctx.io_depth = opts.io_depth;
+  ctx.verify = opts.verify;
+  ctx.extent_order = opts.extent_order;
+  ctx.sample = opts.sample;
+  ctx.hash_algo = opts.hash_algo;
+  ctx.dev_limits = opts.dev_limits;
+  ctx.stats = &stats_sum;
+  auto &files = table.files();
+  const auto st = std::lower_bound(
+      files.begin(), files.end(), range.min,
+      [](const auto &file, const uint64_t size) { return file.size() < size; });
+  const auto ed = std::upper_bound(
+      st, files.end(), range.max,
+      [](const uint64_t size, const auto &file) { return size < file.size(); });
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  oss(std::cerr) << "[log] file count: " << ed - st << " of " << files.size()
+                 << ", size " << range.min << " to " << range.max << '\n';
+
+  result_out_t out(sink);
+  std::cerr << "[log] detect duplicates..." << std::endl;
+  clock.start(phase_t::hash);
+  dedupe_sorted({st, ed}, table, out, ctx, opts.max_thread);
+  clock.end(phase_t::hash);
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] duplicate group count: " << out.dupe_cnt() << std::endl;
+  std::cerr << "[log] linked group count: " << out.linked_cnt() << std::endl;
+
+  if (cache) {
+    std::cerr << "[log] save cache..." << std::endl;
+    clock.start(phase_t::save);
+    // a shard looks up only its own sizes
+    cache->save(st == files.begin() && ed == files.end());
+    clock.end(phase_t::save);
+    std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  }
+
+  stats.merge(stats_sum.total());
+  stats.dupe_cnt = out.dupe_cnt();
+  stats.linked_cnt = out.linked_cnt();
+  sink.on_stats(stats);
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
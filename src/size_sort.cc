@@ -0,0 +1,187 @@
+#include "size_sort.hh"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// key of files whose size and index don't fit one word
+struct size_key_t {
+  uint64_t size;
+  uint64_t idx;
+};
+
+constexpr auto radix_bits = 11U;
+constexpr auto radix = 1U << radix_bits;
+// fewer keys are sorted on one thread
+constexpr auto par_min_keys = 1UL << 16U;
+// entries gathered ahead of use
+constexpr auto prefetch_dist = 16UL;
+
+// run fn(part) for part in [0, part_cnt), returns when all are done
+template <typename Fn>
+void run_parts(const uint32_t part_cnt, const Fn &fn) {
+  if (part_cnt == 1) {
+    fn(0U);
+    return;
+  }
+  boost::asio::thread_pool pool(part_cnt);
+  for (auto part = 0U; part < part_cnt; ++part) {
+    boost::asio::post(pool, [&fn, part] { fn(part); });
+  }
+  pool.join();
+}
+
+/**
+ * @brief LSD radix sort of keys by bits [lo, hi) of key_of(key), stable,
+ * each thread counts and scatters a contiguous part of the keys, parts are
+ * placed in order within each digit, digits equal in all keys are skipped
+ *
+ * @param[in,out] keys keys to sort
+ * @param key_of sort key of a key
+ * @param lo lowest bit of the sort key
+ * @param max_thread threads of the passes
+ */
+template <typename Key, typename KeyOf>
+void radix_sort(std::vector<Key> &keys, const KeyOf &key_of, const uint32_t lo,
+                const uint32_t max_thread) {
+  const auto key_cnt = keys.size();
+  if (key_cnt < 2) {
+    return;
+  }
+  const auto part_cnt = key_cnt < par_min_keys ? 1U : std::max(max_thread, 1U);
+  const auto part_len = (key_cnt + part_cnt - 1) / part_cnt;
+  auto part_st = [&](const uint32_t part) {
+    return std::min(key_cnt, part * part_len);
+  };
+  // bits set in some keys but not all
+  uint64_t diff = 0;
+  const auto front = key_of(keys.front());
+  for (const auto &key : keys) {
+    diff |= key_of(key) ^ front;
+  }
+  diff &= ~0UL << lo;
+
+  std::vector<Key> tmp(key_cnt);
+  std::vector<std::array<uint64_t, radix>> hist(part_cnt);
+  for (auto shift = lo; shift < 64U && (diff >> shift) != 0;
+       shift += radix_bits) {
+    if (((diff >> shift) & (radix - 1)) == 0) {
+      continue;
+    }
+    auto digit = [&key_of, shift](const Key &key) {
+      return (key_of(key) >> shift) & (radix - 1);
+    };
+    run_parts(part_cnt, [&](const uint32_t part) {
+      auto &part_hist = hist[part];
+      part_hist.fill(0);
+      for (auto i = part_st(part); i < part_st(part + 1); ++i) {
+        ++part_hist[digit(keys[i])];
+      }
+    });
+    // digit-major, part-minor offsets keep the sort stable
+    uint64_t off = 0;
+    for (auto dig = 0U; dig < radix; ++dig) {
+      for (auto &part_hist : hist) {
+        const auto cnt = part_hist[dig];
+        part_hist[dig] = off;
+        off += cnt;
+      }
+    }
+    run_parts(part_cnt, [&](const uint32_t part) {
+      auto &part_hist = hist[part];
+      for (auto i = part_st(part); i < part_st(part + 1); ++i) {
+        tmp[part_hist[digit(keys[i])]++] = keys[i];
+      }
+    });
+    keys.swap(tmp);
+  }
+}
+
+/**
+ * @brief move files to the order of sorted keys
+ *
+ * @param[in,out] files files
+ * @param keys sorted keys
+ * @param size_of size of a key
+ * @param idx_of file index of a key
+ * @param keep_unique keep files of a size of their own
+ * @return number of files dropped
+ */
+template <typename Key, typename SizeOf, typename IdxOf>
+uint64_t gather(std::vector<file_entry_t> &files, const std::vector<Key> &keys,
+                const SizeOf &size_of, const IdxOf &idx_of,
+                const bool keep_unique) {
+  const auto key_cnt = keys.size();
+  auto single = [&](const uint64_t i) {
+    const auto size = size_of(keys[i]);
+    return (i == 0 || size_of(keys[i - 1]) != size) &&
+           (i + 1 == key_cnt || size_of(keys[i + 1]) != size);
+  };
+  // entries of sizes with one file are never copied
+  uint64_t kept = key_cnt;
+  if (!keep_unique) {
+    for (auto i = 0UL; i < key_cnt; ++i) {
+      kept -= single(i);
+    }
+  }
+  std::vector<file_entry_t> sorted;
+  sorted.reserve(kept);
+  for (auto i = 0UL; i < key_cnt; ++i) {
+    if (i + prefetch_dist < key_cnt) {
+      __builtin_prefetch(&files[idx_of(keys[i + prefetch_dist])]);
+    }
+    if (keep_unique || !single(i)) {
+      sorted.emplace_back(files[idx_of(keys[i])]);
+    }
+  }
+  const auto dropped = files.size() - sorted.size();
+  files.swap(sorted);
+  return dropped;
+}
+
+}  // namespace
+
+uint64_t sort_by_size(std::vector<file_entry_t> &files,
+                      const uint32_t max_thread, const bool keep_unique) {
+  uint64_t max_size = 0;
+  for (const auto &file : files) {
+    max_size = std::max(max_size, file.size());
+  }
+  const auto idx_bits = (uint32_t)std::bit_width(files.size());
+  if (idx_bits + std::bit_width(max_size) <= 64) {
+    // size above index in one word, indices start sorted and stay so
+    std::vector<uint64_t> keys(files.size());
+    for (auto i = 0UL; i < files.size(); ++i) {
+      keys[i] = files[i].size() << idx_bits | i;
+    }
+    const auto ident = [](const uint64_t key) { return key; };
+    radix_sort(keys, ident, idx_bits, max_thread);
+    return gather(
+        files, keys, [idx_bits](const uint64_t key) { return key >> idx_bits; },
+        [idx_bits](const uint64_t key) {
+          return key & ((1UL << idx_bits) - 1);
+        },
+        keep_unique);
+  }
+  std::vector<size_key_t> keys(files.size());
+  for (auto i = 0UL; i < files.size(); ++i) {
+    keys[i] = {files[i].size(), i};
+  }
+  const auto size_of = [](const size_key_t &key) { return key.size; };
+  radix_sort(keys, size_of, 0, max_thread);
+  return gather(
+      files, keys, size_of, [](const size_key_t &key) { return key.idx; },
+      keep_unique);
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
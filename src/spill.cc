@@ -0,0 +1,408 @@
+#include "spill.hh"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "config.hh"
+#include "dedupe_same_sz.hh"
+#include "oss.hh"
+#include "size_sort.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// header of a spilled file, its full path follows
+struct run_rec_t {
+  uint64_t size;
+  file_stat_t stat;
+  uint32_t path_len;
+  uint32_t sparse;
+};
+
+static_assert(std::is_trivially_copyable_v<run_rec_t>);
+
+inline std::string err_msg(const int err) {
+  return std::error_code(err, std::system_category()).message();
+}
+
+/**
+ * @brief create a run of a unique name in dir, only readable by its owner
+ *
+ * @param dir directory of runs
+ * @param[out] path path of run
+ * @return fd open for writing
+ * @throw std::runtime_error on create error
+ */
+int create_run(const std::filesystem::path &dir, std::filesystem::path &path) {
+  auto name = (dir / "dedupe-XXXXXX.run").native();
+  // O_EXCL and mode 0600, a name taken by another user is never reused
+  const int fd = ::mkostemps(name.data(), 4, O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("failed to create run in " + dir.native() +
+                             " - " + err_msg(errno));
+  }
+  path = std::move(name);
+  return fd;
+}
+
+class run_writer_t {
+  std::unique_ptr<char[]> _buf;
+  uint64_t _len = 0;
+  int _fd;
+  std::filesystem::path _path;
+
+  void flush() {
+    for (auto off = 0UL; off < _len;) {
+      const auto write_len = ::write(_fd, _buf.get() + off, _len - off);
+      if (write_len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("failed to write run: " + _path.native() +
+                                 " - " + err_msg(errno));
+      }
+      off += (uint64_t)write_len;
+    }
+    _len = 0;
+  }
+
+  void put(const char *data, uint64_t len) {
+    while (len != 0) {
+      if (_len == spill_buf_sz) {
+        flush();
+      }
+      const auto copy_len = std::min(len, spill_buf_sz - _len);
+      std::memcpy(_buf.get() + _len, data, copy_len);
+      _len += copy_len;
+      data += copy_len;
+      len -= copy_len;
+    }
+  }
+
+ public:
+  // takes fd of a created run
+  run_writer_t(const int fd, std::filesystem::path path)
+      : _buf(std::make_unique_for_overwrite<char[]>(spill_buf_sz)),
+        _fd(fd),
+        _path(std::move(path)) {}
+  ~run_writer_t() noexcept {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+  run_writer_t(const run_writer_t &) = delete;
+  run_writer_t &operator=(const run_writer_t &) = delete;
+
+  inline void write(const run_rec_t &rec, const std::string_view path) {
+    put(reinterpret_cast<const char *>(&rec), sizeof(rec));
+    put(path.data(), path.size());
+  }
+
+  void close() {
+    flush();
+    const auto ret = ::close(std::exchange(_fd, -1));
+    if (ret != 0) {
+      throw std::runtime_error("failed to write run: " + _path.native() +
+                               " - " + err_msg(errno));
+    }
+  }
+};
+
+class run_reader_t {
+  std::unique_ptr<char[]> _buf;
+  uint64_t _pos = 0;
+  uint64_t _len = 0;
+  int _fd;
+  std::filesystem::path _path;
+  run_rec_t _rec{};
+  std::string _file_path;
+
+  // copy up to len bytes, fewer only at end of run
+  uint64_t get(char *out, const uint64_t len) {
+    auto done = 0UL;
+    while (done < len) {
+      if (_pos == _len) {
+        const auto read_len = ::read(_fd, _buf.get(), spill_buf_sz);
+        if (read_len < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          throw std::runtime_error("failed to read run: " + _path.native() +
+                                   " - " + err_msg(errno));
+        }
+        if (read_len == 0) {
+          break;
+        }
+        _pos = 0;
+        _len = (uint64_t)read_len;
+      }
+      const auto copy_len = std::min(len - done, _len - _pos);
+      std::memcpy(out + done, _buf.get() + _pos, copy_len);
+      _pos += copy_len;
+      done += copy_len;
+    }
+    return done;
+  }
+
+ public:
+  explicit run_reader_t(std::filesystem::path path)
+      : _buf(std::make_unique_for_overwrite<char[]>(spill_buf_sz)),
+        _fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW)),
+        _path(std::move(path)) {
+    if (_fd < 0) {
+      throw std::runtime_error("failed to open run: " + _path.native() +
+                               " - " + err_msg(errno));
+    }
+  }
+  ~run_reader_t() noexcept { ::close(_fd); }
+  run_reader_t(const run_reader_t &) = delete;
+  run_reader_t &operator=(const run_reader_t &) = delete;
+
+  // read next record, false at end of run
+  bool next() {
+    const auto rec_len = get(reinterpret_cast<char *>(&_rec), sizeof(_rec));
+    if (rec_len != sizeof(_rec)) {
+      if (rec_len != 0) {
+        throw std::runtime_error("truncated run: " + _path.native());
+      }
+      return false;
+    }
+    _file_path.resize(_rec.path_len);
+    if (get(_file_path.data(), _rec.path_len) != _rec.path_len) {
+      throw std::runtime_error("truncated run: " + _path.native());
+    }
+    return true;
+  }
+  inline const run_rec_t &rec() const noexcept { return _rec; }
+  inline std::string &path() noexcept { return _file_path; }
+};
+
+/**
+ * @brief k-way merge of runs by size, ties in run order
+ *
+ * @param runs runs to merge
+ * @param emit receives every record and its path in size order
+ */
+template <typename Emit>
+void merge_readers(const std::vector<std::filesystem::path> &runs,
+                   const Emit &emit) {
+  std::vector<std::unique_ptr<run_reader_t>> readers;
+  readers.reserve(runs.size());
+  // (size, reader), smallest on top
+  using head_t = std::pair<uint64_t, uint64_t>;
+  std::priority_queue<head_t, std::vector<head_t>, std::greater<>> heads;
+  for (const auto &run : runs) {
+    auto &reader = readers.emplace_back(std::make_unique<run_reader_t>(run));
+    if (reader->next()) {
+      heads.emplace(reader->rec().size, readers.size() - 1);
+    }
+  }
+  while (!heads.empty()) {
+    const auto idx = heads.top().second;
+    heads.pop();
+    auto &reader = *readers[idx];
+    emit(reader.rec(), reader.path());
+    if (reader.next()) {
+      heads.emplace(reader.rec().size, idx);
+    }
+  }
+}
+
+// table of one size group, files are added by full path like watch_t does
+class group_builder_t {
+  file_table_t _table;
+  std::unordered_map<std::string, uint32_t> _dirs;
+
+ public:
+  void add(const run_rec_t &rec, const std::string_view path) {
+    const auto slash = path.rfind('/');
+    const auto name = path.substr(slash + 1);
+    const auto dir = slash == 0 ? std::string_view("/") : path.substr(0, slash);
+    auto [it, inserted] = _dirs.try_emplace(std::string(dir), 0);
+    if (inserted) {
+      it->second = _table.add_root(dir);
+    }
+    file_entry_t entry(it->second, 0, (uint32_t)name.size(), rec.size,
+                       rec.stat, rec.sparse != 0);
+    _table.append(name, {&entry, 1});
+  }
+  inline const file_table_t &table() const noexcept { return _table; }
+  inline file_table_t take() {
+    _dirs.clear();
+    return std::exchange(_table, {});
+  }
+};
+
+}  // namespace
+
+spill_t::spill_t(const std::filesystem::path &tmp_dir,
+                 const uint64_t mem_limit, const uint32_t max_thread)
+    : _dir(tmp_dir.empty() ? std::filesystem::temp_directory_path()
+                           : tmp_dir),
+      _table_limit(mem_limit / 3),
+      _group_limit(mem_limit / 2),
+      _max_thread(max_thread) {
+  // checked here, so a bad directory fails before listing starts
+  if (!std::filesystem::is_directory(_dir)) {
+    throw std::runtime_error("not a directory: " + _dir.native());
+  }
+}
+
+spill_t::~spill_t() noexcept {
+  for (const auto &run : _runs) {
+    std::error_code ec;
+    std::filesystem::remove(run, ec);
+  }
+}
+
+void spill_t::add(const std::string_view dir_path,
+                  const std::string_view names,
+                  const std::span<file_entry_t> files) {
+  if (files.empty() || _err) {
+    return;
+  }
+  // the root keeps the full path, so no other directory is needed
+  const auto dir = _table.add_root(dir_path);
+  for (auto &file : files) {
+    file = file_entry_t(dir, file.name_off(), file.name_len(), file.size(),
+                        file.stat(), file.sparse());
+  }
+  _table.append(names, files);
+  if (_table.mem() > _table_limit) {
+    // called from listing jobs, an exception would escape the pool
+    try {
+      spill();
+    } catch (...) {
+      _err = std::current_exception();
+      _table = {};
+    }
+  }
+}
+
+void spill_t::rethrow() const {
+  if (_err) {
+    std::rethrow_exception(_err);
+  }
+}
+
+void spill_t::spill() {
+  auto &table = _table;
+  if (table.files().empty()) {
+    return;
+  }
+  sort_by_size(table.files(), _max_thread, true);
+  std::filesystem::path path;
+  const int fd = create_run(_dir, path);
+  run_writer_t writer(fd, path);
+  // registered before writing, so it is removed on failure
+  _runs.emplace_back(path);
+  std::string file_path;
+  auto last_dir = file_table_t::no_parent;
+  std::string dir_path;
+  for (const auto &file : table.files()) {
+    if (file.parent() != last_dir) {
+      last_dir = file.parent();
+      dir_path.clear();
+      table.append_dir_path(last_dir, dir_path);
+      if (dir_path.empty() || dir_path.back() != '/') {
+        dir_path += '/';
+      }
+    }
+    file_path = dir_path;
+    file_path += table.name(file);
+    writer.write({file.size(), file.stat(), (uint32_t)file_path.size(),
+                  file.sparse()},
+                 file_path);
+    _bytes += sizeof(run_rec_t) + file_path.size();
+  }
+  writer.close();
+  _file_cnt += table.files().size();
+  oss(std::cerr) << "[log] spilled " << table.files().size()
+                 << " files to " << path << '\n';
+  // release capacity, clear would keep it
+  _table = {};
+}
+
+void spill_t::merge_runs(const uint64_t st, const uint64_t ed) {
+  const std::vector<std::filesystem::path> runs(
+      _runs.begin() + (int64_t)st, _runs.begin() + (int64_t)ed);
+  std::filesystem::path path;
+  const int fd = create_run(_dir, path);
+  run_writer_t writer(fd, path);
+  _runs.emplace_back(path);
+  merge_readers(runs, [&](const run_rec_t &rec, const std::string &file_path) {
+    writer.write(rec, file_path);
+  });
+  writer.close();
+  for (const auto &run : runs) {
+    std::error_code ec;
+    std::filesystem::remove(run, ec);
+  }
+  _runs.erase(_runs.begin() + (int64_t)st, _runs.begin() + (int64_t)ed);
+}
+
+uint64_t spill_t::merge(const std::function<void(file_table_t &&)> &fn) {
+  // each pass merges the oldest runs, so every file is rewritten about
+  // log_fan_in(run_cnt) times
+  while (_runs.size() > spill_fan_in) {
+    merge_runs(0, spill_fan_in);
+  }
+  uint64_t unique_cnt = 0;
+  group_builder_t builder;
+  uint64_t group_size = 0;
+  uint64_t group_cnt = 0;
+  // group past its limit, the rest of it is only counted
+  bool oversized = false;
+  auto flush = [&] {
+    auto table = builder.take();
+    if (oversized) {
+      oss(std::cerr) << "[warn] skip size group over memory limit: size "
+                     << group_size << ", " << group_cnt << " files\n";
+      _oversized_cnt += group_cnt;
+    } else if (group_cnt > 1) {
+      fn(std::move(table));
+    } else {
+      unique_cnt += group_cnt;
+    }
+    group_cnt = 0;
+    oversized = false;
+  };
+  merge_readers(_runs, [&](const run_rec_t &rec, const std::string &path) {
+    if (group_cnt != 0 && rec.size != group_size) {
+      flush();
+    }
+    group_size = rec.size;
+    ++group_cnt;
+    if (!oversized) {
+      builder.add(rec, path);
+      if (group_mem(builder.table()) > _group_limit) {
+        oversized = true;
+        builder.take();
+      }
+    }
+  });
+  flush();
+  return unique_cnt;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,47 @@
+#include <algorithm>
+
+#include "config.hh"
+#include "dedupe.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+void DEDUPE_EXPORT stats_t::merge(const stats_t &rhs) noexcept {
+  for (auto i = 0UL; i < phase_time.size(); ++i) {
+    phase_time[i].wall_ms += rhs.phase_time[i].wall_ms;
+    phase_time[i].cpu_ms += rhs.phase_time[i].cpu_ms;
+  }
+  file_cnt += rhs.file_cnt;
+  dir_cnt += rhs.dir_cnt;
+  excluded_cnt += rhs.excluded_cnt;
+  skipped_cnt += rhs.skipped_cnt;
+  list_error_cnt += rhs.list_error_cnt;
+  max_list_queue = std::max(max_list_queue, rhs.max_list_queue);
+  for (auto i = 0U; i < max_lvl; ++i) {
+    blk_hashed[i] += rhs.blk_hashed[i];
+    bytes_read[i] += rhs.bytes_read[i];
+    eliminated[i] += rhs.eliminated[i];
+  }
+  files_opened += rhs.files_opened;
+  read_error_cnt += rhs.read_error_cnt;
+  verify_split_cnt += rhs.verify_split_cnt;
+  sample_hashed += rhs.sample_hashed;
+  sample_bytes_read += rhs.sample_bytes_read;
+  sample_eliminated += rhs.sample_eliminated;
+  sample_bytes_skipped += rhs.sample_bytes_skipped;
+  group_cnt += rhs.group_cnt;
+  group_us_total += rhs.group_us_total;
+  group_us_max = std::max(group_us_max, rhs.group_us_max);
+  for (auto i = 0U; i < hist_cnt; ++i) {
+    group_us_hist[i] += rhs.group_us_hist[i];
+  }
+  max_hash_queue = std::max(max_hash_queue, rhs.max_hash_queue);
+  oversized_cnt += rhs.oversized_cnt;
+  dupe_cnt += rhs.dupe_cnt;
+  linked_cnt += rhs.linked_cnt;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,123 @@
+#include "table_io.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+constexpr char table_magic[8] = {'D', 'D', 'P', 'T', 'A', 'B', 'L', 'E'};
+constexpr uint32_t table_version = 1;
+
+static_assert(std::is_trivially_copyable_v<dir_node_t>);
+static_assert(std::is_trivially_copyable_v<file_entry_t>);
+
+// directories, files and names follow in that order
+struct table_hdr_t {
+  char magic[8];
+  uint32_t version;
+  // layout check, entries are written as in memory
+  uint32_t entry_sz;
+  char host[40];
+  uint64_t dir_cnt;
+  uint64_t file_cnt;
+  uint64_t names_sz;
+};
+
+}  // namespace
+
+std::string boot_id() {
+  std::ifstream ifs("/proc/sys/kernel/random/boot_id");
+  std::string id;
+  std::getline(ifs, id);
+  return id;
+}
+
+void write_table(const std::filesystem::path &path,
+                 const file_table_t &table) {
+  table_hdr_t hdr{};
+  std::memcpy(hdr.magic, table_magic, sizeof(table_magic));
+  hdr.version = table_version;
+  hdr.entry_sz = sizeof(file_entry_t);
+  const auto host = boot_id();
+  std::memcpy(hdr.host, host.data(), std::min(host.size(), sizeof(hdr.host)));
+  hdr.dir_cnt = table.dirs().size();
+  hdr.file_cnt = table.files().size();
+  hdr.names_sz = table.names().size();
+
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    ofs.write(reinterpret_cast<const char *>(table.dirs().data()),
+              (int64_t)(hdr.dir_cnt * sizeof(dir_node_t)));
+    ofs.write(reinterpret_cast<const char *>(table.files().data()),
+              (int64_t)(hdr.file_cnt * sizeof(file_entry_t)));
+    ofs.write(table.names().data(), (int64_t)hdr.names_sz);
+    ofs.close();
+    if (!ofs) {
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+      throw std::runtime_error("failed to write table: " + tmp_path.native());
+    }
+  }
+  std::filesystem::rename(tmp_path, path);
+}
+
+file_table_t read_table(const std::filesystem::path &path, std::string *host) {
+  std::ifstream ifs(path, std::ios::binary);
+  table_hdr_t hdr{};
+  ifs.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+  if (!ifs || std::memcmp(hdr.magic, table_magic, sizeof(table_magic)) != 0 ||
+      hdr.version != table_version || hdr.entry_sz != sizeof(file_entry_t)) {
+    throw std::runtime_error("invalid table: " + path.native());
+  }
+  const auto file_sz = std::filesystem::file_size(path);
+  if (file_sz != sizeof(hdr) + hdr.dir_cnt * sizeof(dir_node_t) +
+                     hdr.file_cnt * sizeof(file_entry_t) + hdr.names_sz) {
+    throw std::runtime_error("truncated table: " + path.native());
+  }
+  std::vector<dir_node_t> dirs(hdr.dir_cnt);
+  ifs.read(reinterpret_cast<char *>(dirs.data()),
+           (int64_t)(hdr.dir_cnt * sizeof(dir_node_t)));
+  // file_entry_t has no default constructor
+  std::vector<file_entry_t> files(hdr.file_cnt, file_entry_t(0, 0, 0, 0));
+  ifs.read(reinterpret_cast<char *>(files.data()),
+           (int64_t)(hdr.file_cnt * sizeof(file_entry_t)));
+  std::string names(hdr.names_sz, '\0');
+  ifs.read(names.data(), (int64_t)hdr.names_sz);
+  if (!ifs) {
+    throw std::runtime_error("failed to read table: " + path.native());
+  }
+  // parents come before children, names within the arena
+  for (auto i = 0UL; i < dirs.size(); ++i) {
+    const auto &dir = dirs[i];
+    if ((dir.parent != file_table_t::no_parent && dir.parent >= i) ||
+        dir.name_off + dir.name_len > names.size()) {
+      throw std::runtime_error("corrupt table: " + path.native());
+    }
+  }
+  for (const auto &file : files) {
+    if (file.parent() >= dirs.size() ||
+        file.name_off() + file.name_len() > names.size()) {
+      throw std::runtime_error("corrupt table: " + path.native());
+    }
+  }
+  if (host != nullptr) {
+    *host = std::string(hdr.host, strnlen(hdr.host, sizeof(hdr.host)));
+  }
+  return {std::move(names), std::move(dirs), std::move(files)};
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
@@ -0,0 +1,182 @@
+#include "verify.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <numeric>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "config.hh"
+#include "oss.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) bool bytes_equal_avx2(
+    const char *lhs, const char *rhs, const uint64_t size) noexcept {
+  uint64_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    const auto *l = reinterpret_cast<const __m256i *>(lhs + i);
+    const auto *r = reinterpret_cast<const __m256i *>(rhs + i);
+    auto diff = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256(l), _mm256_loadu_si256(r)),
+            _mm256_xor_si256(_mm256_loadu_si256(l + 1),
+                             _mm256_loadu_si256(r + 1))),
+        _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256(l + 2),
+                             _mm256_loadu_si256(r + 2)),
+            _mm256_xor_si256(_mm256_loadu_si256(l + 3),
+                             _mm256_loadu_si256(r + 3))));
+    if (!_mm256_testz_si256(diff, diff)) {
+      return false;
+    }
+  }
+  return std::memcmp(lhs + i, rhs + i, size - i) == 0;
+}
+#endif
+
+struct free_deleter_t {
+  void operator()(char *ptr) const noexcept { std::free(ptr); }
+};
+using aligned_buf_t = std::unique_ptr<char, free_deleter_t>;
+
+aligned_buf_t alloc_buf() {
+  void *ptr = nullptr;
+  if (::posix_memalign(&ptr, 4096, verify_blk_sz) != 0) {
+    throw std::bad_alloc();
+  }
+  return aligned_buf_t(static_cast<char *>(ptr));
+}
+
+// read exactly size bytes at off, reopening if fd isn't kept open
+bool read_at(int fd, const file_cmp_t &file, char *buf, uint64_t size,
+             uint64_t off) noexcept {
+  const bool reopen = fd < 0;
+  if (reopen) {
+    fd = ::open(file.path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+  }
+  while (size > 0) {
+    const auto read_len = ::pread(fd, buf, size, (off_t)off);
+    if (read_len <= 0) {
+      break;
+    }
+    buf += read_len;
+    off += (uint64_t)read_len;
+    size -= (uint64_t)read_len;
+  }
+  if (reopen) {
+    ::close(fd);
+  }
+  return size == 0;
+}
+
+}  // namespace
+
+bool bytes_equal(const char *lhs, const char *rhs,
+                 const uint64_t size) noexcept {
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    return bytes_equal_avx2(lhs, rhs, size);
+  }
+#endif
+  return std::memcmp(lhs, rhs, size) == 0;
+}
+
+std::vector<std::vector<uint32_t>> verify_group(std::span<file_cmp_t> files) {
+  const auto size = files[0].size();
+  // keep files open across chunks, reopen per chunk if out of fds
+  std::vector<int> fds(files.size(), -1);
+  for (auto i = 0UL; i < files.size(); ++i) {
+    fds[i] = ::open(files[i].path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fds[i] >= 0) {
+      ::posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    } else if (errno != EMFILE && errno != ENFILE) {
+      files[i].set_invalid();
+    }
+  }
+
+  std::vector<std::vector<uint32_t>> done;
+  std::vector<std::vector<uint32_t>> classes(1);
+  for (auto i = 0U; i < files.size(); ++i) {
+    if (files[i].valid()) {
+      classes[0].emplace_back(i);
+    }
+  }
+  // distinct content of current chunk within a class, and its members
+  std::vector<std::pair<aligned_buf_t, std::vector<uint32_t>>> parts;
+  std::vector<aligned_buf_t> free_bufs;
+  auto get_buf = [&] {
+    if (free_bufs.empty()) {
+      return alloc_buf();
+    }
+    auto buf = std::move(free_bufs.back());
+    free_bufs.pop_back();
+    return buf;
+  };
+
+  std::vector<std::vector<uint32_t>> next_classes;
+  for (uint64_t off = 0; off < size && !classes.empty(); off += verify_blk_sz) {
+    const auto len = std::min(verify_blk_sz, size - off);
+    next_classes.clear();
+    for (auto &cls : classes) {
+      parts.clear();
+      auto buf = get_buf();
+      for (const auto idx : cls) {
+        if (!read_at(fds[idx], files[idx], buf.get(), len, off)) {
+          files[idx].set_invalid();
+          continue;
+        }
+        auto part = std::find_if(parts.begin(), parts.end(), [&](auto &p) {
+          return bytes_equal(p.first.get(), buf.get(), len);
+        });
+        if (part != parts.end()) {
+          part->second.emplace_back(idx);
+        } else {
+          parts.emplace_back(std::move(buf), std::vector<uint32_t>{idx});
+          buf = get_buf();
+        }
+      }
+      free_bufs.emplace_back(std::move(buf));
+      if (parts.size() > 1) {
+        oss(std::cerr) << "[warn] content differs despite equal hash: "
+                       << files[cls[0]].path() << '\n';
+      }
+      for (auto &[part_buf, members] : parts) {
+        // singletons are settled, no need to read further
+        (members.size() > 1 ? next_classes : done)
+            .emplace_back(std::move(members));
+        free_bufs.emplace_back(std::move(part_buf));
+      }
+    }
+    classes.swap(next_classes);
+  }
+  for (const auto fd : fds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+  std::move(classes.begin(), classes.end(), std::back_inserter(done));
+  return done;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
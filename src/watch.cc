@@ -0,0 +1,364 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include "calibrate.hh"
+#include "change_src.hh"
+#include "config.hh"
+#include "dedupe.hh"
+#include "dedupe_same_sz.hh"
+#include "exclude.hh"
+#include "file_entry.hh"
+#include "file_table.hh"
+#include "hash_cache.hh"
+#include "ls_dir_rec.hh"
+#include "oss.hh"
+#include "stats.hh"
+#include "timer.hh"
+
+namespace dedupe {
+
+inline namespace detail_v1_0_0 {
+
+namespace {
+
+// listing record of a watched file
+struct file_rec_t {
+  uint64_t size = 0;
+  file_stat_t stat;
+  bool sparse = false;
+
+  inline bool operator==(const file_rec_t &rhs) const noexcept {
+    return size == rhs.size && stat.dev == rhs.stat.dev &&
+           stat.ino == rhs.stat.ino && stat.mtime_ns == rhs.stat.mtime_ns &&
+           stat.ctime_ns == rhs.stat.ctime_ns;
+  }
+};
+
+// collects groups of a round, hard links alone are not duplicates
+class collect_sink_t : public result_sink_t {
+ public:
+  std::vector<std::vector<std::filesystem::path>> groups;
+
+  void on_dupe(std::vector<std::filesystem::path> &&group) override {
+    groups.emplace_back(std::move(group));
+  }
+};
+
+}  // namespace
+
+struct watcher_t::impl_t {
+  std::vector<std::string> roots;
+  exclude_t exclude;
+  uint32_t max_thread;
+  // before cache, which is keyed by it
+  blk_sched_t blk_sched;
+  hash_cache_t cache;
+  // last cache write, merges in between stay in memory
+  std::chrono::steady_clock::time_point flushed =
+      std::chrono::steady_clock::now();
+  same_sz_ctx_t ctx;
+  std::unique_ptr<change_src_t> src;
+
+  // by path, files of a directory are a contiguous range
+  std::map<std::string, file_rec_t> files;
+  std::unordered_map<uint64_t, std::set<std::string>> by_size;
+  // sizes whose files changed since last search
+  std::set<uint64_t> touched;
+
+  mutable std::mutex mtx;
+  // duplicate groups by size, protected by mtx
+  std::unordered_map<uint64_t, std::vector<std::vector<std::filesystem::path>>>
+      groups;
+
+  impl_t(const std::vector<std::filesystem::path> &search_dir,
+         const std::vector<std::regex> &exclude_regex, const options_t &opts)
+      : exclude(opts.exclude_pattern, exclude_regex),
+        max_thread(opts.max_thread),
+        blk_sched(pick_blk_sched(opts.blk_sched, search_dir, opts.cache_path,
+                                 opts.hash_algo)),
+        cache(opts.cache_path, opts.hash_algo, blk_sched) {
+    if (!hash_algo_supported(opts.hash_algo)) {
+      throw std::invalid_argument("hash algorithm not supported by this build");
+    }
+    for (const auto &dir : search_dir) {
+      std::error_code ec;
+      auto root = std::filesystem::canonical(dir, ec);
+      if (ec) {
+        oss(std::cerr) << "[warn] skip search dir: " << dir << " - "
+                       << ec.message() << '\n';
+        continue;
+      }
+      roots.emplace_back(root.native());
+    }
+    ctx.layout = blk_layout_t(blk_sched);
+    ctx.cache = &cache;
+    ctx.io_depth = opts.io_depth;
+    ctx.verify = opts.verify;
+    ctx.extent_order = opts.extent_order;
+    ctx.sample = opts.sample;
+    ctx.hash_algo = opts.hash_algo;
+    ctx.dev_limits = opts.dev_limits;
+    // watch before scanning, so changes made while scanning are not lost
+    src = make_change_src(roots);
+  }
+
+  ~impl_t() {
+    try {
+      cache.flush();
+    } catch (const std::exception &e) {
+      oss(std::cerr) << "[warn] can't write cache: " << e.what() << '\n';
+    }
+  }
+
+  // write the cache when enough is unsaved or it was written long ago
+  void flush(const bool force) {
+    const auto now = std::chrono::steady_clock::now();
+    if (force || cache.unsaved() >= cache_flush_cnt ||
+        now - flushed >= std::chrono::seconds(cache_flush_sec)) {
+      cache.flush();
+      flushed = now;
+    }
+  }
+
+  void erase(const std::map<std::string, file_rec_t>::iterator it) {
+    const auto size = it->second.size;
+    auto &same_sz = by_size[size];
+    same_sz.erase(it->first);
+    if (same_sz.empty()) {
+      by_size.erase(size);
+    }
+    touched.emplace(size);
+    files.erase(it);
+  }
+
+  // forget path and everything under it
+  void erase_tree(const std::string &path) {
+    if (auto it = files.find(path); it != files.end()) {
+      erase(it);
+    }
+    auto it = files.lower_bound(path + '/');
+    // '0' follows '/'
+    const auto ed = files.lower_bound(path + '0');
+    while (it != ed) {
+      erase(it++);
+    }
+  }
+
+  void upsert(const std::string &path, const file_rec_t &rec) {
+    if (auto it = files.find(path); it != files.end()) {
+      if (it->second == rec) {
+        return;
+      }
+      erase(it);
+    }
+    files.emplace(path, rec);
+    by_size[rec.size].emplace(path);
+    touched.emplace(rec.size);
+  }
+
+  // path is under a root and neither it nor a directory above is excluded
+  bool wanted(const std::string &path) const {
+    for (const auto &root : roots) {
+      if (!path.starts_with(root) ||
+          (path.size() > root.size() && path[root.size()] != '/' &&
+           root != "/")) {
+        continue;
+      }
+      for (auto pos = path.find('/', root.size() + 1);
+           pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        if (exclude.match(std::string_view(path).substr(0, pos))) {
+          return false;
+        }
+      }
+      return !exclude.match(path);
+    }
+    return false;
+  }
+
+  // list dirs recursively and replace what is known under them
+  void scan(const std::vector<std::string> &dirs) {
+    file_table_t table;
+    {
+      std::mutex table_mtx;
+      stats_sum_t stats;
+      boost::asio::thread_pool pool(max_thread);
+      const ls_ctx_t ls_ctx{table, table_mtx, pool, exclude, nullptr, stats};
+      ls_roots({dirs.begin(), dirs.end()}, ls_ctx);
+      pool.join();
+    }
+    std::set<std::string> listed;
+    for (const auto &file : table.files()) {
+      auto path = table.path(file).native();
+      upsert(path, {file.size(), file.stat(), file.sparse()});
+      listed.emplace(std::move(path));
+    }
+    for (const auto &dir : dirs) {
+      auto it = files.lower_bound(dir + '/');
+      const auto ed = files.lower_bound(dir + '0');
+      while (it != ed) {
+        if (listed.contains(it->first)) {
+          ++it;
+        } else {
+          erase(it++);
+        }
+      }
+    }
+    std::string dir_path;
+    for (auto dir = 0U; dir < table.dir_cnt(); ++dir) {
+      dir_path.clear();
+      table.append_dir_path(dir, dir_path);
+      src->add_dir(dir_path);
+    }
+  }
+
+  // bring what is known about path up to date, false if not watched
+  bool apply(const std::string &path) {
+    if (!wanted(path)) {
+      return false;
+    }
+    struct statx stx {};
+    if (::statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME |
+                    STATX_CTIME | STATX_BLOCKS,
+                &stx) != 0) {
+      erase_tree(path);
+      return true;
+    }
+    if (S_ISDIR(stx.stx_mode)) {
+      scan({path});
+    } else if (S_ISREG(stx.stx_mode) && stx.stx_size > 0) {
+      file_rec_t rec;
+      rec.size = stx.stx_size;
+      rec.stat.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      rec.stat.ino = stx.stx_ino;
+      rec.stat.mtime_ns =
+          stx.stx_mtime.tv_sec * 1000000000L + stx.stx_mtime.tv_nsec;
+      rec.stat.ctime_ns =
+          stx.stx_ctime.tv_sec * 1000000000L + stx.stx_ctime.tv_nsec;
+      rec.sparse = (stx.stx_mask & STATX_BLOCKS) != 0 &&
+                   stx.stx_blocks * 512UL < stx.stx_size;
+      upsert(path, rec);
+    } else {
+      // emptied, or no longer a regular file
+      erase_tree(path);
+    }
+    return true;
+  }
+
+  // search touched sizes again, hash chains come from cache when unchanged,
+  // full when every size was touched
+  uint64_t search(const bool full) {
+    std::vector<uint64_t> sizes;
+    for (const auto size : touched) {
+      if (auto it = by_size.find(size);
+          it != by_size.end() && it->second.size() > 1) {
+        sizes.emplace_back(size);
+      }
+    }
+    // each size gets its own table, paths are split into directory and name
+    std::vector<file_table_t> tables(sizes.size());
+    for (auto i = 0UL; i < sizes.size(); ++i) {
+      for (const auto &path : by_size[sizes[i]]) {
+        const auto &rec = files.at(path);
+        const auto slash = path.rfind('/');
+        const auto name = std::string_view(path).substr(slash + 1);
+        const auto dir = tables[i].add_root(
+            slash == 0 ? "/" : std::string_view(path).substr(0, slash));
+        file_entry_t entry(dir, 0, (uint32_t)name.size(), rec.size, rec.stat,
+                           rec.sparse);
+        tables[i].append(name, {&entry, 1});
+      }
+    }
+    collect_sink_t sink;
+    result_out_t out(sink);
+    dedupe_groups(tables, out, ctx, max_thread);
+    if (!sizes.empty()) {
+      cache.merge(full);
+    }
+    flush(full);
+
+    std::lock_guard lk(mtx);
+    for (const auto size : touched) {
+      groups.erase(size);
+    }
+    for (auto &group : sink.groups) {
+      const auto size = files.at(group.front().native()).size;
+      groups[size].emplace_back(std::move(group));
+    }
+    touched.clear();
+    return sizes.size();
+  }
+};
+
+DEDUPE_EXPORT watcher_t::watcher_t(
+    const std::vector<std::filesystem::path> &search_dir,
+    const std::vector<std::regex> &exclude_regex, const options_t &opts)
+    : _impl(std::make_unique<impl_t>(search_dir, exclude_regex, opts)) {
+  timer_t timer;
+  std::cerr << "[log] list files..." << std::endl;
+  _impl->scan(_impl->roots);
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+  std::cerr << "[log] file count: " << _impl->files.size() << std::endl;
+  std::cerr << "[log] detect duplicates..." << std::endl;
+  const auto job_cnt = _impl->search(true);
+  std::cerr << "[log] job count: " << job_cnt << std::endl;
+  std::cerr << "[log] elapsed: " << timer.time().count() << "ms" << std::endl;
+}
+
+DEDUPE_EXPORT watcher_t::~watcher_t() = default;
+
+uint64_t DEDUPE_EXPORT
+watcher_t::poll(const std::chrono::milliseconds timeout) {
+  std::vector<std::string> changed;
+  if (!_impl->src->wait((int)timeout.count(), changed)) {
+    throw std::system_error(errno, std::system_category(), "watch");
+  }
+  // parents first, so a new directory is scanned before its entries
+  std::sort(changed.begin(), changed.end());
+  changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+  uint64_t applied_cnt = 0;
+  for (const auto &path : changed) {
+    applied_cnt += _impl->apply(path);
+  }
+  // fanotify also reports the rest of the filesystem
+  if (applied_cnt == 0) {
+    _impl->flush(false);
+    return 0;
+  }
+  const auto job_cnt = _impl->search(false);
+  oss(std::cerr) << "[log] changed paths: " << applied_cnt
+                 << ", size groups searched: " << job_cnt << '\n';
+  return job_cnt;
+}
+
+std::vector<std::vector<std::filesystem::path>> DEDUPE_EXPORT
+watcher_t::dupes() const {
+  std::vector<std::vector<std::filesystem::path>> ret;
+  std::lock_guard lk(_impl->mtx);
+  for (const auto &[size, size_groups] : _impl->groups) {
+    ret.insert(ret.end(), size_groups.begin(), size_groups.end());
+  }
+  return ret;
+}
+
+}  // namespace detail_v1_0_0
+
+}  // namespace dedupe
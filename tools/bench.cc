@@ -0,0 +1,414 @@
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dedupe.hh"
+
+using namespace std::literals;
+
+namespace {
+
+// shape of the synthetic tree, same seed gives the same tree
+struct gen_opts_t {
+  std::filesystem::path dir;
+  uint64_t file_cnt = 10000;
+  uint64_t dir_cnt = 500;
+  uint32_t depth = 12;
+  // files below 8 bytes may collide and break expected group counts
+  uint64_t min_size = 64;
+  uint64_t max_size = 256UL * 1024UL;
+  // fractions of files that are copies, hard links and files sharing the
+  // first prefix_kib KiB with another file, the rest is unique
+  double dup_ratio = 0.3;
+  double link_ratio = 0.05;
+  double prefix_ratio = 0.1;
+  uint64_t prefix_kib = 4;
+  uint64_t seed = 1;
+};
+
+// bytes before split come from seed, the rest from tail_seed, first word is
+// the seed itself so distinct seeds give distinct files of 8 bytes or more,
+// byte at split differs from the file the head is shared with
+struct content_t {
+  uint64_t size;
+  uint64_t seed;
+  uint64_t tail_seed;
+  uint64_t split;
+};
+
+struct tree_t {
+  uint64_t file_cnt = 0;
+  uint64_t byte_cnt = 0;
+  uint64_t dupe_groups = 0;
+  uint64_t linked_groups = 0;
+};
+
+inline uint64_t splitmix64(uint64_t x) noexcept {
+  x += 0x9e3779b97f4a7c15UL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+  return x ^ (x >> 31);
+}
+
+inline uint64_t word_at(const uint64_t seed, const uint64_t word) noexcept {
+  return word == 0 ? seed : splitmix64(seed ^ (word * 0x2545f4914f6cdd1dUL));
+}
+
+void fill(char *buf, const content_t &content, const uint64_t off,
+          const uint64_t len) {
+  for (auto i = 0UL; i < len;) {
+    const auto pos = off + i;
+    const auto seed = pos < content.split ? content.seed : content.tail_seed;
+    const auto val = word_at(seed, pos / 8);
+    const auto n = std::min(8 - pos % 8, len - i);
+    std::memcpy(buf + i, reinterpret_cast<const char *>(&val) + pos % 8, n);
+    i += n;
+  }
+  if (content.split < content.size && content.split >= off &&
+      content.split < off + len) {
+    const auto val = word_at(content.seed, content.split / 8);
+    buf[content.split - off] =
+        (char)(reinterpret_cast<const char *>(&val)[content.split % 8] ^ 0x5a);
+  }
+}
+
+bool write_file(const std::filesystem::path &path, const content_t &content,
+                char *buf, const uint64_t buf_len) {
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                        0644);
+  if (fd < 0) {
+    return false;
+  }
+  for (uint64_t off = 0; off < content.size;) {
+    const auto len = std::min(buf_len, content.size - off);
+    fill(buf, content, off, len);
+    if (::write(fd, buf, len) != (ssize_t)len) {
+      ::close(fd);
+      return false;
+    }
+    off += len;
+  }
+  return ::close(fd) == 0;
+}
+
+/**
+ * @brief generate tree under opts.dir, which must not exist
+ *
+ * @return shape of generated tree and expected results
+ */
+tree_t gen_tree(const gen_opts_t &opts) {
+  std::mt19937_64 rng(opts.seed);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  // a chain of depth levels first, then random parents above depth limit
+  std::vector<std::filesystem::path> dirs{opts.dir};
+  std::vector<uint32_t> dir_depth{0};
+  std::filesystem::create_directory(opts.dir);
+  for (auto i = 1UL; i < std::max(opts.dir_cnt, 1UL); ++i) {
+    uint64_t parent = i - 1;
+    if (i > opts.depth) {
+      do {
+        parent = rng() % dirs.size();
+      } while (dir_depth[parent] >= opts.depth);
+    }
+    dirs.emplace_back(dirs[parent] / ("d" + std::to_string(i)));
+    dir_depth.emplace_back(dir_depth[parent] + 1);
+    std::filesystem::create_directory(dirs.back());
+  }
+
+  // log-uniform sizes
+  const auto log_min = std::log((double)std::max(opts.min_size, 1UL));
+  const auto log_max =
+      std::log((double)std::max(opts.max_size, opts.min_size) + 1.0);
+  auto rand_size = [&] {
+    return (uint64_t)std::exp(log_min + unit(rng) * (log_max - log_min));
+  };
+
+  tree_t tree;
+  std::vector<content_t> contents;
+  // inodes per content, names per inode
+  std::vector<uint64_t> content_inodes;
+  std::vector<std::pair<uint64_t, uint64_t>> inodes;
+  std::vector<std::filesystem::path> inode_path;
+  std::vector<uint64_t> uniques;
+  constexpr auto buf_len = 1UL << 20;
+  auto buf = std::make_unique<char[]>(buf_len);
+  for (auto i = 0UL; i < opts.file_cnt; ++i) {
+    const auto path =
+        dirs[rng() % dirs.size()] / ("f" + std::to_string(i) + ".dat");
+    const auto kind = unit(rng);
+    if (kind < opts.link_ratio && !inodes.empty()) {
+      const auto inode = rng() % inodes.size();
+      std::filesystem::create_hard_link(inode_path[inode], path);
+      ++inodes[inode].second;
+    } else {
+      uint64_t content_idx = contents.size();
+      if (kind < opts.link_ratio + opts.dup_ratio && !uniques.empty()) {
+        content_idx = uniques[rng() % uniques.size()];
+      } else if (kind < opts.link_ratio + opts.dup_ratio + opts.prefix_ratio &&
+                 !uniques.empty()) {
+        // same size and head as another file, differs after prefix, at
+        // least a word of tail keeps variants of one file apart
+        const auto &base = contents[uniques[rng() % uniques.size()]];
+        const auto split = std::min(opts.prefix_kib * 1024UL,
+                                    base.size > 8 ? base.size - 8 : 0);
+        contents.emplace_back(
+            content_t{base.size, base.seed, contents.size() + 1, split});
+        content_inodes.emplace_back(0);
+      } else {
+        const auto size = rand_size();
+        contents.emplace_back(content_t{size, contents.size() + 1, 0, size});
+        content_inodes.emplace_back(0);
+        uniques.emplace_back(content_idx);
+      }
+      if (!write_file(path, contents[content_idx], buf.get(), buf_len)) {
+        throw std::runtime_error("can't write " + path.native());
+      }
+      ++content_inodes[content_idx];
+      inodes.emplace_back(content_idx, 1);
+      inode_path.emplace_back(path);
+    }
+    ++tree.file_cnt;
+  }
+  for (const auto &[content_idx, name_cnt] : inodes) {
+    tree.byte_cnt += contents[content_idx].size * name_cnt;
+    if (content_inodes[content_idx] == 1 && name_cnt > 1) {
+      ++tree.linked_groups;
+    }
+  }
+  for (const auto cnt : content_inodes) {
+    tree.dupe_groups += cnt > 1;
+  }
+  return tree;
+}
+
+// process counters at a point in time
+struct sample_t {
+  std::chrono::steady_clock::time_point wall;
+  double cpu_ms = 0;
+  uint64_t syscr = 0;
+  uint64_t syscw = 0;
+  uint64_t rchar = 0;
+
+  static sample_t now() {
+    sample_t sample;
+    sample.wall = std::chrono::steady_clock::now();
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    sample.cpu_ms = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+                        1e3 +
+                    (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) /
+                        1e3;
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t val;
+    while (io >> key >> val) {
+      if (key == "syscr:") {
+        sample.syscr = val;
+      } else if (key == "syscw:") {
+        sample.syscw = val;
+      } else if (key == "rchar:") {
+        sample.rchar = val;
+      }
+    }
+    return sample;
+  }
+};
+
+constexpr std::array<std::string_view, 4> phase_name = {"list", "sort", "hash",
+                                                        "save"};
+
+// counts groups and samples counters at phase boundaries
+class bench_sink_t : public dedupe::result_sink_t {
+  std::array<sample_t, 4> _start;
+  std::array<sample_t, 4> _end;
+  std::array<bool, 4> _ran = {};
+
+ public:
+  uint64_t dupe_cnt = 0;
+  uint64_t linked_cnt = 0;
+
+  void on_dupe(std::vector<std::filesystem::path> &&) override { ++dupe_cnt; }
+  void on_linked(std::vector<std::filesystem::path> &&) override {
+    ++linked_cnt;
+  }
+  void on_phase_start(dedupe::phase_t phase) override {
+    _start[(std::size_t)phase] = sample_t::now();
+  }
+  void on_phase_end(dedupe::phase_t phase) override {
+    _end[(std::size_t)phase] = sample_t::now();
+    _ran[(std::size_t)phase] = true;
+  }
+
+  // phases as json array
+  void print_phases(std::ostream &os, const tree_t &tree) const {
+    os << '[';
+    bool first = true;
+    for (auto i = 0UL; i < phase_name.size(); ++i) {
+      if (!_ran[i]) {
+        continue;
+      }
+      const auto &st = _start[i];
+      const auto &ed = _end[i];
+      const auto wall_ms =
+          std::chrono::duration<double, std::milli>(ed.wall - st.wall).count();
+      const auto sec = std::max(wall_ms / 1e3, 1e-9);
+      const auto read_bytes = ed.rchar - st.rchar;
+      os << (first ? "" : ",") << "{\"phase\":\"" << phase_name[i]
+         << "\",\"wall_ms\":" << wall_ms
+         << ",\"cpu_ms\":" << ed.cpu_ms - st.cpu_ms
+         << ",\"read_syscalls\":" << ed.syscr - st.syscr
+         << ",\"write_syscalls\":" << ed.syscw - st.syscw
+         << ",\"read_bytes\":" << read_bytes
+         << ",\"files_per_sec\":" << (double)tree.file_cnt / sec
+         << ",\"read_mib_per_sec\":"
+         << (double)read_bytes / (1024.0 * 1024.0) / sec << '}';
+      first = false;
+    }
+    os << ']';
+  }
+};
+
+std::filesystem::path default_dir() {
+  std::error_code ec;
+  if (std::filesystem::is_directory("/dev/shm", ec)) {
+    return "/dev/shm/dedupe_bench";
+  }
+  return std::filesystem::temp_directory_path() / "dedupe_bench";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  gen_opts_t gen;
+  gen.dir = default_dir();
+  dedupe::options_t opts;
+  uint32_t run_cnt = 3;
+  bool keep = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument("missing value of " + std::string(arg));
+      }
+      return argv[++i];
+    };
+    try {
+      if (arg == "--dir") {
+        gen.dir = next();
+      } else if (arg == "--files") {
+        gen.file_cnt = std::stoull(next());
+      } else if (arg == "--dirs") {
+        gen.dir_cnt = std::stoull(next());
+      } else if (arg == "--depth") {
+        gen.depth = (uint32_t)std::stoul(next());
+      } else if (arg == "--min-size") {
+        gen.min_size = std::stoull(next());
+      } else if (arg == "--max-size") {
+        gen.max_size = std::stoull(next());
+      } else if (arg == "--dup-ratio") {
+        gen.dup_ratio = std::stod(next());
+      } else if (arg == "--link-ratio") {
+        gen.link_ratio = std::stod(next());
+      } else if (arg == "--prefix-ratio") {
+        gen.prefix_ratio = std::stod(next());
+      } else if (arg == "--prefix-kib") {
+        gen.prefix_kib = std::stoull(next());
+      } else if (arg == "--seed") {
+        gen.seed = std::stoull(next());
+      } else if (arg == "--runs") {
+        run_cnt = (uint32_t)std::stoul(next());
+      } else if (arg == "-j") {
+        opts.max_thread = std::max((uint32_t)std::stoul(next()), 1U);
+      } else if (arg == "--io-depth") {
+        opts.io_depth = (uint32_t)std::stoul(next());
+      } else if (arg == "--cache") {
+        opts.cache_path = next();
+      } else if (arg == "--pipeline") {
+        opts.pipeline = true;
+      } else if (arg == "--verify") {
+        opts.verify = true;
+      } else if (arg == "--extent-order") {
+        opts.extent_order = true;
+      } else if (arg == "--keep") {
+        keep = true;
+      } else {
+        std::cerr
+            << "usage: [--dir scratch_dir] [--files n] [--dirs n] "
+               "[--depth n] [--min-size bytes] [--max-size bytes] "
+               "[--dup-ratio r] [--link-ratio r] [--prefix-ratio r] "
+               "[--prefix-kib n] [--seed n] [--runs n] [-j jobs] "
+               "[--io-depth depth] [--cache cache_path] [--pipeline] "
+               "[--verify] [--extent-order] [--keep]"
+            << std::endl;
+        return arg == "-h" || arg == "--help" ? 0 : 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "invalid option " << arg << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  std::error_code ec;
+  if (std::filesystem::exists(gen.dir, ec)) {
+    std::cerr << "scratch dir exists: " << gen.dir << std::endl;
+    return 1;
+  }
+  tree_t tree;
+  const auto gen_st = std::chrono::steady_clock::now();
+  try {
+    tree = gen_tree(gen);
+  } catch (const std::exception &e) {
+    std::cerr << "generate tree failed: " << e.what() << std::endl;
+    std::filesystem::remove_all(gen.dir, ec);
+    return 1;
+  }
+  const auto gen_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - gen_st)
+                          .count();
+
+  bool match = true;
+  for (auto run = 0U; run < run_cnt; ++run) {
+    bench_sink_t sink;
+    dedupe::dedupe({gen.dir}, {}, opts, sink);
+    match = match && sink.dupe_cnt == tree.dupe_groups &&
+            sink.linked_cnt == tree.linked_groups;
+    // one json object per run
+    std::cout << "{\"run\":" << run << ",\"seed\":" << gen.seed
+              << ",\"files\":" << tree.file_cnt << ",\"bytes\":"
+              << tree.byte_cnt << ",\"gen_ms\":" << gen_ms
+              << ",\"threads\":" << opts.max_thread
+              << ",\"dupe_groups\":" << sink.dupe_cnt
+              << ",\"expected_dupe_groups\":" << tree.dupe_groups
+              << ",\"linked_groups\":" << sink.linked_cnt
+              << ",\"expected_linked_groups\":" << tree.linked_groups
+              << ",\"phases\":";
+    sink.print_phases(std::cout, tree);
+    std::cout << '}' << std::endl;
+  }
+
+  if (!keep) {
+    std::filesystem::remove_all(gen.dir, ec);
+  }
+  if (!match) {
+    std::cerr << "group count differs from generated tree" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,73 +1,617 @@
-#include <filesystem>
-#include <iostream>
-#include <regex>
-#include <string>
-#include <string_view>
-#include <vector>
-
-#include "dedupe.hh"
-
-using namespace std::literals;
-
-int main(int argc, char* argv[]) {
-  std::vector<std::filesystem::path> search_dir;
-  std::vector<std::regex> exclude_regex;
-  uint32_t max_thread = 8;
-  bool print_out = false;
-
-  for (int i = 1; i < argc; ++i) {
-    if (argv[i] == "-i"sv) {
-      ++i;
-      if (i >= argc) {
-        std::cerr << "missing search_dir" << std::endl;
-        return 1;
-      }
-      search_dir.emplace_back(argv[i]);
-    } else if (argv[i] == "-e"sv) {
-      ++i;
-      if (i >= argc) {
-        std::cerr << "missing exclude_regex" << std::endl;
-        return 1;
-      }
-      // exclude_regex.emplace_back(argv[i]);
-      try {
-        exclude_regex.emplace_back(argv[i]);
-      } catch (const std::regex_error& e) {
-        std::cerr << "invalid exclude_regex: " << argv[i] << std::endl;
-        return 1;
-      }
-    } else if (argv[i] == "-j"sv) {
-      ++i;
-      if (i >= argc) {
-        std::cerr << "missing max_thread" << std::endl;
-        return 1;
-      }
-      max_thread = (uint32_t)std::stoi(argv[i]);
-      if (max_thread == 0 || max_thread > 256) {
-        std::cerr << "jobs must be > 0 and <= 256" << std::endl;
-        return 1;
-      }
-    } else if (argv[i] == "-p"sv || argv[i] == "--print"sv) {
-      print_out = true;
-    } else if (argv[i] == "-h"sv || argv[i] == "--help"sv) {
-      std::cerr << "usage: [-i search_dir] [-e exclude_regex] [-j jobs] "
-                   "[-p/--print] [-h/--help]"
-                << std::endl;
-      return 0;
-    } else {
-      std::cerr << "unknown option: " << argv[i] << std::endl;
-      return 1;
-    }
-  }
-
-  auto dupe_list = dedupe::dedupe(search_dir, exclude_regex, max_thread);
-  if (print_out) {
-    for (auto& dupe : dupe_list) {
-      std::cout << "----\n";
-      for (auto& file : dupe) {
-        std::cout << file << '\n';
-      }
-    }
-    std::cout << "----\n";
-  }
-}
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dedupe.hh"
+
+using namespace std::literals;
+
+// array up to last non-zero entry
+template <typename T, std::size_t N>
+void print_array(std::ostream& os, const std::array<T, N>& arr) {
+  auto len = N;
+  while (len > 0 && arr[len - 1] == 0) {
+    --len;
+  }
+  os << '[';
+  for (auto i = 0UL; i < len; ++i) {
+    os << (i == 0 ? "" : ",") << arr[i];
+  }
+  os << ']';
+}
+
+void print_stats(std::ostream& os, const dedupe::stats_t& stats) {
+  constexpr std::array phase_name = {"list", "sort", "hash", "save"};
+  os << "{\"phase_time\":{";
+  for (auto i = 0UL; i < phase_name.size(); ++i) {
+    os << (i == 0 ? "" : ",") << '"' << phase_name[i]
+       << "\":{\"wall_ms\":" << stats.phase_time[i].wall_ms
+       << ",\"cpu_ms\":" << stats.phase_time[i].cpu_ms << '}';
+  }
+  os << "},\"file_cnt\":" << stats.file_cnt
+     << ",\"dir_cnt\":" << stats.dir_cnt
+     << ",\"excluded_cnt\":" << stats.excluded_cnt
+     << ",\"skipped_cnt\":" << stats.skipped_cnt
+     << ",\"list_error_cnt\":" << stats.list_error_cnt
+     << ",\"max_list_queue\":" << stats.max_list_queue
+     << ",\"blk_hashed\":";
+  print_array(os, stats.blk_hashed);
+  os << ",\"bytes_read\":";
+  print_array(os, stats.bytes_read);
+  os << ",\"eliminated\":";
+  print_array(os, stats.eliminated);
+  os << ",\"files_opened\":" << stats.files_opened
+     << ",\"read_error_cnt\":" << stats.read_error_cnt
+     << ",\"verify_split_cnt\":" << stats.verify_split_cnt
+     << ",\"sample_hashed\":" << stats.sample_hashed
+     << ",\"sample_bytes_read\":" << stats.sample_bytes_read
+     << ",\"sample_eliminated\":" << stats.sample_eliminated
+     << ",\"sample_bytes_skipped\":" << stats.sample_bytes_skipped
+     << ",\"group_cnt\":" << stats.group_cnt
+     << ",\"group_us_total\":" << stats.group_us_total
+     << ",\"group_us_max\":" << stats.group_us_max
+     << ",\"group_us_hist\":";
+  print_array(os, stats.group_us_hist);
+  os << ",\"max_hash_queue\":" << stats.max_hash_queue
+     << ",\"oversized_cnt\":" << stats.oversized_cnt
+     << ",\"dupe_cnt\":" << stats.dupe_cnt
+     << ",\"linked_cnt\":" << stats.linked_cnt << "}\n";
+}
+
+// prints groups as they are found
+class print_sink_t : public dedupe::result_sink_t {
+  bool _print_dupe;
+  bool _print_linked;
+  bool _keep_dupe;
+
+ public:
+  dedupe::stats_t stats;
+  // kept for link_dupes
+  std::vector<std::vector<std::filesystem::path>> dupe_list;
+
+  print_sink_t(bool print_dupe, bool print_linked, bool keep_dupe)
+      : _print_dupe(print_dupe),
+        _print_linked(print_linked),
+        _keep_dupe(keep_dupe) {}
+
+  void on_dupe(std::vector<std::filesystem::path>&& group) override {
+    if (_print_dupe) {
+      std::cout << "----\n";
+      for (auto& file : group) {
+        std::cout << file << '\n';
+      }
+    }
+    if (_keep_dupe) {
+      dupe_list.emplace_back(std::move(group));
+    }
+  }
+  void on_linked(std::vector<std::filesystem::path>&& group) override {
+    if (_print_linked) {
+      std::cout << "====\n";
+      for (auto& file : group) {
+        std::cout << file << '\n';
+      }
+    }
+  }
+  void on_stats(const dedupe::stats_t& stats) override { this->stats = stats; }
+};
+
+// prints pairs and repeated chunks of chunk mode
+class chunk_print_sink_t : public dedupe::chunk_sink_t {
+  bool _print;
+
+ public:
+  explicit chunk_print_sink_t(bool print) : _print(print) {}
+
+  void on_pair(dedupe::shared_pair_t&& pair) override {
+    if (_print) {
+      std::cout << "++++ " << pair.shared << '\n'
+                << pair.lhs << ' ' << pair.lhs_size << '\n'
+                << pair.rhs << ' ' << pair.rhs_size << '\n';
+    }
+  }
+  void on_chunk(uint32_t len,
+                std::vector<dedupe::chunk_loc_t>&& locs) override {
+    if (_print) {
+      std::cout << "#### " << len << '\n';
+      for (auto& loc : locs) {
+        std::cout << loc.path << ' ' << loc.off << '\n';
+      }
+    }
+  }
+};
+
+// concatenate partial outputs of -p and --print-linked, terminators of
+// each are replaced by one of each kind at the end
+bool merge_results(const std::vector<std::filesystem::path>& results) {
+  bool dupe_end = false;
+  bool linked_end = false;
+  for (const auto& path : results) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+      std::cerr << "can't read result: " << path << std::endl;
+      return false;
+    }
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(ifs, line);) {
+      lines.emplace_back(std::move(line));
+    }
+    while (!lines.empty() &&
+           (lines.back() == "----" || lines.back() == "====")) {
+      (lines.back() == "----" ? dupe_end : linked_end) = true;
+      lines.pop_back();
+    }
+    for (const auto& line : lines) {
+      std::cout << line << '\n';
+    }
+  }
+  if (dupe_end) {
+    std::cout << "----\n";
+  }
+  if (linked_end) {
+    std::cout << "====\n";
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<std::filesystem::path> search_dir;
+  std::vector<std::regex> exclude_regex;
+  dedupe::options_t opts;
+  opts.max_thread = 8;
+  bool print_out = false;
+  bool print_linked = false;
+  std::filesystem::path stats_path;
+  bool link = false;
+  dedupe::link_opts_t link_opts;
+  bool watch = false;
+  bool chunk = false;
+  dedupe::chunk_opts_t chunk_opts;
+  std::vector<std::filesystem::path> tables;
+  std::filesystem::path write_table;
+  uint32_t part_cnt = 1;
+  dedupe::size_range_t size_range;
+  std::vector<std::filesystem::path> results;
+
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == "-i"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing search_dir" << std::endl;
+        return 1;
+      }
+      search_dir.emplace_back(argv[i]);
+    } else if (argv[i] == "-e"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing exclude_regex" << std::endl;
+        return 1;
+      }
+      try {
+        [[maybe_unused]] std::regex regex(argv[i]);
+        opts.exclude_pattern.emplace_back(argv[i]);
+      } catch (const std::regex_error& e) {
+        std::cerr << "invalid exclude_regex: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "-j"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing max_thread" << std::endl;
+        return 1;
+      }
+      opts.max_thread = (uint32_t)std::stoi(argv[i]);
+      if (opts.max_thread == 0 || opts.max_thread > 256) {
+        std::cerr << "jobs must be > 0 and <= 256" << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--cache"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing cache_path" << std::endl;
+        return 1;
+      }
+      opts.cache_path = argv[i];
+    } else if (argv[i] == "--io-depth"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing io_depth" << std::endl;
+        return 1;
+      }
+      opts.io_depth = (uint32_t)std::stoi(argv[i]);
+      if (opts.io_depth > 4096) {
+        std::cerr << "io_depth must be <= 4096" << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--pipeline"sv) {
+      opts.pipeline = true;
+    } else if (argv[i] == "--verify"sv) {
+      opts.verify = true;
+    } else if (argv[i] == "--extent-order"sv) {
+      opts.extent_order = true;
+    } else if (argv[i] == "--sample"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing sample_min_size" << std::endl;
+        return 1;
+      }
+      opts.sample.min_size = std::stoull(argv[i]);
+    } else if (argv[i] == "--sample-len"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing sample_len" << std::endl;
+        return 1;
+      }
+      opts.sample.len = (uint32_t)std::stoul(argv[i]);
+    } else if (argv[i] == "--sample-at"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing sample_points" << std::endl;
+        return 1;
+      }
+      // comma separated per-mille of size
+      opts.sample.points.clear();
+      std::string_view points = argv[i];
+      while (!points.empty()) {
+        const auto comma = std::min(points.find(','), points.size());
+        const auto point = std::stoul(std::string(points.substr(0, comma)));
+        if (point > 1000) {
+          std::cerr << "sample points must be in [0, 1000]" << std::endl;
+          return 1;
+        }
+        opts.sample.points.emplace_back((uint32_t)point);
+        points.remove_prefix(std::min(comma + 1, points.size()));
+      }
+    } else if (argv[i] == "--hash"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing hash_algo" << std::endl;
+        return 1;
+      }
+      if (argv[i] == "xxh128"sv) {
+        opts.hash_algo = dedupe::hash_algo_t::xxh128;
+      } else if (argv[i] == "xxh64"sv) {
+        opts.hash_algo = dedupe::hash_algo_t::xxh64_early;
+      } else if (argv[i] == "blake3"sv) {
+        opts.hash_algo = dedupe::hash_algo_t::blake3;
+      } else {
+        std::cerr << "unknown hash_algo: " << argv[i] << std::endl;
+        return 1;
+      }
+      if (!dedupe::hash_algo_supported(opts.hash_algo)) {
+        std::cerr << "built without " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--blk-sched"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing blk_sched" << std::endl;
+        return 1;
+      }
+      // auto, or first_blk,growth,max_blk
+      if (argv[i] == "auto"sv) {
+        opts.blk_sched.auto_calibrate = true;
+      } else {
+        std::string_view sched = argv[i];
+        std::vector<uint64_t> fields;
+        while (!sched.empty()) {
+          const auto comma = std::min(sched.find(','), sched.size());
+          fields.emplace_back(std::stoull(std::string(sched.substr(0, comma))));
+          sched.remove_prefix(std::min(comma + 1, sched.size()));
+        }
+        if (fields.size() != 3 || fields[0] == 0 || fields[1] < 2 ||
+            fields[1] > 1024 ||
+            (fields[2] != 0 &&
+             fields[2] < std::max<uint64_t>(fields[0], 1UL << 20U))) {
+          std::cerr << "blk_sched must be first,growth,cap with first > 0, "
+                       "growth in [2, 1024] and cap 0 or >= max(first, 1MiB)"
+                    << std::endl;
+          return 1;
+        }
+        opts.blk_sched.first_blk = fields[0];
+        opts.blk_sched.growth = (uint32_t)fields[1];
+        opts.blk_sched.max_blk = fields[2];
+      }
+    } else if (argv[i] == "--dev-jobs"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing dev_jobs" << std::endl;
+        return 1;
+      }
+      // rotational,solid
+      const std::string_view jobs = argv[i];
+      const auto comma = jobs.find(',');
+      if (comma == std::string_view::npos) {
+        std::cerr << "dev_jobs must be rotational,solid" << std::endl;
+        return 1;
+      }
+      opts.dev_limits.rotational =
+          (uint32_t)std::stoul(std::string(jobs.substr(0, comma)));
+      opts.dev_limits.solid =
+          (uint32_t)std::stoul(std::string(jobs.substr(comma + 1)));
+    } else if (argv[i] == "--dev-limit"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing dev_limit" << std::endl;
+        return 1;
+      }
+      // path=jobs, path may contain '='
+      const std::string_view limit = argv[i];
+      const auto eq = limit.rfind('=');
+      if (eq == std::string_view::npos || eq == 0) {
+        std::cerr << "dev_limit must be path=jobs" << std::endl;
+        return 1;
+      }
+      opts.dev_limits.per_path.emplace_back(
+          std::string(limit.substr(0, eq)),
+          (uint32_t)std::stoul(std::string(limit.substr(eq + 1))));
+    } else if (argv[i] == "--mem-limit"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing mem_limit" << std::endl;
+        return 1;
+      }
+      // bytes, with an optional K, M or G suffix
+      std::size_t used = 0;
+      opts.mem_limit = std::stoull(argv[i], &used);
+      const std::string_view suffix = argv[i] + used;
+      if (suffix == "K"sv) {
+        opts.mem_limit <<= 10U;
+      } else if (suffix == "M"sv) {
+        opts.mem_limit <<= 20U;
+      } else if (suffix == "G"sv) {
+        opts.mem_limit <<= 30U;
+      } else if (!suffix.empty()) {
+        std::cerr << "mem_limit must be bytes with K, M or G" << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--tmp-dir"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing tmp_dir" << std::endl;
+        return 1;
+      }
+      opts.tmp_dir = argv[i];
+    } else if (argv[i] == "--stats-json"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing stats_path" << std::endl;
+        return 1;
+      }
+      stats_path = argv[i];
+    } else if (argv[i] == "--link"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing link_mode" << std::endl;
+        return 1;
+      }
+      link = true;
+      if (argv[i] == "reflink"sv) {
+        link_opts.mode = dedupe::link_mode_t::reflink;
+      } else if (argv[i] == "hardlink"sv) {
+        link_opts.mode = dedupe::link_mode_t::hardlink;
+      } else if (argv[i] == "auto"sv) {
+        link_opts.mode = dedupe::link_mode_t::reflink_or_hardlink;
+      } else {
+        std::cerr << "link_mode must be reflink, hardlink or auto"
+                  << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--keeper"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing keeper" << std::endl;
+        return 1;
+      }
+      if (argv[i] == "oldest"sv) {
+        link_opts.keeper = dedupe::keeper_t::oldest;
+      } else if (argv[i] == "shortest"sv) {
+        link_opts.keeper = dedupe::keeper_t::shortest_path;
+      } else if (argv[i] == "preferred"sv) {
+        link_opts.keeper = dedupe::keeper_t::preferred;
+      } else {
+        std::cerr << "keeper must be oldest, shortest or preferred"
+                  << std::endl;
+        return 1;
+      }
+    } else if (argv[i] == "--prefer"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing preferred_dir" << std::endl;
+        return 1;
+      }
+      link_opts.preferred_dir = argv[i];
+    } else if (argv[i] == "--watch"sv) {
+      watch = true;
+    } else if (argv[i] == "--chunk"sv) {
+      chunk = true;
+    } else if (argv[i] == "--chunk-avg"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing chunk_avg" << std::endl;
+        return 1;
+      }
+      const auto avg = std::stoul(argv[i]);
+      if (avg < 256 || avg > 1024 * 1024 || (avg & (avg - 1)) != 0) {
+        std::cerr << "chunk_avg must be a power of 2 in [256, 1048576]"
+                  << std::endl;
+        return 1;
+      }
+      chunk_opts.avg_chunk = (uint32_t)avg;
+      chunk_opts.min_chunk = (uint32_t)avg / 4;
+      chunk_opts.max_chunk = (uint32_t)avg * 8;
+    } else if (argv[i] == "--chunk-map"sv) {
+      chunk_opts.chunk_map = true;
+    } else if (argv[i] == "--min-shared"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing min_shared" << std::endl;
+        return 1;
+      }
+      chunk_opts.min_shared = std::stoull(argv[i]);
+    } else if (argv[i] == "-t"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing table" << std::endl;
+        return 1;
+      }
+      tables.emplace_back(argv[i]);
+    } else if (argv[i] == "--write-table"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing table" << std::endl;
+        return 1;
+      }
+      write_table = argv[i];
+    } else if (argv[i] == "--parts"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing parts" << std::endl;
+        return 1;
+      }
+      part_cnt = (uint32_t)std::stoul(argv[i]);
+    } else if (argv[i] == "--size-range"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing size_range" << std::endl;
+        return 1;
+      }
+      const std::string_view range = argv[i];
+      const auto colon = range.find(':');
+      if (colon == std::string_view::npos) {
+        std::cerr << "size_range must be min:max" << std::endl;
+        return 1;
+      }
+      size_range.min = std::stoull(std::string(range.substr(0, colon)));
+      size_range.max = std::stoull(std::string(range.substr(colon + 1)));
+    } else if (argv[i] == "-r"sv) {
+      ++i;
+      if (i >= argc) {
+        std::cerr << "missing result" << std::endl;
+        return 1;
+      }
+      results.emplace_back(argv[i]);
+    } else if (argv[i] == "-p"sv || argv[i] == "--print"sv) {
+      print_out = true;
+    } else if (argv[i] == "--print-linked"sv) {
+      print_linked = true;
+    } else if (argv[i] == "-h"sv || argv[i] == "--help"sv) {
+      std::cerr << "usage: [-i search_dir] [-e exclude_regex] [-j jobs] "
+                   "[--cache cache_path] [--io-depth depth] [--pipeline] "
+                   "[--verify] [--extent-order] [--sample min_size] "
+                   "[--sample-len bytes] [--sample-at points] "
+                   "[--hash xxh128|xxh64|blake3] "
+                   "[--blk-sched auto|first,growth,cap] "
+                   "[--dev-jobs rotational,solid] [--dev-limit path=jobs] "
+                   "[--mem-limit bytes] [--tmp-dir tmp_dir] "
+                   "[--stats-json stats_path] "
+                   "[--link reflink|hardlink|auto] "
+                   "[--keeper oldest|shortest|preferred] "
+                   "[--prefer preferred_dir] [--watch] [--chunk] "
+                   "[--chunk-avg bytes] "
+                   "[--chunk-map] [--min-shared bytes] [-t table] "
+                   "[--write-table table_path] [--parts n] "
+                   "[--size-range min:max] [-r result] [-p/--print] "
+                   "[--print-linked] [-h/--help]"
+                << std::endl;
+      return 0;
+    } else {
+      std::cerr << "unknown option: " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  if (link_opts.keeper == dedupe::keeper_t::preferred &&
+      link_opts.preferred_dir.empty()) {
+    std::cerr << "--keeper preferred needs --prefer" << std::endl;
+    return 1;
+  }
+
+  if (!results.empty()) {
+    return merge_results(results) ? 0 : 1;
+  }
+
+  if (!write_table.empty()) {
+    if (tables.empty()) {
+      dedupe::list_table(search_dir, exclude_regex, opts, write_table);
+      return 0;
+    }
+    // one line per worker
+    for (const auto& range : dedupe::merge_tables(tables, write_table,
+                                                  part_cnt)) {
+      std::cout << range.min << ' ' << range.max << '\n';
+    }
+    return 0;
+  }
+  if (tables.size() > 1) {
+    std::cerr << "merge tables with --write-table first" << std::endl;
+    return 1;
+  }
+
+  if (chunk) {
+    chunk_opts.max_thread = opts.max_thread;
+    chunk_opts.exclude_pattern = opts.exclude_pattern;
+    chunk_print_sink_t chunk_sink(print_out);
+    dedupe::chunk_dupes(search_dir, exclude_regex, chunk_opts, chunk_sink);
+    return 0;
+  }
+
+  if (watch) {
+    dedupe::watcher_t watcher(search_dir, exclude_regex, opts);
+    while (true) {
+      if (print_out) {
+        for (const auto& group : watcher.dupes()) {
+          std::cout << "----\n";
+          for (const auto& file : group) {
+            std::cout << file << '\n';
+          }
+        }
+        std::cout << "----" << std::endl;
+      }
+      while (watcher.poll(std::chrono::seconds(1)) == 0) {
+      }
+    }
+  }
+
+  print_sink_t sink(print_out, print_linked, link);
+  try {
+    if (!tables.empty()) {
+      dedupe::dedupe_table(tables.front(), size_range, opts, sink);
+    } else {
+      dedupe::dedupe(search_dir, exclude_regex, opts, sink);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "search failed: " << e.what() << std::endl;
+    return 1;
+  }
+  if (print_out) {
+    std::cout << "----\n";
+  }
+  if (print_linked) {
+    std::cout << "====\n";
+  }
+  if (link) {
+    link_opts.max_thread = opts.max_thread;
+    const auto res = dedupe::link_dupes(sink.dupe_list, link_opts);
+    std::cerr << "[log] linked " << res.linked_cnt << " files ("
+              << res.byte_cnt << " bytes), " << res.skipped_cnt
+              << " already linked, " << res.failed_cnt << " failed"
+              << std::endl;
+  }
+  if (stats_path == "-") {
+    print_stats(std::cout, sink.stats);
+  } else if (!stats_path.empty()) {
+    std::ofstream stats_file(stats_path);
+    print_stats(stats_file, sink.stats);
+    if (!stats_file) {
+      std::cerr << "can't write stats: " << stats_path << std::endl;
+      return 1;
+    }
+  }
+}
@@ -0,0 +1,116 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "exclude.hh"
+
+using namespace std::literals;
+
+// compares exclude_t against matching each std::regex in turn, the way
+// listing did before, on synthetic paths
+int main(int argc, char* argv[]) {
+  uint64_t path_cnt = 200000;
+  std::vector<std::string> patterns;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == "-n"sv && i + 1 < argc) {
+      path_cnt = std::stoull(argv[++i]);
+    } else if (argv[i] == "-e"sv && i + 1 < argc) {
+      patterns.emplace_back(argv[++i]);
+    } else {
+      std::cerr << "usage: [-n path_count] [-e exclude_regex]..." << std::endl;
+      return argv[i] == "-h"sv ? 0 : 1;
+    }
+  }
+  if (patterns.empty()) {
+    // typical exclude list, literal forms and a few real regexes
+    for (auto ext : {"tmp", "swp", "o", "a", "so", "pyc", "class", "log", "bak",
+                     "cache", "lock", "part", "crdownload", "DS_Store"}) {
+      patterns.emplace_back(".*\\."s + ext);
+    }
+    for (auto name : {"node_modules", "\\.git", "\\.svn", "\\.hg",
+                      "__pycache__", "\\.venv", "target", "build", "\\.idea",
+                      "\\.vscode", "Thumbs\\.db", "\\.Trash-1000"}) {
+      patterns.emplace_back(".*/"s + name);
+    }
+    patterns.insert(
+        patterns.end(),
+        {"/proc/.*", "/sys/.*", "/dev/.*", "/run/.*", ".*/\\.cache/.*",
+         ".*/snapshots/.*", ".*~", ".*\\.tar\\.gz", ".*/core\\.[0-9]+",
+         ".*/[Tt]emp", ".*\\.sw[a-p]", ".*/\\.#.*", ".*/backup-[0-9]{8}",
+         ".*\\.(orig|rej)"});
+  }
+
+  // synthetic tree paths
+  std::mt19937_64 rng(0x5eed);
+  const std::vector<std::string> dirs = {
+      "home", "user", "src", "project", "lib", "include", "docs", "photos",
+      "2023", "2024", "music", "build", "node_modules", ".git", "assets",
+      "data", "archive", "backup-20240101", "Temp", ".cache"};
+  const std::vector<std::string> exts = {
+      ".cc", ".hh", ".txt", ".jpg", ".png", ".mp3", ".o", ".tmp", ".pdf",
+      ".json", ".tar.gz", ".md", ".log", "", ".rej", ".swp"};
+  std::vector<std::string> paths;
+  paths.reserve(path_cnt);
+  for (auto i = 0UL; i < path_cnt; ++i) {
+    std::string path = "/data";
+    const auto depth = 2 + rng() % 7;
+    for (auto d = 0UL; d < depth; ++d) {
+      path += '/';
+      path += dirs[rng() % dirs.size()];
+    }
+    path += "/file_" + std::to_string(rng() % 100000);
+    path += exts[rng() % exts.size()];
+    paths.emplace_back(std::move(path));
+  }
+  // search roots are matched as given, relative ones may have no slash
+  paths.insert(paths.end(), {"node_modules", "build", ".git", "a.tmp", "Temp",
+                             "src/node_modules", "./build", "/", ""});
+
+  auto time = [](auto&& fn) {
+    const auto st = std::chrono::steady_clock::now();
+    const auto ret = fn();
+    const auto ed = std::chrono::steady_clock::now();
+    return std::pair(
+        ret, std::chrono::duration<double, std::milli>(ed - st).count());
+  };
+
+  std::vector<char> base_hit(paths.size());
+  const auto [base_cnt, base_ms] = time([&] {
+    std::vector<std::regex> regexes(patterns.begin(), patterns.end());
+    uint64_t cnt = 0;
+    for (auto i = 0UL; i < paths.size(); ++i) {
+      for (const auto& regex : regexes) {
+        if (std::regex_match(paths[i], regex)) {
+          base_hit[i] = 1;
+          ++cnt;
+          break;
+        }
+      }
+    }
+    return cnt;
+  });
+  uint64_t mismatch = 0;
+  const auto [cnt, ms] = time([&] {
+    const dedupe::exclude_t exclude(patterns, {});
+    uint64_t cnt = 0;
+    for (auto i = 0UL; i < paths.size(); ++i) {
+      const bool hit = exclude.match(paths[i]);
+      cnt += hit;
+      mismatch += hit != (bool)base_hit[i];
+    }
+    return cnt;
+  });
+
+  std::cout << "paths " << paths.size() << '\n'
+            << "patterns " << patterns.size() << '\n'
+            << "regex_loop_ms " << base_ms << '\n'
+            << "regex_loop_excluded " << base_cnt << '\n'
+            << "exclude_ms " << ms << '\n'
+            << "exclude_excluded " << cnt << '\n'
+            << "mismatch " << mismatch << std::endl;
+  return mismatch == 0 ? 0 : 1;
+}